@@ -5,8 +5,31 @@
 //  - Choose an output container format (mp4, mkv, avi, mov)
 //  - Either remux (stream copy) or re-encode the video to H.264 (libx264)
 //  - Runs conversion in a background wxThread and updates progress/log
+//  - Estimates job duration/output size from short encoded samples before starting
+//  - One-time per-host calibration of decoder/scaler/encoder thread counts
+//  - Optional worker-process mode: jobs run in child processes reporting through shared memory
+//  - Distributed re-encode: GOP-aligned chunks encoded by local/remote chunk workers over sockets
+//  - Skips jobs whose input fingerprint and settings match an already finished job
+//  - Keyframe-only thumbnail, sprite sheet and WebVTT index generation
+//  - Optional thumbnail tap on re-encodes (interval / scene change) written by a side thread
+//  - Draft proxy mode: reduced-resolution decoding, fast downscale and ultrafast x264
+//  - Optional audio transcode (AAC/Opus via swresample + audio FIFO), one thread per track
+//  - EBU R128 loudness measured during audio transcodes; cached measurements drive normalization
+//  - Every video stream of a re-encode is transcoded, additional ones on their own workers
+//  - Stream selection rules (type/language/codec/index); dropped streams are discarded at demux
+//  - Automatic bitstream filters (mp4toannexb, aac_adtstoasc) on stream copy
+//  - MPEG-TS, WebM (VP9/Opus) and fragmented MP4 output with per-container muxer options
+//  - One remux read can feed several output containers
+//  - Remux fast path: per-stream precomputed timestamp rescaling, batched progress/cancel checks
+//  - Per-stream packet handlers resolved once into a dispatch table
+//  - Timestamp repair (overlaps, missing pts) and VFR-preserving re-encode
+//  - Interlace detection (field order, first frames) and a multithreaded yadif-style deinterlacer
+//  - HDR (PQ/HLG) to SDR BT.709 tone mapping with selectable curve; color tags passed to the encoder
+//  - 10-bit output for high-bit-depth sources; matching frames bypass the scaler
+//  - Scaler told the source matrix/range; direct (SSE2) 4:2:2 and full range to yuv420p conversions
+//  - Decoder frames from a recycled, huge-page backed buffer pool, with page fault counts logged
 // Limitations:
-//  - Audio streams are copied (stream copy) when re-encoding video.
+//  - Audio streams are copied (stream copy) unless an audio codec is chosen.
 //  - Minimal error handling; intended as a starting point.
 
 #include <wx/wx.h>
@@ -15,61 +38,226 @@
 #include <wx/thread.h>
 #include <wx/progdlg.h>
 #include <wx/checkbox.h>
+#include <wx/stdpaths.h>
+#include <wx/socket.h>
+#include <wx/spinctrl.h>
+#include <wx/dir.h>
+#include <algorithm>
+#include <cmath>
 #include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <numeric>
+#include <random>
+#include <sstream>
 #include <string>
+#include <thread>
 #include <vector>
 
+#ifdef __WXMSW__
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// SSE2 is part of x86-64; AVX2 (e.g. -march=native) adds hardware table gathers
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define HAVE_SSE2 1
+#endif
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
 extern "C" {
 #include <libavformat/avformat.h>
 #include <libavutil/avutil.h>
 #include <libavcodec/avcodec.h>
 #include <libswscale/swscale.h>
 #include <libavutil/imgutils.h>
+#include <libavutil/opt.h>
+#include <libavutil/hash.h>
+#include <libavcodec/bsf.h>
+#include <libavutil/pixdesc.h>
+#include <libavutil/audio_fifo.h>
+#include <libavutil/channel_layout.h>
+#include <libswresample/swresample.h>
 }
 
 
 class ConverterThread;
 
+// Chunk workers read the job token from this variable rather than from argv, which other local
+// users can see (ps, /proc/<pid>/cmdline).
+static const char* const kChunkTokenEnv = "WXFFMPEG_CHUNK_TOKEN";
+
+// Encoder settings used by the re-encode path and by the job estimator.
+struct EncodeProfile {
+    std::string preset;          // x264 preset, empty = encoder default
+    std::string video_encoder;   // empty = libx264; set to "libvpx-vp9" for webm output
+    int64_t bit_rate = 800000;   // 800kbps default; adjust as needed
+    int dec_threads = 0;         // decoder thread_count, 0 = host calibration or libavcodec default
+    bool frame_pool = true;      // decoded frames from a recycled, huge-page backed FramePool instead of libavcodec's allocator
+    int sws_threads = 0;         // swscale slice threads, 0 = host calibration or single-threaded
+    int enc_threads = 0;         // x264 threads, 0 = host calibration or x264 auto
+    int chunk_workers = 2;       // local chunk worker processes in distributed mode
+    bool remote_workers = false; // distributed mode also accepts workers from other hosts (else loopback only)
+    bool chunk_cache = true;     // reuse previously encoded chunks (content-addressed cache)
+    bool dedup = true;           // short-circuit jobs identical to a finished one
+    int fingerprint_keyframes = 0; // also hash the first N video keyframes into the input fingerprint
+    int thumb_count = 16;        // thumbnails per input (evenly spaced)
+    int thumb_width = 160;       // thumbnail width in pixels, height follows the display aspect
+    int thumb_columns = 4;       // sprite sheet columns
+    bool thumb_png = false;      // PNG instead of JPEG
+    bool thumb_tap = false;      // also write thumbnails from the frames a re-encode decodes
+    double thumb_tap_interval = 10.0; // seconds between tapped thumbnails
+    int thumb_scene_threshold = 30;   // mean luma difference (0-255) counted as a scene change; 0 = off
+    bool draft = false;          // low-resolution proxy: lowres/skip decoding, ultrafast x264
+    int bit_depth = 0;           // encoder bit depth: 8, 10, or 0 = 10 for high-bit-depth sources (drafts stay 8-bit)
+    bool cfr = false;            // constant frame rate output (1/framerate time base); default keeps source timing (VFR)
+    int deinterlace = -1;        // -1 = detect (field order, then frames), 0 = off, 1 = always
+    bool top_field_first = true; // field order when deinterlace = 1 is passed to chunk workers
+    std::string tonemap;         // HDR (PQ/HLG) sources: "hable" (empty), "reinhard", "mobius", "clip"; "off" keeps HDR
+    int draft_height = 360;      // proxy height (never upscaled)
+    std::string stream_rules;    // stream selection, see stream_selected(); empty = all streams
+    std::string extra_formats;   // remux only: more containers written from the same read, e.g. "mkv,ts"
+    std::string audio_codec;     // empty = copy audio; otherwise encoder name ("aac", "libopus")
+    std::string fallback_audio_codec; // copy mode: encoder for tracks the container refuses (webm: "libopus")
+    int64_t audio_bit_rate = 128000;
+    int audio_sample_rate = 48000; // 0 = keep the source rate
+    int audio_channels = 2;      // 0 = keep the source channel count
+    bool loudnorm = false;       // normalize transcoded audio to loudness_target
+    double loudness_target = -23.0; // LUFS (EBU R128)
+    double true_peak_limit = -1.0;  // dBTP; loudnorm never raises a track's true peak above this
+    // container options, see container_options(); set from the "Mux options" field (parse_mux_options())
+    int mkv_cues_kb = 0;         // mkv/webm: space reserved after the header for the cues, 0 = cues at the end
+    int64_t ts_muxrate = 0;      // mpegts: constant mux rate in bit/s, 0 = VBR
+    int ts_pcr_period_ms = 0;    // mpegts: PCR interval, 0 = muxer default
+    int frag_duration_ms = 0;    // fragmented mp4: longest fragment, 0 = one fragment per keyframe
+};
+
+enum class JobMode {
+    Convert,
+    Estimate,
+    Calibrate,
+    Distributed,
+    Thumbnails
+};
+
+static bool tonemap_wanted(const AVCodecContext* dec_ctx, const EncodeProfile& prof);
+static bool have_thread_calibration();
+static void apply_thread_calibration(EncodeProfile* prof);
+static bool parse_mux_options(const std::string& text, EncodeProfile* prof, std::string* bad);
+
+class SharedMemory;
+struct WorkerStatusBlock;
+static void worker_log(WorkerStatusBlock* st, const std::string& s);
+static void worker_set_progress(WorkerStatusBlock* st, int pct);
+static bool worker_cancelled(WorkerStatusBlock* st);
+static void worker_set_finished(WorkerStatusBlock* st, int role);
+
 class MainFrame : public wxFrame {
 public:
     MainFrame();
     ~MainFrame();
     void setRunning(bool value) { m_running.store(value); }
+    void CalibrateIfNeeded();
+    void OnWorkerExit(int pid, int status);
+    void AbandonWorkers();
 
 private:
     void OnOpen(wxCommandEvent&);
     void OnStart(wxCommandEvent&);
+    void OnEstimate(wxCommandEvent&);
+    void OnThumbnails(wxCommandEvent&);
     void OnClose(wxCloseEvent&);
+    void StartJob(JobMode mode);
+    bool StartWorkerJob(const std::string& in, const std::string& fmt, bool reencode, const EncodeProfile& profile);
+    void OnWorkerTimer(wxTimerEvent&);
+    void DrainWorkerStatus();
+    void FinishWorkerJob();
 
     wxButton* m_openBtn;
     wxButton* m_startBtn;
+    wxButton* m_estimateBtn;
+    wxButton* m_thumbsBtn;
     wxChoice* m_formatChoice;
+    wxChoice* m_audioChoice;
+    wxChoice* m_deinterlaceChoice;
+    wxChoice* m_tonemapChoice;
+    wxChoice* m_bitDepthChoice;
     wxTextCtrl* m_inputPath;
+    wxTextCtrl* m_streamRules;
+    wxTextCtrl* m_extraFormats;
+    wxTextCtrl* m_muxOptions;
     wxTextCtrl* m_log;
     wxGauge* m_progress;
     wxCheckBox* m_reencodeCheck;
+    wxCheckBox* m_workerCheck;
+    wxCheckBox* m_splitDecodeCheck;
+    wxCheckBox* m_thumbTapCheck;
+    wxCheckBox* m_draftCheck;
+    wxCheckBox* m_loudnormCheck;
+    wxCheckBox* m_distributedCheck;
+    wxSpinCtrl* m_chunkWorkersSpin;
+    wxCheckBox* m_remoteWorkersCheck;
+    EncodeProfile m_profile;
 
     ConverterThread* m_thread = nullptr;
     std::atomic<bool> m_running{false};
 
+    // worker-process mode (supervisor side)
+    SharedMemory* m_workerShm = nullptr;
+    wxTimer m_workerTimer;
+    long m_workerPids[2] = {0, 0};   // converting worker, decode worker
+    wxProcess* m_workerProcs[2] = {nullptr, nullptr};
+    int m_workersAlive = 0;
+    uint32_t m_workerLogNext = 0;
+
     wxDECLARE_EVENT_TABLE();
 };
 
 enum {
     ID_Open = wxID_HIGHEST + 1,
-    ID_Start
+    ID_Start,
+    ID_Estimate,
+    ID_Thumbnails,
+    ID_WorkerTimer
 };
 
 wxBEGIN_EVENT_TABLE(MainFrame, wxFrame)
     EVT_BUTTON(ID_Open, MainFrame::OnOpen)
     EVT_BUTTON(ID_Start, MainFrame::OnStart)
+    EVT_BUTTON(ID_Estimate, MainFrame::OnEstimate)
+    EVT_BUTTON(ID_Thumbnails, MainFrame::OnThumbnails)
+    EVT_TIMER(ID_WorkerTimer, MainFrame::OnWorkerTimer)
     EVT_CLOSE(MainFrame::OnClose)
 wxEND_EVENT_TABLE()
 
 class ConverterThread : public wxThread {
 public:
-    ConverterThread(MainFrame* handler, const std::string& in, const std::string& outFormat, bool reencode)
-        : wxThread(wxTHREAD_DETACHED), m_handler(handler), m_input(in), m_outFormat(outFormat), m_reencode(reencode) {}
+    ConverterThread(MainFrame* handler, const std::string& in, const std::string& outFormat, bool reencode,
+                    const EncodeProfile& profile, JobMode mode = JobMode::Convert)
+        : wxThread(wxTHREAD_DETACHED), m_handler(handler), m_input(in), m_outFormat(outFormat), m_reencode(reencode),
+          m_profile(profile), m_mode(mode) {}
+
+    // Worker-process mode: report through the shared status block instead of GUI events and,
+    // if frameRing is set, take decoded video frames from a decode worker.
+    void AttachWorker(WorkerStatusBlock* status, const std::string& frameRing) { m_status = status; m_frameRing = frameRing; }
+    // Run the job on the calling thread (worker processes have no GUI thread to report to).
+    ExitCode RunInline() { return Entry(); }
 
 protected:
     virtual ExitCode Entry() override;
@@ -79,9 +267,21 @@ private:
     std::string m_input;
     std::string m_outFormat;
     bool m_reencode;
+    EncodeProfile m_profile;
+    JobMode m_mode;
+    WorkerStatusBlock* m_status = nullptr;
+    std::string m_frameRing;
 
     void Log(const std::string& s);
     void PostProgress(int pct);
+    bool IsCancelled();
+    void NotifyFinished();
+    ExitCode RunEstimate();
+    ExitCode RunCalibration();
+    ExitCode RunDistributed();
+    ExitCode RunThumbnails();
+    bool ReuseFinishedJob(const std::string& out_filename, std::string* key);
+    void RecordFinishedJob(const std::string& key, const std::string& out_filename);
 };
 
 wxDEFINE_EVENT(wxEVT_LOG_UPDATE, wxCommandEvent);
@@ -105,21 +305,83 @@ MainFrame::MainFrame()
     wxBoxSizer* optsSizer = new wxBoxSizer(wxHORIZONTAL);
     wxArrayString formats;
     formats.Add("mp4"); formats.Add("mkv"); formats.Add("avi"); formats.Add("mov");
+    formats.Add("ts"); formats.Add("webm"); formats.Add("fmp4");
     m_formatChoice = new wxChoice(panel, wxID_ANY, wxDefaultPosition, wxDefaultSize, formats);
     m_formatChoice->SetSelection(0);
+    wxArrayString audioCodecs;
+    audioCodecs.Add("Copy audio"); audioCodecs.Add("AAC"); audioCodecs.Add("Opus");
+    m_audioChoice = new wxChoice(panel, wxID_ANY, wxDefaultPosition, wxDefaultSize, audioCodecs);
+    m_audioChoice->SetSelection(0);
+    m_loudnormCheck = new wxCheckBox(panel, wxID_ANY, "Normalize loudness (R128)");
+    wxArrayString deinterlaceModes;
+    deinterlaceModes.Add("Deinterlace: auto"); deinterlaceModes.Add("Deinterlace: off"); deinterlaceModes.Add("Deinterlace: on");
+    m_deinterlaceChoice = new wxChoice(panel, wxID_ANY, wxDefaultPosition, wxDefaultSize, deinterlaceModes);
+    m_deinterlaceChoice->SetSelection(0);
+    wxArrayString toneCurves;
+    toneCurves.Add("HDR tone map: hable"); toneCurves.Add("HDR tone map: reinhard"); toneCurves.Add("HDR tone map: mobius");
+    toneCurves.Add("HDR tone map: clip"); toneCurves.Add("HDR tone map: off");
+    m_tonemapChoice = new wxChoice(panel, wxID_ANY, wxDefaultPosition, wxDefaultSize, toneCurves);
+    m_tonemapChoice->SetSelection(0);
+    wxArrayString bitDepths;
+    bitDepths.Add("Bit depth: as source"); bitDepths.Add("Bit depth: 8"); bitDepths.Add("Bit depth: 10");
+    m_bitDepthChoice = new wxChoice(panel, wxID_ANY, wxDefaultPosition, wxDefaultSize, bitDepths);
+    m_bitDepthChoice->SetSelection(0);
     m_startBtn = new wxButton(panel, ID_Start, "Start Conversion");
+    m_estimateBtn = new wxButton(panel, ID_Estimate, "Estimate");
+    m_thumbsBtn = new wxButton(panel, ID_Thumbnails, "Thumbnails");
     m_reencodeCheck = new wxCheckBox(panel, wxID_ANY, "Re-encode video (H.264)");
+    m_workerCheck = new wxCheckBox(panel, wxID_ANY, "Run in worker process");
+    m_splitDecodeCheck = new wxCheckBox(panel, wxID_ANY, "Decode in separate process");
+    m_thumbTapCheck = new wxCheckBox(panel, wxID_ANY, "Thumbnails while encoding");
+    m_draftCheck = new wxCheckBox(panel, wxID_ANY, "Draft proxy (360p)");
+    m_workerTimer.SetOwner(this, ID_WorkerTimer);
+    m_distributedCheck = new wxCheckBox(panel, wxID_ANY, "Distributed chunk encoding, local workers:");
+    m_chunkWorkersSpin = new wxSpinCtrl(panel, wxID_ANY, "2", wxDefaultPosition, wxSize(60, -1), 0, 0, 64, 2);
+    m_remoteWorkersCheck = new wxCheckBox(panel, wxID_ANY, "Accept remote workers");
+    wxSocketBase::Initialize(); // required before sockets are used from worker threads
 
     optsSizer->Add(new wxStaticText(panel, wxID_ANY, "Output format:"), 0, wxALIGN_CENTER_VERTICAL|wxALL, 6);
     optsSizer->Add(m_formatChoice, 0, wxALL, 6);
+    optsSizer->Add(m_audioChoice, 0, wxALL, 6);
+    optsSizer->Add(m_loudnormCheck, 0, wxALL|wxALIGN_CENTER_VERTICAL, 6);
     optsSizer->Add(m_reencodeCheck, 0, wxALL|wxALIGN_CENTER_VERTICAL, 6);
+    optsSizer->Add(m_draftCheck, 0, wxALL|wxALIGN_CENTER_VERTICAL, 6);
+    optsSizer->Add(m_deinterlaceChoice, 0, wxALL, 6);
+    optsSizer->Add(m_tonemapChoice, 0, wxALL, 6);
+    optsSizer->Add(m_bitDepthChoice, 0, wxALL, 6);
+    optsSizer->Add(m_estimateBtn, 0, wxALL|wxALIGN_CENTER_VERTICAL, 6);
+    optsSizer->Add(m_thumbsBtn, 0, wxALL|wxALIGN_CENTER_VERTICAL, 6);
+    optsSizer->Add(m_thumbTapCheck, 0, wxALL|wxALIGN_CENTER_VERTICAL, 6);
     optsSizer->Add(m_startBtn, 0, wxALL|wxALIGN_CENTER_VERTICAL, 6);
 
+    wxBoxSizer* streamSizer = new wxBoxSizer(wxHORIZONTAL);
+    m_streamRules = new wxTextCtrl(panel, wxID_ANY, "", wxDefaultPosition, wxSize(360, -1));
+    m_streamRules->SetHint("e.g. -subtitle,-audio,+audio:lang=eng");
+    streamSizer->Add(new wxStaticText(panel, wxID_ANY, "Streams:"), 0, wxALIGN_CENTER_VERTICAL|wxALL, 6);
+    streamSizer->Add(m_streamRules, 1, wxALL, 6);
+    m_extraFormats = new wxTextCtrl(panel, wxID_ANY, "", wxDefaultPosition, wxSize(120, -1));
+    m_extraFormats->SetHint("e.g. mkv,ts");
+    streamSizer->Add(new wxStaticText(panel, wxID_ANY, "Also write:"), 0, wxALIGN_CENTER_VERTICAL|wxALL, 6);
+    streamSizer->Add(m_extraFormats, 0, wxALL, 6);
+    m_muxOptions = new wxTextCtrl(panel, wxID_ANY, "", wxDefaultPosition, wxSize(260, -1));
+    m_muxOptions->SetHint("e.g. cues_kb=512,muxrate=8000000,pcr_ms=40,frag_ms=2000");
+    streamSizer->Add(new wxStaticText(panel, wxID_ANY, "Mux options:"), 0, wxALIGN_CENTER_VERTICAL|wxALL, 6);
+    streamSizer->Add(m_muxOptions, 0, wxALL, 6);
+
+    wxBoxSizer* workerSizer = new wxBoxSizer(wxHORIZONTAL);
+    workerSizer->Add(m_workerCheck, 0, wxALL|wxALIGN_CENTER_VERTICAL, 6);
+    workerSizer->Add(m_splitDecodeCheck, 0, wxALL|wxALIGN_CENTER_VERTICAL, 6);
+    workerSizer->Add(m_distributedCheck, 0, wxALL|wxALIGN_CENTER_VERTICAL, 6);
+    workerSizer->Add(m_chunkWorkersSpin, 0, wxALL|wxALIGN_CENTER_VERTICAL, 6);
+    workerSizer->Add(m_remoteWorkersCheck, 0, wxALL|wxALIGN_CENTER_VERTICAL, 6);
+
     m_progress = new wxGauge(panel, wxID_ANY, 100, wxDefaultPosition, wxSize(-1,20));
     m_log = new wxTextCtrl(panel, wxID_ANY, "", wxDefaultPosition, wxDefaultSize, wxTE_MULTILINE|wxTE_READONLY);
 
     topSizer->Add(fileSizer, 0, wxEXPAND);
     topSizer->Add(optsSizer, 0, wxEXPAND);
+    topSizer->Add(streamSizer, 0, wxEXPAND);
+    topSizer->Add(workerSizer, 0, wxEXPAND);
     topSizer->Add(m_progress, 0, wxEXPAND|wxALL, 5);
     topSizer->Add(m_log, 1, wxEXPAND|wxALL, 5);
 
@@ -132,6 +394,19 @@ MainFrame::MainFrame()
             wxString num = s.Mid(9);
             long pct = 0; num.ToLong(&pct);
             m_progress->SetValue((int)pct);
+        } else if (s.StartsWith("SPAWN_CHUNK_WORKERS:")) {
+            // "SPAWN_CHUNK_WORKERS:<port>:<count>:<token>" from a distributed job's coordinator
+            wxString args = s.Mid(20);
+            long port = 0, count = 0;
+            args.BeforeFirst(':').ToLong(&port);
+            args = args.AfterFirst(':');
+            args.BeforeFirst(':').ToLong(&count);
+            wxString cmd = "\"" + wxStandardPaths::Get().GetExecutablePath() + "\" --chunk-worker 127.0.0.1:" + std::to_string(port);
+            wxExecuteEnv env;
+            wxGetEnvMap(&env.env);
+            env.env[kChunkTokenEnv] = args.AfterFirst(':');
+            for (long i = 0; i < count; ++i) wxExecute(cmd, wxEXEC_ASYNC|wxEXEC_HIDE_CONSOLE, NULL, &env);
+            m_log->AppendText("Coordinator listening on port " + std::to_string(port) + "; started " + std::to_string(count) + " local chunk workers");
         } else {
             m_log->AppendText(s);
             m_log->AppendText("");
@@ -153,6 +428,18 @@ void MainFrame::OnOpen(wxCommandEvent&) {
 }
 
 void MainFrame::OnStart(wxCommandEvent&) {
+    StartJob(JobMode::Convert);
+}
+
+void MainFrame::OnEstimate(wxCommandEvent&) {
+    StartJob(JobMode::Estimate);
+}
+
+void MainFrame::OnThumbnails(wxCommandEvent&) {
+    StartJob(JobMode::Thumbnails);
+}
+
+void MainFrame::StartJob(JobMode mode) {
     if (m_running.load()) {
         wxMessageBox("Conversion already running", "Info");
         return;
@@ -160,14 +447,59 @@ void MainFrame::OnStart(wxCommandEvent&) {
     wxString in = m_inputPath->GetValue();
     if (in.IsEmpty()) { wxMessageBox("Choose an input file first", "Error"); return; }
     wxString fmt = m_formatChoice->GetStringSelection();
+    EncodeProfile profile = m_profile;
+    std::string bad;
+    if (!parse_mux_options(std::string(m_muxOptions->GetValue().mb_str()), &profile, &bad)) {
+        wxMessageBox("Unknown mux option \"" + bad + "\" (use cues_kb, muxrate, pcr_ms, frag_ms)", "Error");
+        return;
+    }
 
     m_log->Clear();
     m_progress->SetValue(0);
 
     bool reencode = m_reencodeCheck->GetValue();
 
+    apply_thread_calibration(&profile);
+
+    profile.chunk_workers = m_chunkWorkersSpin->GetValue();
+    profile.remote_workers = m_remoteWorkersCheck->GetValue();
+    profile.thumb_tap = m_thumbTapCheck->GetValue();
+    profile.draft = m_draftCheck->GetValue();
+    if (profile.draft) reencode = true; // a proxy is always a re-encode
+    const char* audioEncoders[] = { "", "aac", "libopus" };
+    profile.audio_codec = audioEncoders[std::max(0, m_audioChoice->GetSelection())];
+    profile.loudnorm = m_loudnormCheck->GetValue();
+    const int deinterlaceModes[] = { -1, 0, 1 };
+    profile.deinterlace = deinterlaceModes[std::max(0, m_deinterlaceChoice->GetSelection())];
+    const char* toneCurves[] = { "hable", "reinhard", "mobius", "clip", "off" };
+    profile.tonemap = toneCurves[std::max(0, m_tonemapChoice->GetSelection())];
+    const int bitDepths[] = { 0, 8, 10 };
+    profile.bit_depth = bitDepths[std::max(0, m_bitDepthChoice->GetSelection())];
+    profile.stream_rules = std::string(m_streamRules->GetValue().mb_str());
+    profile.extra_formats = std::string(m_extraFormats->GetValue().mb_str());
+    if (fmt == "avi") profile.cfr = true; // AVI has no per-frame timestamps
+    if (fmt == "webm") {
+        // WebM only carries VP8/VP9/AV1 video and Vorbis/Opus audio: copied Opus/Vorbis stay as they
+        // are, only tracks it would refuse (AAC, AC-3) are transcoded to Opus
+        if (profile.audio_codec == "aac") { wxMessageBox("WebM cannot carry AAC audio; choose Opus or copy", "Error"); return; }
+        profile.video_encoder = "libvpx-vp9";
+        profile.fallback_audio_codec = "libopus";
+    }
+    if (profile.loudnorm && profile.audio_codec.empty()) // gain needs a transcode
+        profile.audio_codec = profile.fallback_audio_codec.empty() ? "aac" : profile.fallback_audio_codec;
+    if (mode == JobMode::Convert && reencode && m_distributedCheck->GetValue()) mode = JobMode::Distributed;
+
+    if (mode == JobMode::Convert && m_workerCheck->GetValue()) {
+        m_running.store(true);
+        if (!StartWorkerJob(std::string(in.mb_str()), std::string(fmt.mb_str()), reencode, profile)) {
+            wxMessageBox("Failed to start worker process", "Error");
+            m_running.store(false);
+        }
+        return;
+    }
+
     m_running.store(true);
-    m_thread = new ConverterThread(this, std::string(in.mb_str()), std::string(fmt.mb_str()), reencode);
+    m_thread = new ConverterThread(this, std::string(in.mb_str()), std::string(fmt.mb_str()), reencode, profile, mode);
     if (m_thread->Run() != wxTHREAD_NO_ERROR) {
         wxMessageBox("Failed to start conversion thread", "Error");
         m_running.store(false);
@@ -175,14 +507,28 @@ void MainFrame::OnStart(wxCommandEvent&) {
     }
 }
 
+// Run the thread-count calibration once per host; results land in threads.cache and are
+// picked up by every job started afterwards.
+void MainFrame::CalibrateIfNeeded() {
+    if (have_thread_calibration() || m_running.load()) return;
+    m_running.store(true);
+    m_thread = new ConverterThread(this, std::string(), std::string(), true, m_profile, JobMode::Calibrate);
+    if (m_thread->Run() != wxTHREAD_NO_ERROR) {
+        m_running.store(false);
+        delete m_thread; m_thread = nullptr;
+    }
+}
+
 void MainFrame::OnClose(wxCloseEvent& ev) {
     if (m_running.load()) {
         if (wxMessageBox("A conversion is running. Quit anyway?", "Confirm", wxYES_NO) != wxYES) { ev.Veto(); return; }
     }
+    AbandonWorkers();
     Destroy();
 }
 
 void ConverterThread::Log(const std::string& s) {
+    if (m_status) { worker_log(m_status, s); return; }
     wxCommandEvent* ev = new wxCommandEvent(wxEVT_LOG_UPDATE);
     ev->SetString(s);
     // Queue the event to the GUI thread (wx takes ownership of the event pointer)
@@ -190,334 +536,5560 @@ void ConverterThread::Log(const std::string& s) {
 }
 
 void ConverterThread::PostProgress(int pct) {
+    if (m_status) { worker_set_progress(m_status, pct); return; }
     wxCommandEvent* ev = new wxCommandEvent(wxEVT_LOG_UPDATE);
     ev->SetString(std::string("PROGRESS:") + std::to_string(pct));
     wxQueueEvent(m_handler, ev);
 }
 
-// Simple function to derive output filename from input + format
-static std::string make_output_path(const std::string& inPath, const std::string& outFmt) {
+// TestDestroy() is only valid on a running wxThread; inline worker runs poll the shared cancel flag.
+bool ConverterThread::IsCancelled() {
+    return m_status ? worker_cancelled(m_status) : TestDestroy();
+}
+
+void ConverterThread::NotifyFinished() {
+    if (m_status) worker_set_finished(m_status, 0);
+    else m_handler->setRunning(false);
+}
+
+// Input path without extension; side outputs (thumbnails etc.) are named after it
+static std::string output_base_path(const std::string& inPath) {
     size_t p = inPath.find_last_of("/\\");
     std::string dir = (p==std::string::npos) ? std::string() : inPath.substr(0, p+1);
     std::string base = (p==std::string::npos) ? inPath : inPath.substr(p+1);
     size_t dot = base.find_last_of('.');
     if (dot!=std::string::npos) base = base.substr(0,dot);
-    return dir + base + "_converted." + outFmt;
+    return dir + base;
 }
 
-// The main converter thread entry. Depending on m_reencode it will either remux (stream copy)
-// or decode->encode the video stream (H.264) while copying other streams.
-wxThread::ExitCode ConverterThread::Entry() {
-    Log(m_reencode ? "Starting encoding conversion..." : "Starting remux (stream-copy) conversion...");
-
-    const char* in_filename = m_input.c_str();
-    std::string out_filename = make_output_path(m_input, m_outFormat);
+// Output formats offered in the format choice map to a muxer and a file extension; "ts" is
+// MPEG-TS and "fmp4" is fragmented MP4 (written as _frag.mp4, so it does not replace an mp4 output).
+static std::string container_muxer(const std::string& fmt) {
+    if (fmt == "ts") return "mpegts";
+    if (fmt == "mkv") return "matroska";
+    if (fmt == "fmp4") return "mp4";
+    return fmt;
+}
 
-    AVFormatContext* in_ctx = nullptr;
-    AVFormatContext* out_ctx = nullptr;
-    int ret = 0;
+static std::string container_extension(const std::string& fmt) {
+    return fmt == "fmp4" ? "mp4" : fmt;
+}
 
-    // Open input
-    ret = avformat_open_input(&in_ctx, in_filename, NULL, NULL);
-    if (ret < 0) {
-        char errbuf[256]; av_strerror(ret, errbuf, sizeof(errbuf));
-        Log(std::string("Failed to open input: ") + errbuf);
-        m_handler->setRunning(false);
-        return (wxThread::ExitCode)0;
+// Muxer options for `fmt` from the profile, for avformat_write_header(). Everything is settled
+// before the header so the file is final when the trailer is written: fragmented MP4 needs no
+// moov rewrite, and mkv cues land in space reserved up front instead of a seek back to the start.
+static void container_options(const std::string& fmt, const EncodeProfile& prof, AVDictionary** opts) {
+    if ((fmt == "mkv" || fmt == "webm") && prof.mkv_cues_kb > 0)
+        av_dict_set_int(opts, "reserve_index_space", (int64_t)prof.mkv_cues_kb * 1024, 0);
+    if (fmt == "ts") {
+        if (prof.ts_muxrate > 0) av_dict_set_int(opts, "muxrate", prof.ts_muxrate, 0);
+        if (prof.ts_pcr_period_ms > 0) av_dict_set_int(opts, "pcr_period", prof.ts_pcr_period_ms, 0);
+    }
+    if (fmt == "fmp4") {
+        av_dict_set(opts, "movflags", "frag_keyframe+empty_moov+default_base_moof", 0);
+        if (prof.frag_duration_ms > 0) av_dict_set_int(opts, "frag_duration", (int64_t)prof.frag_duration_ms * 1000, 0);
     }
+}
 
-    if ((ret = avformat_find_stream_info(in_ctx, NULL)) < 0) {
-        Log("Failed to find stream info");
-        avformat_close_input(&in_ctx);
-        m_handler->setRunning(false);
-        return 0;
+// "cues_kb=512,muxrate=8000000,pcr_ms=40,frag_ms=2000" into the profile's container options
+// (any subset, empty = muxer defaults). False with *bad set to the first entry not understood.
+static bool parse_mux_options(const std::string& text, EncodeProfile* prof, std::string* bad) {
+    std::istringstream is(text);
+    std::string item;
+    while (std::getline(is, item, ',')) {
+        item.erase(0, item.find_first_not_of(" \t"));
+        item.erase(item.find_last_not_of(" \t") + 1);
+        if (item.empty()) continue;
+        size_t eq = item.find('=');
+        std::string key = item.substr(0, eq);
+        char* end = nullptr;
+        long long v = eq == std::string::npos ? -1 : strtoll(item.c_str() + eq + 1, &end, 10);
+        if (v < 0 || !end || *end || end == item.c_str() + eq + 1) { *bad = item; return false; }
+        if (key == "cues_kb") prof->mkv_cues_kb = (int)v;
+        else if (key == "muxrate") prof->ts_muxrate = v;
+        else if (key == "pcr_ms") prof->ts_pcr_period_ms = (int)v;
+        else if (key == "frag_ms") prof->frag_duration_ms = (int)v;
+        else { *bad = item; return false; }
     }
+    return true;
+}
 
-    // If no re-encode requested -> perform simple remux (stream copy)
-    if (!m_reencode) {
-        avformat_alloc_output_context2(&out_ctx, NULL, m_outFormat.c_str(), out_filename.c_str());
-        if (!out_ctx) {
-            Log("Could not create output context (unsupported format?)");
-            avformat_close_input(&in_ctx);
-            m_handler->setRunning(false);
-            return 0;
-        }
+// avformat_write_header() with the container options; unused options are ignored.
+static int write_container_header(AVFormatContext* out_ctx, const std::string& fmt, const EncodeProfile& prof) {
+    AVDictionary* opts = nullptr;
+    container_options(fmt, prof, &opts);
+    int ret = avformat_write_header(out_ctx, &opts);
+    av_dict_free(&opts);
+    return ret;
+}
 
-        std::vector<int> stream_mapping(in_ctx->nb_streams, -1);
-        int stream_index = 0;
-        for (unsigned i = 0; i < in_ctx->nb_streams; ++i) {
-            AVStream* in_stream = in_ctx->streams[i];
-            AVCodecParameters* in_par = in_stream->codecpar;
-            AVStream* out_stream = avformat_new_stream(out_ctx, NULL);
-            if (!out_stream) {
-                Log("Failed allocating output stream");
-                ret = AVERROR_UNKNOWN; break;
-            }
-            ret = avcodec_parameters_copy(out_stream->codecpar, in_par);
-            if (ret < 0) { Log("Failed to copy codec parameters"); break; }
-            out_stream->codecpar->codec_tag = 0;
-            stream_mapping[i] = stream_index++;
-        }
+// False if the container cannot store a stream of this codec (e.g. H.264 in webm).
+static bool container_accepts(const AVOutputFormat* ofmt, const AVCodecParameters* par) {
+    return avformat_query_codec(ofmt, par->codec_id, FF_COMPLIANCE_NORMAL) != 0;
+}
 
-        if (ret < 0) {
-            avformat_close_input(&in_ctx);
-            if (out_ctx) avformat_free_context(out_ctx);
-            m_handler->setRunning(false);
-            return 0;
-        }
+// Simple function to derive output filename from input + format
+static std::string make_output_path(const std::string& inPath, const std::string& outFmt, bool proxy = false) {
+    return output_base_path(inPath) + (proxy ? "_proxy" : "_converted") + (outFmt == "fmp4" ? "_frag." : ".") + container_extension(outFmt);
+}
 
-        if (!(out_ctx->oformat->flags & AVFMT_NOFILE)) {
-            ret = avio_open(&out_ctx->pb, out_filename.c_str(), AVIO_FLAG_WRITE);
-            if (ret < 0) {
-                char errbuf[256]; av_strerror(ret, errbuf, sizeof(errbuf));
-                Log(std::string("Could not open output file: ") + errbuf);
-                avformat_close_input(&in_ctx);
-                avformat_free_context(out_ctx);
-                m_handler->setRunning(false);
-                return 0;
-            }
-        }
+// Full range (JPEG) variants of the planar YUV formats
+static bool is_yuvj(AVPixelFormat fmt) {
+    return fmt == AV_PIX_FMT_YUVJ420P || fmt == AV_PIX_FMT_YUVJ422P || fmt == AV_PIX_FMT_YUVJ444P;
+}
 
-        ret = avformat_write_header(out_ctx, NULL);
-        if (ret < 0) {
-            Log("Error occurred when writing header");
-            if (!(out_ctx->oformat->flags & AVFMT_NOFILE)) avio_closep(&out_ctx->pb);
-            avformat_close_input(&in_ctx);
-            avformat_free_context(out_ctx);
-            m_handler->setRunning(false);
-            return 0;
+// Encoder input format: yuv420p, or yuv420p10 when prof.bit_depth asks for 10 bits (0: when the
+// source has more than 8 bits per sample) and the encoder takes it. Drafts are always 8-bit.
+static AVPixelFormat encoder_pix_fmt(const AVCodec* enc, const AVCodecContext* dec_ctx, const EncodeProfile& prof) {
+    const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get(dec_ctx->pix_fmt);
+    bool deep = prof.bit_depth == 10 || (prof.bit_depth == 0 && desc && desc->comp[0].depth > 8);
+    if (prof.draft || !deep) return AV_PIX_FMT_YUV420P;
+#if LIBAVCODEC_VERSION_INT >= AV_VERSION_INT(61, 13, 100) // AVCodec::pix_fmts is deprecated from here on
+    const void* cfg = nullptr;
+    if (avcodec_get_supported_config(NULL, enc, AV_CODEC_CONFIG_PIX_FORMAT, 0, &cfg, NULL) < 0) cfg = nullptr;
+    const AVPixelFormat* pix_fmts = (const AVPixelFormat*)cfg;
+#else
+    const AVPixelFormat* pix_fmts = enc->pix_fmts;
+#endif
+    for (const AVPixelFormat* p = pix_fmts; p && *p != AV_PIX_FMT_NONE; ++p)
+        if (*p == AV_PIX_FMT_YUV420P10) return AV_PIX_FMT_YUV420P10;
+    return AV_PIX_FMT_YUV420P;
+}
+
+// Allocate and open the video encoder (libx264, or prof.video_encoder) for frames coming from dec_ctx.
+// The encoder time base is 1/framerate, or src_tb (the decoded frames' stream time base) for VFR
+// output when given and prof.cfr is off. Color tags follow the source, or BT.709 when the frames
+// are tone mapped (tonemap_wanted()).
+// Returns 0 on success or a negative AVERROR (AVERROR_ENCODER_NOT_FOUND if the encoder is missing).
+static int open_video_encoder(const AVCodecContext* dec_ctx, AVRational framerate, const EncodeProfile& prof, AVCodecContext** out,
+                              AVRational src_tb = AVRational{ 0, 1 }) {
+    *out = nullptr;
+    const AVCodec* enc = prof.video_encoder.empty() ? avcodec_find_encoder(AV_CODEC_ID_H264)
+                                                    : avcodec_find_encoder_by_name(prof.video_encoder.c_str());
+    if (!enc) return AVERROR_ENCODER_NOT_FOUND;
+    bool x264 = enc->id == AV_CODEC_ID_H264;
+
+    AVCodecContext* enc_ctx = avcodec_alloc_context3(enc);
+    if (!enc_ctx) return AVERROR(ENOMEM);
+    enc_ctx->height = dec_ctx->height;
+    enc_ctx->width = dec_ctx->width;
+    enc_ctx->sample_aspect_ratio = dec_ctx->sample_aspect_ratio;
+    enc_ctx->pix_fmt = encoder_pix_fmt(enc, dec_ctx, prof);
+    if (tonemap_wanted(dec_ctx, prof)) {
+        enc_ctx->color_primaries = AVCOL_PRI_BT709;
+        enc_ctx->color_trc = AVCOL_TRC_BT709;
+        enc_ctx->colorspace = AVCOL_SPC_BT709;
+        enc_ctx->color_range = AVCOL_RANGE_MPEG;
+    } else {
+        enc_ctx->color_primaries = dec_ctx->color_primaries;
+        enc_ctx->color_trc = dec_ctx->color_trc;
+        enc_ctx->colorspace = dec_ctx->colorspace;
+        // yuvj formats are converted to limited range (EncoderInput)
+        enc_ctx->color_range = is_yuvj(dec_ctx->pix_fmt) ? AVCOL_RANGE_MPEG : dec_ctx->color_range;
+    }
+    enc_ctx->time_base = (!prof.cfr && src_tb.num > 0) ? src_tb : av_inv_q(framerate);
+    enc_ctx->framerate = framerate;
+    enc_ctx->bit_rate = prof.bit_rate;
+    if (prof.enc_threads > 0) enc_ctx->thread_count = prof.enc_threads;
+    if (prof.draft) {
+        // proxy: scale down to draft_height keeping the aspect ratio, one keyframe per second for scrubbing
+        if (dec_ctx->height > prof.draft_height) {
+            enc_ctx->height = prof.draft_height & ~1;
+            enc_ctx->width = (int)((int64_t)dec_ctx->width * enc_ctx->height / dec_ctx->height) & ~1;
+        }
+        enc_ctx->gop_size = std::max(1, (int)(av_q2d(framerate) + 0.5));
+        if (x264) {
+            av_opt_set(enc_ctx->priv_data, "preset", "ultrafast", 0);
+            av_opt_set(enc_ctx->priv_data, "tune", "fastdecode", 0);
+        } else {
+            av_opt_set(enc_ctx->priv_data, "deadline", "realtime", 0);
+            av_opt_set_int(enc_ctx->priv_data, "cpu-used", 8, 0);
         }
+    } else if (x264 && !prof.preset.empty()) {
+        av_opt_set(enc_ctx->priv_data, "preset", prof.preset.c_str(), 0);
+    } else if (!x264) {
+        av_opt_set_int(enc_ctx->priv_data, "row-mt", 1, 0); // libvpx-vp9: use enc_threads within a frame
+    }
 
-        AVPacket pkt;
-        while (true) {
-            ret = av_read_frame(in_ctx, &pkt);
-            if (ret < 0) break; // EOF or error
-            AVStream* in_stream = in_ctx->streams[pkt.stream_index];
-            if (pkt.stream_index >= (int)stream_mapping.size() || stream_mapping[pkt.stream_index] < 0) {
-                av_packet_unref(&pkt);
-                continue;
-            }
-            pkt.stream_index = stream_mapping[pkt.stream_index];
+    int ret = avcodec_open2(enc_ctx, enc, NULL);
+    if (ret < 0) { avcodec_free_context(&enc_ctx); return ret; }
+    *out = enc_ctx;
+    return 0;
+}
 
-            AVStream* out_stream = out_ctx->streams[pkt.stream_index];
-            pkt.pts = av_rescale_q_rnd(pkt.pts, in_stream->time_base, out_stream->time_base,
-                                       (AVRounding)(AV_ROUND_NEAR_INF|AV_ROUND_PASS_MINMAX));
-            pkt.dts = av_rescale_q_rnd(pkt.dts, in_stream->time_base, out_stream->time_base,
-                                       (AVRounding)(AV_ROUND_NEAR_INF|AV_ROUND_PASS_MINMAX));
-            pkt.duration = av_rescale_q(pkt.duration, in_stream->time_base, out_stream->time_base);
-            pkt.pos = -1;
+// Turns decoded frame timestamps (stream time base) into strictly increasing encoder timestamps.
+// Frames without a timestamp get the previous one plus a frame duration; frames landing on or
+// before their predecessor are moved one tick later, or dropped when the encoder time base is one
+// frame (CFR). Encoders reject non-increasing pts, so without this a single bad timestamp could
+// fail a job hours in. Forward gaps are kept as they are: audio and copied streams keep their
+// source timestamps, so closing a gap in the video alone would put A/V out of sync.
+class FrameTimestamps {
+public:
+    // drop_overlaps: CFR output
+    void Init(AVRational in_tb, AVRational enc_tb, AVRational framerate, bool drop_overlaps) {
+        m_inTb = in_tb;
+        m_encTb = enc_tb;
+        m_frameTicks = std::max<int64_t>(1, av_rescale_q(1, av_inv_q(framerate), enc_tb));
+        m_drop = drop_overlaps;
+    }
 
-            ret = av_interleaved_write_frame(out_ctx, &pkt);
-            if (ret < 0) {
-                Log("Error muxing packet");
-                av_packet_unref(&pkt);
-                break;
+    // Encoder pts for a frame with decoder timestamp `ts` (AV_NOPTS_VALUE if unknown), or
+    // AV_NOPTS_VALUE if the frame is to be dropped.
+    int64_t Next(int64_t ts) {
+        int64_t out;
+        if (ts == AV_NOPTS_VALUE) {
+            out = m_last == AV_NOPTS_VALUE ? 0 : m_last + m_frameTicks;
+            m_missing++;
+        } else {
+            out = av_rescale_q(ts, m_inTb, m_encTb);
+            int64_t delta = m_last == AV_NOPTS_VALUE ? m_frameTicks : out - m_last;
+            if (delta <= 0) {
+                if (m_drop) { m_dropped++; return AV_NOPTS_VALUE; }
+                out = m_last + 1;
+                m_shifted++;
             }
+        }
+        return m_last = out;
+    }
 
-            // approximate progress if duration known
-            if (in_ctx->duration > 0 && pkt.pts != AV_NOPTS_VALUE) {
-                int pct = (int)((pkt.pts * av_q2d(out_stream->time_base) * AV_TIME_BASE) * 100 / in_ctx->duration);
-                if (pct < 0) pct = 0; if (pct > 100) pct = 100;
-                PostProgress(pct);
-            }
+    // "2 missing, 1 overlapping shifted" etc.; empty when every timestamp was usable as is
+    std::string Report() const {
+        std::string r;
+        auto add = [&](int64_t n, const char* what) {
+            if (n) r += (r.empty() ? "" : ", ") + std::to_string(n) + " " + what;
+        };
+        add(m_missing, "missing");
+        add(m_shifted, "overlapping shifted");
+        add(m_dropped, "overlapping dropped");
+        return r;
+    }
 
-            av_packet_unref(&pkt);
-            if (TestDestroy()) { Log("Conversion cancelled"); break; }
-        }
+private:
+    AVRational m_inTb{ 1, 1 }, m_encTb{ 1, 1 };
+    int64_t m_frameTicks = 1, m_last = AV_NOPTS_VALUE;
+    bool m_drop = false;
+    int64_t m_missing = 0, m_shifted = 0, m_dropped = 0;
+};
 
-        av_write_trailer(out_ctx);
-        if (!(out_ctx->oformat->flags & AVFMT_NOFILE)) avio_closep(&out_ctx->pb);
-        avformat_close_input(&in_ctx);
-        avformat_free_context(out_ctx);
+// Decoder settings from the profile. Draft mode trades decode quality for speed: `lowres` (only
+// some decoders, e.g. mjpeg/mpeg4/h263, support it) decodes at 1/2, 1/4 or 1/8 size while the
+// result still covers draft_height, and loop filtering / B-frame IDCT are skipped. Call before
+// avcodec_open2(); dec_ctx->width/height reflect lowres after opening.
+static void apply_decoder_profile(AVCodecContext* dec_ctx, const AVCodec* dec, const EncodeProfile& prof) {
+    if (prof.dec_threads > 0) dec_ctx->thread_count = prof.dec_threads;
+    if (!prof.draft) return;
+    int lowres = 0;
+    while (lowres < dec->max_lowres && (dec_ctx->height >> (lowres + 1)) >= prof.draft_height) lowres++;
+    dec_ctx->lowres = lowres;
+    dec_ctx->skip_loop_filter = AVDISCARD_ALL;
+    dec_ctx->skip_idct = AVDISCARD_BIDIR;
+    dec_ctx->flags2 |= AV_CODEC_FLAG2_FAST;
+}
 
-        Log(std::string("Remux finished. Output: ") + out_filename);
-        m_handler->setRunning(false);
-        return (wxThread::ExitCode)0;
+// Scaler flags for converting decoded frames to the encoder's size/format
+static int scaler_flags(const EncodeProfile& prof) {
+    return prof.draft ? SWS_FAST_BILINEAR : SWS_BILINEAR;
+}
+
+// Frame rate used for the encoder time base: container guess, then r_frame_rate, then 25fps.
+static AVRational guess_video_framerate(AVFormatContext* in_ctx, int stream_index) {
+    AVRational framerate = av_guess_frame_rate(in_ctx, in_ctx->streams[stream_index], NULL);
+    if (framerate.num == 0) framerate = in_ctx->streams[stream_index]->r_frame_rate;
+    if (framerate.num == 0) framerate = {25,1};
+    return framerate;
+}
+
+// Stream selection rules: comma/space separated, evaluated left to right; the last matching rule
+// decides and streams no rule matches are kept. A rule is '+' (keep) or '-' (drop) followed by
+// ':'-joined conditions: a type (video, audio, subtitle, data, attachment), lang=<code>,
+// codec=<name> or index=<n>. "-audio,+audio:lang=eng,-subtitle" keeps only English audio and
+// drops all subtitles.
+static bool stream_selected(const AVStream* st, const std::string& rules) {
+    bool keep = true;
+    std::string rule;
+    std::istringstream in(rules);
+    while (std::getline(in, rule, ',')) {
+        std::istringstream words(rule);
+        std::string word;
+        while (words >> word) {
+            if (word.size() < 2 || (word[0] != '+' && word[0] != '-')) continue;
+            bool match = true;
+            std::string cond;
+            std::istringstream conds(word.substr(1));
+            while (match && std::getline(conds, cond, ':')) {
+                size_t eq = cond.find('=');
+                std::string key = cond.substr(0, eq), value = eq == std::string::npos ? std::string() : cond.substr(eq + 1);
+                if (eq == std::string::npos) {
+                    const char* type = av_get_media_type_string(st->codecpar->codec_type);
+                    match = type && key == type;
+                } else if (key == "lang") {
+                    AVDictionaryEntry* lang = av_dict_get(st->metadata, "language", NULL, 0);
+                    match = lang && value == lang->value;
+                } else if (key == "codec") {
+                    match = value == avcodec_get_name(st->codecpar->codec_id);
+                } else if (key == "index") {
+                    match = value == std::to_string(st->index);
+                } else {
+                    match = false;
+                }
+            }
+            if (match) keep = word[0] == '+';
+        }
     }
+    return keep;
+}
 
-    // ---- re-encode path (video -> H.264), copy other streams ----
-    int video_stream_index = -1;
-    for (unsigned i = 0; i < in_ctx->nb_streams; i++) {
-        if (in_ctx->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO) { video_stream_index = i; break; }
+// Mark streams the rules drop as AVDISCARD_ALL so the demuxer skips their packets; the job's
+// stream mapping then leaves them out of the output. Returns the number of dropped streams.
+static int apply_stream_selection(AVFormatContext* in_ctx, const std::string& rules) {
+    int dropped = 0;
+    if (rules.empty()) return 0;
+    for (unsigned i = 0; i < in_ctx->nb_streams; ++i) {
+        if (stream_selected(in_ctx->streams[i], rules)) continue;
+        in_ctx->streams[i]->discard = AVDISCARD_ALL;
+        dropped++;
     }
-    if (video_stream_index < 0) {
-        Log("No video stream found for re-encoding");
-        avformat_close_input(&in_ctx);
-        m_handler->setRunning(false);
-        return 0;
+    return dropped;
+}
+
+// The video stream a re-encode encodes itself: the first one that is selected and not an attached
+// picture (cover art). Call after apply_stream_selection(); -1 if there is none.
+static int main_video_stream(const AVFormatContext* in_ctx) {
+    for (unsigned i = 0; i < in_ctx->nb_streams; ++i) {
+        const AVStream* st = in_ctx->streams[i];
+        if (st->codecpar->codec_type == AVMEDIA_TYPE_VIDEO && !(st->disposition & AV_DISPOSITION_ATTACHED_PIC) &&
+            st->discard != AVDISCARD_ALL)
+            return (int)i;
     }
+    return -1;
+}
 
-    // Open decoder for input video stream
-    const AVCodec* dec = avcodec_find_decoder(in_ctx->streams[video_stream_index]->codecpar->codec_id);
-    if (!dec) { Log("Decoder not found"); avformat_close_input(&in_ctx); m_handler->setRunning(false); return 0; }
-    AVCodecContext* dec_ctx = avcodec_alloc_context3(dec);
-    avcodec_parameters_to_context(dec_ctx, in_ctx->streams[video_stream_index]->codecpar);
-    if ((ret = avcodec_open2(dec_ctx, dec, NULL)) < 0) { Log("Failed to open decoder"); avcodec_free_context(&dec_ctx); avformat_close_input(&in_ctx); m_handler->setRunning(false); return 0; }
+// swscale context with optional slice threading ("threads" option, libswscale >= 6.1;
+// older versions ignore it and stay single-threaded). The slice threads only run through
+// sws_scale_frame(); legacy sws_scale() always scales on the calling thread.
+static struct SwsContext* create_scaler(int src_w, int src_h, AVPixelFormat src_fmt,
+                                        int dst_w, int dst_h, AVPixelFormat dst_fmt, int flags, int threads) {
+    struct SwsContext* sws = sws_alloc_context();
+    if (!sws) return nullptr;
+    av_opt_set_int(sws, "srcw", src_w, 0);
+    av_opt_set_int(sws, "srch", src_h, 0);
+    av_opt_set_int(sws, "src_format", src_fmt, 0);
+    av_opt_set_int(sws, "dstw", dst_w, 0);
+    av_opt_set_int(sws, "dsth", dst_h, 0);
+    av_opt_set_int(sws, "dst_format", dst_fmt, 0);
+    av_opt_set_int(sws, "sws_flags", flags, 0);
+    if (threads > 0) av_opt_set_int(sws, "threads", threads, 0);
+    if (sws_init_context(sws, NULL, NULL) < 0) { sws_freeContext(sws); return nullptr; }
+    return sws;
+}
 
-    // Create output context and add streams: video will be encoded, others copied
-    avformat_alloc_output_context2(&out_ctx, NULL, m_outFormat.c_str(), out_filename.c_str());
-    if (!out_ctx) { Log("Could not create output context"); avcodec_free_context(&dec_ctx); avformat_close_input(&in_ctx); m_handler->setRunning(false); return 0; }
+// ---- deinterlacing ----
+//
+// Interlaced sources (broadcast ingest) are detected on a sample of decoded frames with an
+// idet-style comb measure and, when needed, deinterlaced with a yadif-style filter before the
+// scaler. Both run on native planar YUV/gray of up to 16 bits.
 
-    std::vector<int> stream_mapping(in_ctx->nb_streams, -1);
-    int out_stream_cnt = 0;
-    for (unsigned i = 0; i < in_ctx->nb_streams; ++i) {
-        AVStream* in_stream = in_ctx->streams[i];
-        if ((int)i == video_stream_index) {
-            // create placeholder stream for encoded video
-            AVStream* out_stream = avformat_new_stream(out_ctx, NULL);
-            if (!out_stream) { Log("Failed allocating output video stream"); ret = AVERROR_UNKNOWN; break; }
-            stream_mapping[i] = out_stream_cnt++;
-        } else {
-            AVStream* out_stream = avformat_new_stream(out_ctx, NULL);
-            if (!out_stream) { Log("Failed allocating output stream"); ret = AVERROR_UNKNOWN; break; }
-            ret = avcodec_parameters_copy(out_stream->codecpar, in_stream->codecpar);
-            if (ret < 0) { Log("Failed to copy codec parameters for non-video stream"); break; }
-            out_stream->codecpar->codec_tag = 0;
-            stream_mapping[i] = out_stream_cnt++;
+// Fixed set of threads that run one function over slices [0, n); Run() returns when every slice
+// is done and the calling thread takes part. For per-frame stages too fine-grained to start
+// threads for each frame.
+class SlicePool {
+public:
+    explicit SlicePool(int threads) {
+        for (int i = 1; i < threads; ++i) m_threads.emplace_back(&SlicePool::Worker, this);
+    }
+    ~SlicePool() {
+        {
+            std::lock_guard<std::mutex> lk(m_lock);
+            m_stop = true;
         }
+        m_cv.notify_all();
+        for (std::thread& t : m_threads) t.join();
     }
-    if (ret < 0) { avformat_close_input(&in_ctx); avformat_free_context(out_ctx); avcodec_free_context(&dec_ctx); m_handler->setRunning(false); return 0; }
 
-    // Find encoder for H.264
-    const AVCodec* enc = avcodec_find_encoder(AV_CODEC_ID_H264);
-    if (!enc) { Log("H.264 encoder not found"); avformat_close_input(&in_ctx); avformat_free_context(out_ctx); avcodec_free_context(&dec_ctx); m_handler->setRunning(false); return 0; }
+    int Threads() const { return (int)m_threads.size() + 1; }
 
-    // Setup encoder context
-    AVCodecContext* enc_ctx = avcodec_alloc_context3(enc);
-    enc_ctx->height = dec_ctx->height;
-    enc_ctx->width = dec_ctx->width;
-    enc_ctx->sample_aspect_ratio = dec_ctx->sample_aspect_ratio;
-    enc_ctx->pix_fmt = AV_PIX_FMT_YUV420P;
-    AVRational framerate = av_guess_frame_rate(in_ctx, in_ctx->streams[video_stream_index], NULL);
-    if (framerate.num == 0) framerate = in_ctx->streams[video_stream_index]->r_frame_rate;
-    if (framerate.num == 0) framerate = {25,1};
-    enc_ctx->time_base = av_inv_q(framerate);
-    enc_ctx->framerate = framerate;
-    enc_ctx->bit_rate = 800000; // 800kbps default; adjust as needed
-
-    // Open encoder (you can pass AVDictionary for options like preset/crf)
-    if ((ret = avcodec_open2(enc_ctx, enc, NULL)) < 0) { Log("Failed to open encoder"); avcodec_free_context(&enc_ctx); avformat_free_context(out_ctx); avcodec_free_context(&dec_ctx); avformat_close_input(&in_ctx); m_handler->setRunning(false); return 0; }
-
-    // Copy encoder params to output video stream
-    AVStream* out_video_stream = out_ctx->streams[ stream_mapping[video_stream_index] ];
-    avcodec_parameters_from_context(out_video_stream->codecpar, enc_ctx);
-    out_video_stream->time_base = enc_ctx->time_base;
+    void Run(int n, const std::function<void(int)>& fn) {
+        if (m_threads.empty() || n <= 1) {
+            for (int i = 0; i < n; ++i) fn(i);
+            return;
+        }
+        std::unique_lock<std::mutex> lk(m_lock);
+        m_fn = &fn;
+        m_count = n;
+        m_pending = n;
+        m_next = 0;
+        m_generation++;
+        m_cv.notify_all();
+        lk.unlock();
+        Work();
+        lk.lock();
+        m_doneCv.wait(lk, [&] { return m_pending == 0; });
+    }
 
-    // Open output file
-    if (!(out_ctx->oformat->flags & AVFMT_NOFILE)) {
-        ret = avio_open(&out_ctx->pb, out_filename.c_str(), AVIO_FLAG_WRITE);
-        if (ret < 0) { char errbuf[256]; av_strerror(ret, errbuf, sizeof(errbuf)); Log(std::string("Could not open output file: ") + errbuf); avcodec_free_context(&enc_ctx); avformat_free_context(out_ctx); avcodec_free_context(&dec_ctx); avformat_close_input(&in_ctx); m_handler->setRunning(false); return 0; }
+private:
+    void Work() {
+        for (;;) {
+            int i = m_next.fetch_add(1);
+            if (i >= m_count) return;
+            (*m_fn)(i);
+            if (m_pending.fetch_sub(1) == 1) {
+                std::lock_guard<std::mutex> lk(m_lock);
+                m_doneCv.notify_all();
+            }
+        }
     }
 
-    // Write header
-    ret = avformat_write_header(out_ctx, NULL);
-    if (ret < 0) { Log("Error occurred when writing header"); if (!(out_ctx->oformat->flags & AVFMT_NOFILE)) avio_closep(&out_ctx->pb); avcodec_free_context(&enc_ctx); avformat_free_context(out_ctx); avcodec_free_context(&dec_ctx); avformat_close_input(&in_ctx); m_handler->setRunning(false); return 0; }
+    void Worker() {
+        uint64_t seen = 0;
+        std::unique_lock<std::mutex> lk(m_lock);
+        for (;;) {
+            m_cv.wait(lk, [&] { return m_stop || m_generation != seen; });
+            if (m_stop) return;
+            seen = m_generation;
+            lk.unlock();
+            Work();
+            lk.lock();
+        }
+    }
 
-    // Allocate frames/packets
-    AVFrame* frame = av_frame_alloc();
-    AVFrame* sws_frame = av_frame_alloc();
-    AVPacket* pkt = av_packet_alloc();
-    AVPacket* enc_pkt = av_packet_alloc();
+    std::vector<std::thread> m_threads;
+    std::mutex m_lock;
+    std::condition_variable m_cv, m_doneCv;
+    const std::function<void(int)>* m_fn = nullptr;
+    std::atomic<int> m_count{ 0 }, m_next{ 0 }, m_pending{ 0 };
+    uint64_t m_generation = 0;
+    bool m_stop = false;
+};
 
-    // Prepare swscale for pixel format conversion
-    struct SwsContext* sws_ctx = sws_getContext(
-        dec_ctx->width, dec_ctx->height, dec_ctx->pix_fmt,
-        enc_ctx->width, enc_ctx->height, enc_ctx->pix_fmt,
-        SWS_BILINEAR, NULL, NULL, NULL);
+// Planar formats with 1 or 2 bytes per sample in native byte order (yuv420p, yuv422p10le, gray...)
+static bool deinterlace_supported(AVPixelFormat fmt) {
+    const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get(fmt);
+    if (!desc || (desc->flags & (AV_PIX_FMT_FLAG_PAL | AV_PIX_FMT_FLAG_BITSTREAM | AV_PIX_FMT_FLAG_HWACCEL | AV_PIX_FMT_FLAG_BE)))
+        return false;
+    if (!(desc->flags & AV_PIX_FMT_FLAG_PLANAR) && desc->nb_components > 1) return false;
+    for (int i = 0; i < desc->nb_components; ++i) {
+        if (desc->comp[i].depth > 16 || desc->comp[i].shift != 0) return false;
+        if (desc->comp[i].step != (desc->comp[i].depth > 8 ? 2 : 1)) return false;
+    }
+    return true;
+}
 
-    sws_frame->format = enc_ctx->pix_fmt;
-    sws_frame->width  = enc_ctx->width;
-    sws_frame->height = enc_ctx->height;
-    av_frame_get_buffer(sws_frame, 32);
+// Plane geometry of a supported format: number of planes, and per plane the width/height in samples.
+static int plane_sizes(AVPixelFormat fmt, int width, int height, int w[4], int h[4]) {
+    const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get(fmt);
+    int planes = 0;
+    for (int i = 0; i < desc->nb_components; ++i) {
+        int p = desc->comp[i].plane;
+        bool chroma = !(desc->flags & AV_PIX_FMT_FLAG_RGB) && (i == 1 || i == 2);
+        w[p] = chroma ? -((-width) >> desc->log2_chroma_w) : width;
+        h[p] = chroma ? -((-height) >> desc->log2_chroma_h) : height;
+        planes = std::max(planes, p + 1);
+    }
+    return planes;
+}
 
-    // Read packets and process
-    while (true) {
-        ret = av_read_frame(in_ctx, pkt);
-        if (ret < 0) break; // EOF or error
+// Frame with its own buffers, or NULL
+static AVFrame* alloc_video_frame(int width, int height, AVPixelFormat fmt) {
+    AVFrame* f = av_frame_alloc();
+    if (!f) return nullptr;
+    f->format = fmt;
+    f->width = width;
+    f->height = height;
+    if (av_frame_get_buffer(f, 32) < 0) av_frame_free(&f);
+    return f;
+}
 
-        if ((int)pkt->stream_index == video_stream_index) {
-            // send to decoder
-            ret = avcodec_send_packet(dec_ctx, pkt);
-            if (ret < 0) { Log("Error sending packet to decoder"); av_packet_unref(pkt); break; }
+// Comb measure of one frame's first plane: samples that stick out from both vertical neighbours
+// (one line apart, i.e. from the other field) against the same test on lines two apart (same
+// field). Moving interlaced content combs only across fields; progressive detail shows in both.
+// Returns 1 for a combed frame, 0 for a clean one with vertical detail, -1 for a picture too
+// flat to tell (black, fades, plain titles).
+static int frame_combing(const AVFrame* f) {
+    const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get((AVPixelFormat)f->format);
+    int shift = desc->comp[0].depth - 8;
+    bool wide = desc->comp[0].depth > 8;
+    auto px = [&](int x, int y) -> int {
+        const uint8_t* row = f->data[0] + (ptrdiff_t)y * f->linesize[0];
+        return wide ? (reinterpret_cast<const uint16_t*>(row)[x] >> shift) : row[x];
+    };
+    const int kThreshold = 10 * 10;  // both neighbours differ by more than ~10 levels, same direction
+    int64_t across = 0, within = 0, samples = 0;
+    for (int y = 2; y + 2 < f->height; y += 2) {
+        for (int x = 0; x < f->width; x += 2) {
+            int b = px(x, y);
+            if ((px(x, y - 1) - b) * (px(x, y + 1) - b) > kThreshold) across++;
+            if ((px(x, y - 2) - b) * (px(x, y + 2) - b) > kThreshold) within++;
+            samples++;
+        }
+    }
+    if (across * 200 > samples && across > 2 * within) return 1;
+    return (across + within) * 200 > samples ? 0 : -1;
+}
 
-            while (ret >= 0) {
-                ret = avcodec_receive_frame(dec_ctx, frame);
-                if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) break;
-                else if (ret < 0) { Log("Error during decoding"); goto cleanup; }
-
-                // Convert pixel format to encoder's format
-                sws_scale(sws_ctx, frame->data, frame->linesize, 0, dec_ctx->height, sws_frame->data, sws_frame->linesize);
-                sws_frame->pts = frame->pts;
-
-                // send to encoder
-                ret = avcodec_send_frame(enc_ctx, sws_frame);
-                if (ret < 0) { Log("Error sending frame to encoder"); goto cleanup; }
-
-                while (ret >= 0) {
-                    ret = avcodec_receive_packet(enc_ctx, enc_pkt);
-                    if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) break;
-                    else if (ret < 0) { Log("Error during encoding"); goto cleanup; }
-
-                    // rescale and write
-                    av_packet_rescale_ts(enc_pkt, enc_ctx->time_base, out_video_stream->time_base);
-                    enc_pkt->stream_index = out_video_stream->index; // use stream index assigned by avformat
-                    ret = av_interleaved_write_frame(out_ctx, enc_pkt);
-                    av_packet_unref(enc_pkt);
-                    if (ret < 0) { Log("Error muxing encoded packet"); goto cleanup; }
-                }
+struct InterlaceInfo {
+    bool interlaced = false;
+    bool top_field_first = true;
+    int sampled = 0;
+    int combed = 0;
+};
 
-                // progress (approx)
-                if (in_ctx->duration > 0 && frame->pts != AV_NOPTS_VALUE) {
-                    int pct = (int)((frame->pts * av_q2d(in_ctx->streams[video_stream_index]->time_base) * AV_TIME_BASE) * 100 / in_ctx->duration);
-                    if (pct < 0) pct = 0; if (pct > 100) pct = 100;
-                    PostProgress(pct);
-                }
+// Decode a few frames at kSamplePoints positions spread over the input and count combed ones
+// (stream_index < 0 picks the best video stream);
+// the stream counts as interlaced when at least half are. Field order comes from the decoder's
+// frame flags, else the stream's field_order, else top field first.
+static int detect_interlace(const std::string& in, int stream_index, const EncodeProfile& prof, InterlaceInfo* info) {
+    const int kSamplePoints = 6, kFramesPerPoint = 4;
+    *info = InterlaceInfo();
+    AVFormatContext* in_ctx = nullptr;
+    AVCodecContext* dec_ctx = nullptr;
+    AVPacket* pkt = av_packet_alloc();
+    AVFrame* frame = av_frame_alloc();
+    int flagged = 0, tff = 0;
+    int ret = avformat_open_input(&in_ctx, in.c_str(), NULL, NULL);
+    if (ret < 0 || (ret = avformat_find_stream_info(in_ctx, NULL)) < 0) goto done;
+    if (stream_index < 0 && (ret = stream_index = av_find_best_stream(in_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0)) < 0) goto done;
+    for (unsigned i = 0; i < in_ctx->nb_streams; ++i)
+        if ((int)i != stream_index) in_ctx->streams[i]->discard = AVDISCARD_ALL;
+    {
+        AVStream* st = in_ctx->streams[stream_index];
+        const AVCodec* dec = avcodec_find_decoder(st->codecpar->codec_id);
+        if (!dec) { ret = AVERROR_DECODER_NOT_FOUND; goto done; }
+        dec_ctx = avcodec_alloc_context3(dec);
+        avcodec_parameters_to_context(dec_ctx, st->codecpar);
+        if (prof.dec_threads > 0) dec_ctx->thread_count = prof.dec_threads;
+        if ((ret = avcodec_open2(dec_ctx, dec, NULL)) < 0) goto done;
+        if (!deinterlace_supported(dec_ctx->pix_fmt)) { ret = AVERROR(ENOSYS); goto done; }
 
-                if (TestDestroy()) { Log("Conversion cancelled"); goto cleanup; }
+        int points = in_ctx->duration > 0 ? kSamplePoints : 1;
+        for (int p = 0; p < points; ++p) {
+            if (in_ctx->duration > 0) {
+                int64_t ts = av_rescale_q(in_ctx->duration * (2 * p + 1) / (2 * points), AV_TIME_BASE_Q, st->time_base);
+                if (av_seek_frame(in_ctx, stream_index, ts, AVSEEK_FLAG_BACKWARD) < 0) continue;
+                avcodec_flush_buffers(dec_ctx);
             }
-        } else {
-            // copy non-video streams (remux)
-            AVStream* in_stream = in_ctx->streams[pkt->stream_index];
-            if (pkt->stream_index >= (int)stream_mapping.size() || stream_mapping[pkt->stream_index] < 0) {
+            int want = in_ctx->duration > 0 ? kFramesPerPoint : kSamplePoints * kFramesPerPoint;
+            int got = 0;
+            while (got < want && av_read_frame(in_ctx, pkt) >= 0) {
+                if (pkt->stream_index == stream_index) avcodec_send_packet(dec_ctx, pkt);
                 av_packet_unref(pkt);
-                continue;
+                while (got < want && avcodec_receive_frame(dec_ctx, frame) >= 0) {
+                    got++;
+                    info->sampled++;
+                    if (frame_combing(frame) > 0) info->combed++;
+                    if (frame->flags & AV_FRAME_FLAG_INTERLACED) {
+                        flagged++;
+                        if (frame->flags & AV_FRAME_FLAG_TOP_FIELD_FIRST) tff++;
+                    }
+                    av_frame_unref(frame);
+                }
             }
-            pkt->stream_index = stream_mapping[pkt->stream_index];
+        }
+        info->interlaced = info->sampled > 0 && info->combed * 2 >= info->sampled;
+        if (flagged > 0) info->top_field_first = tff * 2 >= flagged;
+        else info->top_field_first = st->codecpar->field_order != AV_FIELD_BB && st->codecpar->field_order != AV_FIELD_BT;
+        ret = 0;
+    }
+done:
+    av_frame_free(&frame);
+    av_packet_free(&pkt);
+    avcodec_free_context(&dec_ctx);
+    avformat_close_input(&in_ctx);
+    return ret;
+}
 
-            AVStream* out_stream = out_ctx->streams[pkt->stream_index];
-            pkt->pts = av_rescale_q_rnd(pkt->pts, in_stream->time_base, out_stream->time_base,
-                                       (AVRounding)(AV_ROUND_NEAR_INF|AV_ROUND_PASS_MINMAX));
-            pkt->dts = av_rescale_q_rnd(pkt->dts, in_stream->time_base, out_stream->time_base,
-                                       (AVRounding)(AV_ROUND_NEAR_INF|AV_ROUND_PASS_MINMAX));
-            pkt->duration = av_rescale_q(pkt->duration, in_stream->time_base, out_stream->time_base);
-            pkt->pos = -1;
+static std::string interlace_summary(const InterlaceInfo& il) {
+    return "Interlace detection: " + std::to_string(il.combed) + " of " + std::to_string(il.sampled) +
+           " sampled frames combed (" + (il.top_field_first ? "top" : "bottom") + " field first), " +
+           (il.interlaced ? "treating as interlaced" : "treating as progressive");
+}
 
-            ret = av_interleaved_write_frame(out_ctx, pkt);
-            if (ret < 0) { Log("Error muxing packet for non-video stream"); av_packet_unref(pkt); goto cleanup; }
-            av_packet_unref(pkt);
+// Interlace decision for the main decode without a sampling pass of its own. The stream's
+// field_order settles it when the demuxer or decoder states it; otherwise the first kFrames
+// decoded frames are held back and measured. They are conclusive when at least half are
+// combed, or none is while most show vertical detail; only inconclusive starts (black leaders,
+// fades) fall back to detect_interlace(). Held frames are replayed in order afterwards.
+class InterlaceProbe {
+public:
+    enum { kFrames = 8 };
+
+    ~InterlaceProbe() {
+        for (AVFrame*& f : m_frames) av_frame_free(&f);
+    }
+
+    // Fills *info and returns true when `order` alone decides.
+    static bool FromFieldOrder(AVFieldOrder order, InterlaceInfo* info) {
+        *info = InterlaceInfo();
+        switch (order) {
+        case AV_FIELD_PROGRESSIVE: return true;
+        case AV_FIELD_TT: case AV_FIELD_TB: info->interlaced = true; return true;
+        case AV_FIELD_BB: case AV_FIELD_BT: info->interlaced = true; info->top_field_first = false; return true;
+        default: return false;
         }
     }
 
-    // flush encoder
-    avcodec_send_frame(enc_ctx, NULL);
+    void Start() { m_pending = true; }
+    bool Pending() const { return m_pending; }
+
+    // Hold a reference to (or, for unreferenced frames, a copy of) `f`. Returns 1 once kFrames
+    // are held, 0 while collecting, or a negative AVERROR.
+    int Add(const AVFrame* f) {
+        AVFrame* held = av_frame_clone(f);
+        if (!held) return AVERROR(ENOMEM);
+        m_frames.push_back(held);
+        int comb = frame_combing(f);
+        m_info.sampled++;
+        if (comb > 0) m_info.combed++;
+        if (comb >= 0) m_detailed++;
+        if (f->flags & AV_FRAME_FLAG_INTERLACED) {
+            m_flagged++;
+            if (f->flags & AV_FRAME_FLAG_TOP_FIELD_FIRST) m_tff++;
+        }
+        return (int)m_frames.size() >= kFrames ? 1 : 0;
+    }
+
+    // Decision from the held frames (field order as in detect_interlace); false if inconclusive.
+    bool Decide(AVFieldOrder order, InterlaceInfo* info) const {
+        *info = m_info;
+        info->interlaced = m_info.sampled > 0 && m_info.combed * 2 >= m_info.sampled;
+        if (m_flagged > 0) info->top_field_first = m_tff * 2 >= m_flagged;
+        else info->top_field_first = order != AV_FIELD_BB && order != AV_FIELD_BT;
+        return info->interlaced || (m_info.combed == 0 && m_info.sampled > 0 && m_detailed * 2 >= m_info.sampled);
+    }
+
+    // Stop collecting and pass the held frames to fn in decode order; stops at the first error.
+    template <typename Fn>
+    int Replay(Fn&& fn) {
+        m_pending = false;
+        int ret = 0;
+        for (AVFrame*& f : m_frames) {
+            if (ret >= 0) ret = fn(f);
+            av_frame_free(&f);
+        }
+        m_frames.clear();
+        return ret;
+    }
+
+private:
+    bool m_pending = false;
+    std::vector<AVFrame*> m_frames;
+    InterlaceInfo m_info;
+    int m_detailed = 0, m_flagged = 0, m_tff = 0;
+};
+
+static std::string field_order_summary(const InterlaceInfo& il) {
+    return std::string("Interlace detection: stream field order says ") +
+           (il.interlaced ? (il.top_field_first ? "top field first" : "bottom field first") : "progressive");
+}
+
+// yadif-style deinterlacer, one output frame per input frame. The first field in time is kept;
+// each line of the other field is the temporal average of the neighbouring frames, limited by
+// the spatial (edge-directed) interpolation wherever the picture moves. Output is one frame
+// behind the input. Rows are sliced across a SlicePool; input frames are copied, so callers may
+// pass frames they reuse (decoder output, shared-memory ring slots).
+class Deinterlacer {
+public:
+    ~Deinterlacer() {
+        for (AVFrame*& f : m_frames) av_frame_free(&f);
+        av_frame_free(&m_out);
+    }
+
+    bool Active() const { return m_out != nullptr; }
+
+    // `threads` slice threads (0 = all cores). Fails with AVERROR(ENOSYS) for unsupported formats.
+    int Init(int width, int height, AVPixelFormat fmt, bool top_field_first, int threads) {
+        if (!deinterlace_supported(fmt)) return AVERROR(ENOSYS);
+        m_planes = plane_sizes(fmt, width, height, m_w, m_h);
+        m_wide = av_pix_fmt_desc_get(fmt)->comp[0].depth > 8;
+        m_tff = top_field_first;
+        for (AVFrame*& f : m_frames) {
+            if (!(f = alloc_video_frame(width, height, fmt))) return AVERROR(ENOMEM);
+        }
+        if (!(m_out = alloc_video_frame(width, height, fmt))) return AVERROR(ENOMEM);
+        m_pool.reset(new SlicePool(threads > 0 ? threads : std::max(1u, std::thread::hardware_concurrency())));
+        return 0;
+    }
+
+    // Queue a copy of `in` (NULL at end of stream). Returns 1 with *out set to the next
+    // deinterlaced frame (valid until the next call), 0 if none is ready, or a negative AVERROR.
+    int Filter(const AVFrame* in, AVFrame** out) {
+        if (!in) {
+            if (m_queued == 0 || m_flushed) return 0;
+            m_flushed = true;
+            if (m_queued == 1) return Produce(Frame(0), Frame(0), Frame(0), out);
+            return Produce(Frame(1), Frame(0), Frame(0), out); // last frame: no successor
+        }
+        m_head = (m_head + 1) % 3;
+        AVFrame* slot = m_frames[m_head];
+        int ret = av_frame_copy(slot, in);
+        if (ret < 0) return ret;
+        av_frame_copy_props(slot, in);
+        m_queued++;
+        if (m_queued == 1) return 0;
+        // Frame(0) is the newest input; the one before it is output now
+        return Produce(m_queued == 2 ? Frame(1) : Frame(2), Frame(1), Frame(0), out);
+    }
+
+private:
+    // age 0 = newest queued frame
+    AVFrame* Frame(int age) const { return m_frames[(m_head + 3 - age) % 3]; }
+
+    int Produce(const AVFrame* prev, const AVFrame* cur, const AVFrame* next, AVFrame** out) {
+        int ret = av_frame_make_writable(m_out);
+        if (ret < 0) return ret;
+        av_frame_copy_props(m_out, cur);
+        m_out->flags &= ~(AV_FRAME_FLAG_INTERLACED | AV_FRAME_FLAG_TOP_FIELD_FIRST);
+        int slices = m_pool->Threads() * 2;
+        m_pool->Run(slices, [&](int s) {
+            for (int p = 0; p < m_planes; ++p) {
+                int y0 = m_h[p] * s / slices, y1 = m_h[p] * (s + 1) / slices;
+                if (m_wide) FilterRows<uint16_t>(p, y0, y1, prev, cur, next);
+                else FilterRows<uint8_t>(p, y0, y1, prev, cur, next);
+            }
+        });
+        *out = m_out;
+        return 1;
+    }
+
+    template <typename T>
+    void FilterRows(int p, int y0, int y1, const AVFrame* prev, const AVFrame* cur, const AVFrame* next) {
+        const int w = m_w[p], h = m_h[p];
+        const int keep = m_tff ? 0 : 1;  // parity of the lines of the field that comes first
+        // the interpolated field lies between cur and next in time (after the kept field)
+        const AVFrame* prev2 = keep ? prev : cur;
+        const AVFrame* next2 = keep ? cur : next;
+        auto row = [&](const AVFrame* f, int y) {
+            return reinterpret_cast<const T*>(f->data[p] + (ptrdiff_t)y * f->linesize[p]);
+        };
+        for (int y = y0; y < y1; ++y) {
+            T* dst = reinterpret_cast<T*>(m_out->data[p] + (ptrdiff_t)y * m_out->linesize[p]);
+            if ((y & 1) == keep || h < 3) {
+                memcpy(dst, row(cur, y), w * sizeof(T));
+                continue;
+            }
+            int up = y > 0 ? y - 1 : y + 1, dn = y + 1 < h ? y + 1 : y - 1;
+            int up2 = y >= 2 ? y - 2 : y, dn2 = y + 2 < h ? y + 2 : y;
+            YadifLine(dst, w, row(cur, up), row(cur, dn), row(prev, up), row(prev, dn), row(next, up), row(next, dn),
+                      row(prev2, y), row(next2, y), row(prev2, up2), row(next2, up2), row(prev2, dn2), row(next2, dn2));
+        }
+    }
+
+    template <typename T>
+    static void YadifLine(T* dst, int w, const T* cu, const T* cd, const T* pu, const T* pd, const T* nu, const T* nd,
+                          const T* p2, const T* n2, const T* p2u, const T* n2u, const T* p2d, const T* n2d) {
+        for (int x = 0; x < w; ++x) {
+            int c = cu[x], e = cd[x];
+            int d = (p2[x] + n2[x]) >> 1;
+            int diff = std::max({ std::abs(p2[x] - n2[x]) >> 1,
+                                  (std::abs(pu[x] - c) + std::abs(pd[x] - e)) >> 1,
+                                  (std::abs(nu[x] - c) + std::abs(nd[x] - e)) >> 1 });
+            int pred = (c + e) >> 1;
+            if (x >= 3 && x < w - 3) {
+                // edge-directed interpolation: follow the diagonal with the best match
+                int best = std::abs(cu[x - 1] - cd[x - 1]) + std::abs(c - e) + std::abs(cu[x + 1] - cd[x + 1]) - 1;
+                auto check = [&](int j) {
+                    int score = std::abs(cu[x - 1 + j] - cd[x - 1 - j]) + std::abs(cu[x + j] - cd[x - j])
+                              + std::abs(cu[x + 1 + j] - cd[x + 1 - j]);
+                    if (score >= best) return false;
+                    best = score;
+                    pred = (cu[x + j] + cd[x - j]) >> 1;
+                    return true;
+                };
+                if (check(-1)) check(-2);
+                if (check(1)) check(2);
+            }
+            // spatial check: don't let the temporal average smear across still vertical detail
+            int b = (p2u[x] + n2u[x]) >> 1, f = (p2d[x] + n2d[x]) >> 1;
+            int mx = std::max({ d - e, d - c, std::min(b - c, f - e) });
+            int mn = std::min({ d - e, d - c, std::max(b - c, f - e) });
+            diff = std::max({ diff, mn, -mx });
+            if (pred > d + diff) pred = d + diff;
+            else if (pred < d - diff) pred = d - diff;
+            dst[x] = (T)pred;
+        }
+    }
+
+    AVFrame* m_frames[3] = { nullptr, nullptr, nullptr };
+    AVFrame* m_out = nullptr;
+    int m_head = 0;
+    int64_t m_queued = 0;
+    bool m_flushed = false;
+    int m_planes = 0;
+    int m_w[4] = { 0 }, m_h[4] = { 0 };
+    bool m_wide = false;
+    bool m_tff = true;
+    std::unique_ptr<SlicePool> m_pool;
+};
+
+// ---- HDR to SDR tone mapping ----
+//
+// PQ (HDR10) and HLG sources are mapped to SDR BT.709 in front of the scaler; the frame keeps its
+// pixel format and size, only sample values and color tags change. Per pixel: Y'CbCr to R'G'B'
+// with the source matrix, linear light through a table, BT.2020 to BT.709 primaries, the tone
+// curve on max(R,G,B) so hues are kept, BT.709 OETF through a table, then limited range Y'CbCr.
+// HLG gets its OOTF (system gamma on scene luminance) between the first two steps. With SSE2
+// every step runs four pixels at a time (table lookups are gathers with AVX2, lane loads
+// otherwise); other targets and row tails take the scalar path. Rows are sliced across a SlicePool.
+
+enum class ToneCurve { Clip, Reinhard, Hable, Mobius };
+
+#ifdef HAVE_SSE2
+// Four 8 or 16 bit samples as floats
+static inline __m128 load4_ps(const uint8_t* p) {
+    int v;
+    memcpy(&v, p, 4);
+    __m128i z = _mm_setzero_si128();
+    return _mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(v), z), z));
+}
+static inline __m128 load4_ps(const uint16_t* p) {
+    return _mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(p)), _mm_setzero_si128()));
+}
+
+// Two samples, each repeated (horizontally subsampled chroma under four luma samples)
+static inline __m128 load2x2_ps(const uint8_t* p) {
+    __m128i z = _mm_setzero_si128();
+    __m128 v = _mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(p[0] | p[1] << 8), z), z));
+    return _mm_unpacklo_ps(v, v);
+}
+static inline __m128 load2x2_ps(const uint16_t* p) {
+    __m128 v = _mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_cvtsi32_si128((int)(p[0] | (unsigned)p[1] << 16)), _mm_setzero_si128()));
+    return _mm_unpacklo_ps(v, v);
+}
+
+// Store four non-negative ints as 8 or 16 bit samples (saturating)
+static inline void store4_epi32(uint8_t* p, __m128i v) {
+    v = _mm_packs_epi32(v, v);
+    int out = _mm_cvtsi128_si32(_mm_packus_epi16(v, v));
+    memcpy(p, &out, 4);
+}
+static inline void store4_epi32(uint16_t* p, __m128i v) {
+    // no unsigned 32 -> 16 bit pack in SSE2: bias into the signed range and back
+    v = _mm_sub_epi32(v, _mm_set1_epi32(32768));
+    v = _mm_packs_epi32(v, v);
+    _mm_storel_epi64(reinterpret_cast<__m128i*>(p), _mm_xor_si128(v, _mm_set1_epi16((short)0x8000)));
+}
+
+static inline __m128 gather_ps(const float* table, __m128i idx) {
+#ifdef __AVX2__
+    return _mm_i32gather_ps(table, idx, 4);
+#else
+    alignas(16) int i[4];
+    _mm_store_si128(reinterpret_cast<__m128i*>(i), idx);
+    return _mm_setr_ps(table[i[0]], table[i[1]], table[i[2]], table[i[3]]);
+#endif
+}
+#endif
+
+static bool hdr_transfer(AVColorTransferCharacteristic trc) {
+    return trc == AVCOL_TRC_SMPTE2084 || trc == AVCOL_TRC_ARIB_STD_B67;
+}
+
+// "hable" (default when empty), "reinhard", "mobius" or "clip"; false for "off" and unknown names
+static bool parse_tone_curve(const std::string& name, ToneCurve* curve) {
+    if (name.empty() || name == "hable") *curve = ToneCurve::Hable;
+    else if (name == "reinhard") *curve = ToneCurve::Reinhard;
+    else if (name == "mobius") *curve = ToneCurve::Mobius;
+    else if (name == "clip") *curve = ToneCurve::Clip;
+    else return false;
+    return true;
+}
+
+// Whether frames from dec_ctx get tone mapped: an HDR transfer in a planar YUV format of up to
+// 16 bits, and prof.tonemap not "off". open_video_encoder() tags the output from the same test.
+static bool tonemap_wanted(const AVCodecContext* dec_ctx, const EncodeProfile& prof) {
+    ToneCurve curve;
+    if (!parse_tone_curve(prof.tonemap, &curve) || !hdr_transfer(dec_ctx->color_trc)) return false;
+    const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get(dec_ctx->pix_fmt);
+    return deinterlace_supported(dec_ctx->pix_fmt) && desc->nb_components == 3 && !(desc->flags & AV_PIX_FMT_FLAG_RGB);
+}
+
+// Kr/Kb of a Y'CbCr matrix; unspecified and unknown matrices are taken as BT.709
+static void luma_coefficients(AVColorSpace cs, double* kr, double* kb) {
+    switch (cs) {
+    case AVCOL_SPC_BT2020_NCL:
+    case AVCOL_SPC_BT2020_CL: *kr = 0.2627; *kb = 0.0593; break;
+    case AVCOL_SPC_BT470BG:
+    case AVCOL_SPC_SMPTE170M: *kr = 0.299; *kb = 0.114; break;
+    default: *kr = 0.2126; *kb = 0.0722; break;
+    }
+}
+
+class ToneMapper {
+public:
+    ~ToneMapper() { av_frame_free(&m_out); }
+
+    bool Active() const { return m_out != nullptr; }
+
+    // "PQ -> BT.709, hable, peak 1000 nits"
+    std::string Describe() const {
+        static const char* names[] = { "clip", "reinhard", "hable", "mobius" };
+        return std::string(m_pq ? "PQ" : "HLG") + " -> BT.709, " + names[(int)m_curve]
+             + ", peak " + std::to_string((int)(m_peak * kWhiteNits + 0.5)) + " nits";
+    }
+
+    // Stays inactive (and returns 0) unless tonemap_wanted(). `threads` slice threads, 0 = all cores.
+    int Init(const AVCodecContext* dec_ctx, const EncodeProfile& prof, int threads) {
+        if (!tonemap_wanted(dec_ctx, prof)) return 0;
+        parse_tone_curve(prof.tonemap, &m_curve);
+        AVPixelFormat fmt = dec_ctx->pix_fmt;
+        const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get(fmt);
+        plane_sizes(fmt, dec_ctx->width, dec_ctx->height, m_w, m_h);
+        m_cw = desc->log2_chroma_w;
+        m_ch = desc->log2_chroma_h;
+        m_depth = desc->comp[0].depth;
+        m_pq = dec_ctx->color_trc == AVCOL_TRC_SMPTE2084;
+        m_gamut = dec_ctx->color_primaries != AVCOL_PRI_BT709; // HDR material is BT.2020 unless tagged otherwise
+
+        // input Y'CbCr -> R'G'B', normalized to [0, 1] / [-0.5, 0.5]
+        double kr, kb;
+        luma_coefficients(dec_ctx->colorspace == AVCOL_SPC_UNSPECIFIED ? AVCOL_SPC_BT2020_NCL : dec_ctx->colorspace, &kr, &kb);
+        double kg = 1.0 - kr - kb;
+        m_rv = (float)(2 * (1 - kr));
+        m_bu = (float)(2 * (1 - kb));
+        m_gu = (float)(2 * kb * (1 - kb) / kg);
+        m_gv = (float)(2 * kr * (1 - kr) / kg);
+        float s = (float)(1 << (m_depth - 8)), maxv = (float)((1 << m_depth) - 1);
+        if (dec_ctx->color_range == AVCOL_RANGE_JPEG) {
+            m_ys = 1.0f / maxv; m_yo = 0.0f;
+            m_cs = 1.0f / maxv; m_co = -(float)(1 << (m_depth - 1)) / maxv;
+        } else {
+            m_ys = 1.0f / (219 * s); m_yo = -16.0f / 219;
+            m_cs = 1.0f / (224 * s); m_co = -128.0f / 224;
+        }
+
+        // HLG scene luminance, in the source primaries
+        double lkr, lkb;
+        luma_coefficients(m_gamut ? AVCOL_SPC_BT2020_NCL : AVCOL_SPC_BT709, &lkr, &lkb);
+        m_lr = (float)lkr; m_lg = (float)(1.0 - lkr - lkb); m_lb = (float)lkb;
+
+        for (int i = 0; i < kTableSize; ++i) {
+            double v = (double)i / (kTableSize - 1);
+            m_eotf[i] = (float)(m_pq ? pq_eotf(v) / kWhiteNits : hlg_scene(v));
+            double lin = v * v; // output and OOTF tables are indexed by sqrt(linear) for precision in the shadows
+            m_oetf[i] = (float)(lin < 0.018 ? 4.5 * lin : 1.099 * std::pow(lin, 0.45) - 0.099);
+            m_ootf[i] = (float)(kHlgPeakNits / kWhiteNits * std::pow(lin, kHlgGamma - 1.0));
+        }
+        SetPeak(kDefaultPeakNits);
+
+        if (!(m_out = alloc_video_frame(dec_ctx->width, dec_ctx->height, fmt))) return AVERROR(ENOMEM);
+        m_pool.reset(new SlicePool(threads > 0 ? threads : std::max(1u, std::thread::hardware_concurrency())));
+        m_slices = std::max(1, std::min(m_h[1], m_pool->Threads() * 2));
+        m_scratch.resize(m_slices);
+        for (Scratch& sc : m_scratch) sc.Resize(m_w[1]);
+        return 0;
+    }
+
+    // Tone map `in` into an internal frame (valid until the next call) tagged BT.709 limited range.
+    int Apply(const AVFrame* in, AVFrame** out) {
+        int ret = av_frame_make_writable(m_out);
+        if (ret < 0) return ret;
+        UpdatePeak(in);
+        av_frame_copy_props(m_out, in);
+        av_frame_remove_side_data(m_out, AV_FRAME_DATA_MASTERING_DISPLAY_METADATA);
+        av_frame_remove_side_data(m_out, AV_FRAME_DATA_CONTENT_LIGHT_LEVEL);
+        m_out->color_primaries = AVCOL_PRI_BT709;
+        m_out->color_trc = AVCOL_TRC_BT709;
+        m_out->colorspace = AVCOL_SPC_BT709;
+        m_out->color_range = AVCOL_RANGE_MPEG;
+        m_pool->Run(m_slices, [&](int s) {
+            int y0 = m_h[1] * s / m_slices, y1 = m_h[1] * (s + 1) / m_slices;
+            for (int cy = y0; cy < y1; ++cy) {
+                if (m_depth > 8) MapRows<uint16_t>(in, cy, &m_scratch[s]);
+                else MapRows<uint8_t>(in, cy, &m_scratch[s]);
+            }
+        });
+        *out = m_out;
+        return 0;
+    }
+
+private:
+    static constexpr int kTableSize = 4096;
+    static constexpr double kWhiteNits = 100.0;      // SDR reference white = linear 1.0
+    static constexpr double kDefaultPeakNits = 1000.0;
+    static constexpr double kHlgPeakNits = 1000.0;   // HLG reference display
+    static constexpr double kHlgGamma = 1.2;         // system gamma at kHlgPeakNits
+
+    struct Scratch {
+        std::vector<float> sr, sg, sb; // per chroma sample: sums of output R'G'B'
+        void Resize(int cw) {
+            for (auto* v : { &sr, &sg, &sb }) v->resize(cw);
+        }
+    };
+
+    // SMPTE ST 2084: code value -> nits
+    static double pq_eotf(double v) {
+        const double m1 = 0.1593017578125, m2 = 78.84375, c1 = 0.8359375, c2 = 18.8515625, c3 = 18.6875;
+        double e = std::pow(v, 1.0 / m2);
+        return 10000.0 * std::pow(std::max(e - c1, 0.0) / (c2 - c3 * e), 1.0 / m1);
+    }
+
+    // ARIB STD-B67 inverse OETF: code value -> scene linear light in [0, 1]. The OOTF (m_ootf)
+    // depends on the luminance of all three channels, so it cannot be folded into this table.
+    static double hlg_scene(double v) {
+        const double a = 0.17883277, b = 0.28466892, c = 0.55991073;
+        return v <= 0.5 ? v * v / 3.0 : (std::exp((v - c) / a) + b) / 12.0;
+    }
+
+    static float Hable(float x) {
+        const float A = 0.15f, B = 0.50f, C = 0.10f, D = 0.20f, E = 0.02f, F = 0.30f;
+        return (x * (A * x + C * B) + D * E) / (x * (A * x + B) + D * F) - E / F;
+    }
+
+    // Peak from MaxCLL, else the mastering display, else 1000 nits; HLG is always a 1000 nit signal
+    void UpdatePeak(const AVFrame* f) {
+        double nits = 0;
+        if (m_pq) {
+            if (AVFrameSideData* sd = av_frame_get_side_data(f, AV_FRAME_DATA_CONTENT_LIGHT_LEVEL))
+                nits = ((const AVContentLightMetadata*)sd->data)->MaxCLL;
+            AVFrameSideData* sd = av_frame_get_side_data(f, AV_FRAME_DATA_MASTERING_DISPLAY_METADATA);
+            if (nits <= 0 && sd && ((const AVMasteringDisplayMetadata*)sd->data)->has_luminance)
+                nits = av_q2d(((const AVMasteringDisplayMetadata*)sd->data)->max_luminance);
+        }
+        if (nits <= 0) nits = kDefaultPeakNits;
+        if (std::fabs(nits / kWhiteNits - m_peak) > 1e-6) SetPeak(nits);
+    }
+
+    // Curve constants for the peak (in units of reference white), so that curve(peak) = 1
+    void SetPeak(double nits) {
+        m_peak = std::max(1.0, nits / kWhiteNits);
+        float p = (float)m_peak;
+        switch (m_curve) {
+        case ToneCurve::Reinhard: m_k[0] = 1.0f / (p * p); break;
+        case ToneCurve::Hable: m_k[0] = 1.0f / Hable(p); break;
+        case ToneCurve::Mobius: {
+            const float j = 0.3f;
+            float a = -j * j * (p - 1.0f) / (j * j - 2.0f * j + p);
+            float b = (j * j - 2.0f * j * p + p) / std::max(p - 1.0f, 1e-6f);
+            m_k[0] = j; m_k[1] = a; m_k[2] = b; m_k[3] = (b * b + 2.0f * b * j + j * j) / (b - a);
+            break;
+        }
+        case ToneCurve::Clip: break;
+        }
+    }
+
+    template <ToneCurve C>
+    static float Curve(float x, const float* k) {
+        if (C == ToneCurve::Reinhard) return x * (1.0f + x * k[0]) / (1.0f + x);
+        if (C == ToneCurve::Hable) return Hable(x) * k[0];
+        if (C == ToneCurve::Mobius) return x <= k[0] ? x : k[3] * (x + k[1]) / (x + k[2]);
+        return std::min(x, 1.0f);
+    }
+
+    // Table index of a value in [0, 1] (clamped)
+    static int Index(float v) { return (int)(std::min(std::max(v, 0.0f), 1.0f) * (kTableSize - 1) + 0.5f); }
+
+    // One pixel, normalized Y'CbCr in, output R'G'B' (BT.709, tone mapped) out
+    template <ToneCurve C>
+    void Pixel(float l, float cb, float cr, float* rgb) const {
+        float R = m_eotf[Index(l + m_rv * cr)];
+        float G = m_eotf[Index(l - m_gu * cb - m_gv * cr)];
+        float B = m_eotf[Index(l + m_bu * cb)];
+        if (!m_pq) {
+            float ootf = m_ootf[Index(std::sqrt(m_lr * R + m_lg * G + m_lb * B))];
+            R *= ootf; G *= ootf; B *= ootf;
+        }
+        if (m_gamut) {
+            float r7 = 1.6605f * R - 0.5876f * G - 0.0728f * B;
+            float g7 = -0.1246f * R + 1.1329f * G - 0.0083f * B;
+            float b7 = -0.0182f * R - 0.1006f * G + 1.1187f * B;
+            R = r7; G = g7; B = b7;
+        }
+        R = std::max(R, 0.0f); G = std::max(G, 0.0f); B = std::max(B, 0.0f);
+        float sig = std::max(std::max(R, G), std::max(B, 1e-6f));
+        float ratio = Curve<C>(sig, m_k) / sig;
+        rgb[0] = m_oetf[Index(std::sqrt(R * ratio))];
+        rgb[1] = m_oetf[Index(std::sqrt(G * ratio))];
+        rgb[2] = m_oetf[Index(std::sqrt(B * ratio))];
+    }
+
+#ifdef HAVE_SSE2
+    static __m128i IndexV(__m128 v) {
+        v = _mm_min_ps(_mm_max_ps(v, _mm_setzero_ps()), _mm_set1_ps(1.0f));
+        return _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(v, _mm_set1_ps(kTableSize - 1)), _mm_set1_ps(0.5f)));
+    }
+
+    template <ToneCurve C>
+    static __m128 CurveV(__m128 x, const float* k) {
+        const __m128 one = _mm_set1_ps(1.0f);
+        if (C == ToneCurve::Reinhard)
+            return _mm_div_ps(_mm_mul_ps(x, _mm_add_ps(one, _mm_mul_ps(x, _mm_set1_ps(k[0])))), _mm_add_ps(one, x));
+        if (C == ToneCurve::Hable) {
+            const float A = 0.15f, B = 0.50f, C_ = 0.10f, D = 0.20f, E = 0.02f, F = 0.30f;
+            __m128 num = _mm_add_ps(_mm_mul_ps(x, _mm_add_ps(_mm_mul_ps(x, _mm_set1_ps(A)), _mm_set1_ps(C_ * B))), _mm_set1_ps(D * E));
+            __m128 den = _mm_add_ps(_mm_mul_ps(x, _mm_add_ps(_mm_mul_ps(x, _mm_set1_ps(A)), _mm_set1_ps(B))), _mm_set1_ps(D * F));
+            return _mm_mul_ps(_mm_sub_ps(_mm_div_ps(num, den), _mm_set1_ps(E / F)), _mm_set1_ps(k[0]));
+        }
+        if (C == ToneCurve::Mobius) {
+            __m128 knee = _mm_cmple_ps(x, _mm_set1_ps(k[0]));
+            __m128 y = _mm_div_ps(_mm_mul_ps(_mm_set1_ps(k[3]), _mm_add_ps(x, _mm_set1_ps(k[1]))), _mm_add_ps(x, _mm_set1_ps(k[2])));
+            return _mm_or_ps(_mm_and_ps(knee, x), _mm_andnot_ps(knee, y));
+        }
+        return _mm_min_ps(x, one);
+    }
+
+    // Pixel() for four pixels
+    template <ToneCurve C>
+    void PixelsV(__m128 l, __m128 cb, __m128 cr, __m128* R_, __m128* G_, __m128* B_) const {
+        __m128 R = gather_ps(m_eotf, IndexV(_mm_add_ps(l, _mm_mul_ps(_mm_set1_ps(m_rv), cr))));
+        __m128 G = gather_ps(m_eotf, IndexV(_mm_sub_ps(_mm_sub_ps(l, _mm_mul_ps(_mm_set1_ps(m_gu), cb)), _mm_mul_ps(_mm_set1_ps(m_gv), cr))));
+        __m128 B = gather_ps(m_eotf, IndexV(_mm_add_ps(l, _mm_mul_ps(_mm_set1_ps(m_bu), cb))));
+        if (!m_pq) {
+            __m128 ys = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(m_lr), R), _mm_mul_ps(_mm_set1_ps(m_lg), G)), _mm_mul_ps(_mm_set1_ps(m_lb), B));
+            __m128 ootf = gather_ps(m_ootf, IndexV(_mm_sqrt_ps(ys)));
+            R = _mm_mul_ps(R, ootf); G = _mm_mul_ps(G, ootf); B = _mm_mul_ps(B, ootf);
+        }
+        if (m_gamut) {
+            auto dot = [&](float a, float b, float c) {
+                return _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(a), R), _mm_mul_ps(_mm_set1_ps(b), G)), _mm_mul_ps(_mm_set1_ps(c), B));
+            };
+            __m128 r7 = dot(1.6605f, -0.5876f, -0.0728f);
+            __m128 g7 = dot(-0.1246f, 1.1329f, -0.0083f);
+            __m128 b7 = dot(-0.0182f, -0.1006f, 1.1187f);
+            R = r7; G = g7; B = b7;
+        }
+        const __m128 zero = _mm_setzero_ps();
+        R = _mm_max_ps(R, zero); G = _mm_max_ps(G, zero); B = _mm_max_ps(B, zero);
+        __m128 sig = _mm_max_ps(_mm_max_ps(R, G), _mm_max_ps(B, _mm_set1_ps(1e-6f)));
+        __m128 ratio = _mm_div_ps(CurveV<C>(sig, m_k), sig);
+        *R_ = gather_ps(m_oetf, IndexV(_mm_sqrt_ps(_mm_mul_ps(R, ratio))));
+        *G_ = gather_ps(m_oetf, IndexV(_mm_sqrt_ps(_mm_mul_ps(G, ratio))));
+        *B_ = gather_ps(m_oetf, IndexV(_mm_sqrt_ps(_mm_mul_ps(B, ratio))));
+    }
+#endif
+
+    template <typename T>
+    void MapRows(const AVFrame* in, int cy, Scratch* sc) const {
+        switch (m_curve) {
+        case ToneCurve::Clip: MapCurveRows<T, ToneCurve::Clip>(in, cy, sc); break;
+        case ToneCurve::Reinhard: MapCurveRows<T, ToneCurve::Reinhard>(in, cy, sc); break;
+        case ToneCurve::Hable: MapCurveRows<T, ToneCurve::Hable>(in, cy, sc); break;
+        case ToneCurve::Mobius: MapCurveRows<T, ToneCurve::Mobius>(in, cy, sc); break;
+        }
+    }
+
+    // One chroma row and the (1 << m_ch) luma rows it covers
+    template <typename T, ToneCurve C>
+    void MapCurveRows(const AVFrame* in, int cy, Scratch* sc) const {
+        const int w = m_w[0], cw = m_w[1];
+        const int y0 = cy << m_ch, y1 = std::min(m_h[0], (cy + 1) << m_ch);
+        const float s = (float)(1 << (m_depth - 8)), maxv = (float)((1 << m_depth) - 1);
+        const T* U = reinterpret_cast<const T*>(in->data[1] + (ptrdiff_t)cy * in->linesize[1]);
+        const T* V = reinterpret_cast<const T*>(in->data[2] + (ptrdiff_t)cy * in->linesize[2]);
+        float* sr = sc->sr.data(); float* sg = sc->sg.data(); float* sb = sc->sb.data();
+        std::fill(sr, sr + cw, 0.0f);
+        std::fill(sg, sg + cw, 0.0f);
+        std::fill(sb, sb + cw, 0.0f);
+
+        for (int y = y0; y < y1; ++y) {
+            const T* Y = reinterpret_cast<const T*>(in->data[0] + (ptrdiff_t)y * in->linesize[0]);
+            T* dst = reinterpret_cast<T*>(m_out->data[0] + (ptrdiff_t)y * m_out->linesize[0]);
+            int x = 0;
+#ifdef HAVE_SSE2
+            // four luma samples per step; chroma sums stay per lane below 4:2:0/4:2:2 width
+            const __m128 ys = _mm_set1_ps(m_ys), yo = _mm_set1_ps(m_yo), cs = _mm_set1_ps(m_cs), co = _mm_set1_ps(m_co);
+            const __m128 lo = _mm_set1_ps(16.0f * s + 0.5f), gain = _mm_set1_ps(219.0f * s);
+            for (; m_cw <= 1 && x + 4 <= w; x += 4) {
+                __m128 l = _mm_add_ps(_mm_mul_ps(load4_ps(Y + x), ys), yo);
+                __m128 cb = m_cw ? load2x2_ps(U + (x >> 1)) : load4_ps(U + x);
+                __m128 cr = m_cw ? load2x2_ps(V + (x >> 1)) : load4_ps(V + x);
+                cb = _mm_add_ps(_mm_mul_ps(cb, cs), co);
+                cr = _mm_add_ps(_mm_mul_ps(cr, cs), co);
+                __m128 R, G, B;
+                PixelsV<C>(l, cb, cr, &R, &G, &B);
+                // BT.709 luma, limited range
+                __m128 luma = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(0.2126f), R), _mm_mul_ps(_mm_set1_ps(0.7152f), G)),
+                                         _mm_mul_ps(_mm_set1_ps(0.0722f), B));
+                store4_epi32(dst + x, _mm_cvttps_epi32(_mm_add_ps(lo, _mm_mul_ps(gain, luma))));
+                if (m_cw) {
+                    // horizontal pair sums land in lanes 0 and 1
+                    auto pairs = [](__m128 v) {
+                        return _mm_add_ps(_mm_shuffle_ps(v, v, _MM_SHUFFLE(2, 0, 2, 0)), _mm_shuffle_ps(v, v, _MM_SHUFFLE(3, 1, 3, 1)));
+                    };
+                    __m64* cr_ = reinterpret_cast<__m64*>(sr + (x >> 1));
+                    __m64* cg_ = reinterpret_cast<__m64*>(sg + (x >> 1));
+                    __m64* cb_ = reinterpret_cast<__m64*>(sb + (x >> 1));
+                    _mm_storel_pi(cr_, _mm_add_ps(_mm_loadl_pi(_mm_setzero_ps(), cr_), pairs(R)));
+                    _mm_storel_pi(cg_, _mm_add_ps(_mm_loadl_pi(_mm_setzero_ps(), cg_), pairs(G)));
+                    _mm_storel_pi(cb_, _mm_add_ps(_mm_loadl_pi(_mm_setzero_ps(), cb_), pairs(B)));
+                } else {
+                    _mm_storeu_ps(sr + x, _mm_add_ps(_mm_loadu_ps(sr + x), R));
+                    _mm_storeu_ps(sg + x, _mm_add_ps(_mm_loadu_ps(sg + x), G));
+                    _mm_storeu_ps(sb + x, _mm_add_ps(_mm_loadu_ps(sb + x), B));
+                }
+            }
+#endif
+            for (; x < w; ++x) {
+                float rgb[3];
+                Pixel<C>(Y[x] * m_ys + m_yo, U[x >> m_cw] * m_cs + m_co, V[x >> m_cw] * m_cs + m_co, rgb);
+                float l = 0.2126f * rgb[0] + 0.7152f * rgb[1] + 0.0722f * rgb[2];
+                dst[x] = (T)(s * (16.0f + 219.0f * l) + 0.5f);
+                sr[x >> m_cw] += rgb[0]; sg[x >> m_cw] += rgb[1]; sb[x >> m_cw] += rgb[2];
+            }
+        }
+
+        // chroma from the average R'G'B' of the covered samples
+        T* Cb = reinterpret_cast<T*>(m_out->data[1] + (ptrdiff_t)cy * m_out->linesize[1]);
+        T* Cr = reinterpret_cast<T*>(m_out->data[2] + (ptrdiff_t)cy * m_out->linesize[2]);
+        for (int x = 0; x < cw; ++x) {
+            int covered = (std::min(w, (x + 1) << m_cw) - (x << m_cw)) * (y1 - y0);
+            float inv = 1.0f / covered;
+            float R = sr[x] * inv, G = sg[x] * inv, B = sb[x] * inv;
+            float l = 0.2126f * R + 0.7152f * G + 0.0722f * B;
+            float cb = (B - l) / 1.8556f, cr = (R - l) / 1.5748f;
+            Cb[x] = (T)std::min(std::max(s * (128.0f + 224.0f * cb) + 0.5f, 0.0f), maxv);
+            Cr[x] = (T)std::min(std::max(s * (128.0f + 224.0f * cr) + 0.5f, 0.0f), maxv);
+        }
+    }
+
+    AVFrame* m_out = nullptr;
+    ToneCurve m_curve = ToneCurve::Hable;
+    bool m_pq = true, m_gamut = true;
+    int m_w[4] = { 0 }, m_h[4] = { 0 };
+    int m_cw = 0, m_ch = 0, m_depth = 8;
+    float m_ys = 0, m_yo = 0, m_cs = 0, m_co = 0;  // input normalization
+    float m_rv = 0, m_gu = 0, m_gv = 0, m_bu = 0;  // input matrix
+    float m_lr = 0, m_lg = 0, m_lb = 0;            // HLG scene luminance weights
+    double m_peak = 0;
+    float m_k[4] = { 0 };
+    float m_eotf[kTableSize];
+    float m_oetf[kTableSize];
+    float m_ootf[kTableSize];                      // HLG: display gain by sqrt(scene luminance)
+    int m_slices = 1;
+    std::vector<Scratch> m_scratch;
+    std::unique_ptr<SlicePool> m_pool;
+};
+
+// ---- encoder input conversion ----
+//
+// Decoded (deinterlaced, tone mapped) pictures become encoder input here. Frames that already
+// match the encoder are passed through; yuv422p and full range yuv420p/yuvj420p at the encoder's
+// size take a direct conversion to yuv420p (SSE2 row kernels, several times swscale's speed on
+// these); anything else goes through swscale in one pass, told the source and destination matrix
+// and range. NV12 stays with swscale, whose unscaled deinterleave is as fast as a direct one.
+
+// swscale's SWS_CS_* for a Y'CbCr matrix; unspecified ones are guessed from the height the way
+// players do (BT.709 from 720 lines up, BT.601 below)
+static int sws_colorspace(AVColorSpace cs, int height) {
+    switch (cs) {
+    case AVCOL_SPC_BT709: return SWS_CS_ITU709;
+    case AVCOL_SPC_BT2020_NCL:
+    case AVCOL_SPC_BT2020_CL: return SWS_CS_BT2020;
+    case AVCOL_SPC_FCC: return SWS_CS_FCC;
+    case AVCOL_SPC_SMPTE240M: return SWS_CS_SMPTE240M;
+    case AVCOL_SPC_BT470BG:
+    case AVCOL_SPC_SMPTE170M: return SWS_CS_ITU601;
+    default: return height >= 720 ? SWS_CS_ITU709 : SWS_CS_ITU601;
+    }
+}
+
+// Without this swscale converts with BT.601 and limited range (full range for yuvj formats)
+// whatever the frames are tagged with.
+static void set_scaler_colorspace(struct SwsContext* sws, int src_cs, bool src_full, int dst_cs, bool dst_full) {
+    sws_setColorspaceDetails(sws, sws_getCoefficients(src_cs), src_full, sws_getCoefficients(dst_cs), dst_full,
+                             0, 1 << 16, 1 << 16);
+}
+
+// Matrix and range of a frame as tagged, for set_scaler_colorspace()
+static int frame_sws_colorspace(const AVFrame* f) { return sws_colorspace(f->colorspace, f->height); }
+static bool frame_full_range(const AVFrame* f) {
+    const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get((AVPixelFormat)f->format);
+    return f->color_range == AVCOL_RANGE_JPEG || is_yuvj((AVPixelFormat)f->format) || (desc && (desc->flags & AV_PIX_FMT_FLAG_RGB));
+}
+
+class EncoderInput {
+public:
+    ~EncoderInput() {
+        sws_freeContext(m_sws);
+        av_frame_free(&m_scaled);
+    }
+
+    // Choose the conversion from dec_ctx's frames (after tone mapping, if tonemap_wanted()) to enc_ctx's input.
+    int Init(const AVCodecContext* dec_ctx, const AVCodecContext* enc_ctx, const EncodeProfile& prof) {
+        bool tonemapped = tonemap_wanted(dec_ctx, prof); // ToneMapper output is BT.709 limited range
+        AVPixelFormat src = dec_ctx->pix_fmt, dst = enc_ctx->pix_fmt;
+        bool src_full = !tonemapped && (dec_ctx->color_range == AVCOL_RANGE_JPEG || is_yuvj(src));
+        bool dst_full = enc_ctx->color_range == AVCOL_RANGE_JPEG;
+        bool direct = dec_ctx->width == enc_ctx->width && dec_ctx->height == enc_ctx->height && dst == AV_PIX_FMT_YUV420P;
+        if (src == dst && src_full == dst_full && dec_ctx->width == enc_ctx->width && dec_ctx->height == enc_ctx->height)
+            m_path = PassThrough;
+        else if (direct && src == AV_PIX_FMT_YUV422P && src_full == dst_full)
+            m_path = Yuv422;
+        else if (direct && (src == AV_PIX_FMT_YUVJ420P || src == AV_PIX_FMT_YUV420P) && src_full && !dst_full)
+            m_path = FullToLimited;
+        else
+            m_path = Scaler;
+        if (m_path == PassThrough) return 0;
+
+        if (!(m_scaled = alloc_video_frame(enc_ctx->width, enc_ctx->height, dst))) return AVERROR(ENOMEM);
+        if (m_path == Scaler) {
+            m_sws = create_scaler(dec_ctx->width, dec_ctx->height, src, enc_ctx->width, enc_ctx->height, dst,
+                                  scaler_flags(prof), prof.sws_threads);
+            if (!m_sws) return AVERROR(EINVAL);
+            int src_cs = sws_colorspace(tonemapped ? AVCOL_SPC_BT709 : dec_ctx->colorspace, dec_ctx->height);
+            int dst_cs = enc_ctx->colorspace == AVCOL_SPC_UNSPECIFIED ? src_cs : sws_colorspace(enc_ctx->colorspace, enc_ctx->height);
+            set_scaler_colorspace(m_sws, src_cs, src_full, dst_cs, dst_full);
+            return 0;
+        }
+        m_pool.reset(new SlicePool(std::max(1, prof.sws_threads)));
+        m_slices = std::max(1, std::min((enc_ctx->height + 1) / 2, m_pool->Threads() * 2));
+        return 0;
+    }
+
+    // "yuv422p -> yuv420p (direct)"
+    std::string Describe(const AVCodecContext* dec_ctx, const AVCodecContext* enc_ctx) const {
+        static const char* paths[] = { "passed through", "direct", "direct", "swscale" };
+        return std::string(av_get_pix_fmt_name(dec_ctx->pix_fmt)) + " -> " + av_get_pix_fmt_name(enc_ctx->pix_fmt)
+             + " (" + paths[m_path] + ")";
+    }
+
+    // Frame for the encoder: `pic` itself when passed through (its picture type dropped, which the
+    // encoder would take as forced), else an internal frame valid until the next call.
+    int Convert(AVFrame* pic, AVFrame** out) {
+        if (m_path == PassThrough) {
+            pic->pict_type = AV_PICTURE_TYPE_NONE;
+            *out = pic;
+            return 0;
+        }
+        int ret = av_frame_make_writable(m_scaled); // the encoder may still reference the previous one
+        if (ret < 0) return ret;
+        if (m_path == Scaler) {
+            if ((ret = sws_scale_frame(m_sws, m_scaled, pic)) < 0) return ret;
+        } else {
+            int rows = (m_scaled->height + 1) / 2; // output chroma rows
+            m_pool->Run(m_slices, [&](int s) { ConvertRows(pic, rows * s / m_slices, rows * (s + 1) / m_slices); });
+        }
+        *out = m_scaled;
+        return 0;
+    }
+
+private:
+    enum Path { PassThrough, Yuv422, FullToLimited, Scaler };
+
+    // Output chroma rows [cy0, cy1) and the luma rows they cover
+    void ConvertRows(const AVFrame* in, int cy0, int cy1) const {
+        const int w = m_scaled->width, h = m_scaled->height, cw = (w + 1) / 2;
+        auto src = [&](int p, int y) { return in->data[p] + (ptrdiff_t)y * in->linesize[p]; };
+        auto dst = [&](int p, int y) { return m_scaled->data[p] + (ptrdiff_t)y * m_scaled->linesize[p]; };
+        for (int cy = cy0; cy < cy1; ++cy) {
+            int ly1 = std::min(h, 2 * cy + 2);
+            for (int y = 2 * cy; y < ly1; ++y) {
+                if (m_path == FullToLimited) LimitRow(dst(0, y), src(0, y), w, 14071, 16);
+                else memcpy(dst(0, y), src(0, y), w);
+            }
+            uint8_t* u = dst(1, cy);
+            uint8_t* v = dst(2, cy);
+            if (m_path == Yuv422) {
+                int y0 = 2 * cy, y1 = ly1 - 1; // 4:2:2 chroma rows to average
+                AverageRow(u, src(1, y0), src(1, y1), cw);
+                AverageRow(v, src(2, y0), src(2, y1), cw);
+            } else {
+                LimitRow(u, src(1, cy), cw, 14392, 128 - 128 * 14392 / 16384.0);
+                LimitRow(v, src(2, cy), cw, 14392, 128 - 128 * 14392 / 16384.0);
+            }
+        }
+    }
+
+    // The row kernels below take 16 samples per step with SSE2 and finish (or, on other targets,
+    // do) the row in plain C; both give the same bytes.
+
+    // d = (a + b + 1) / 2: two 4:2:2 chroma rows into one 4:2:0 row
+    static void AverageRow(uint8_t* d, const uint8_t* a, const uint8_t* b, int n) {
+        int x = 0;
+#ifdef HAVE_SSE2
+        for (; x + 16 <= n; x += 16) {
+            __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + x));
+            __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + x));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(d + x), _mm_avg_epu8(va, vb));
+        }
+#endif
+        for (; x < n; ++x) d[x] = (uint8_t)((a[x] + b[x] + 1) >> 1);
+    }
+
+    // d = s * scale / 16384 + offset, rounded: full range to limited range in 14-bit fixed point
+    // (scale 219/255 for luma, 224/255 for chroma)
+    static void LimitRow(uint8_t* d, const uint8_t* s, int n, int scale, double offset) {
+        const uint32_t add = (uint32_t)(offset * 16384 + 8192);
+        int x = 0;
+#ifdef HAVE_SSE2
+        // s * scale + add as one multiply-add per sample: samples paired with 16, times (scale, add / 16)
+        // (add is a multiple of 16 for both offsets used here)
+        const __m128i z = _mm_setzero_si128(), sixteen = _mm_set1_epi16(16);
+        const __m128i k = _mm_set1_epi32((int)((add / 16) << 16 | (uint32_t)scale));
+        for (; x + 16 <= n; x += 16) {
+            __m128i px = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + x));
+            __m128i lo = _mm_unpacklo_epi8(px, z), hi = _mm_unpackhi_epi8(px, z);
+            __m128i r0 = _mm_srli_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(lo, sixteen), k), 14);
+            __m128i r1 = _mm_srli_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(lo, sixteen), k), 14);
+            __m128i r2 = _mm_srli_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(hi, sixteen), k), 14);
+            __m128i r3 = _mm_srli_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(hi, sixteen), k), 14);
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(d + x), _mm_packus_epi16(_mm_packs_epi32(r0, r1), _mm_packs_epi32(r2, r3)));
+        }
+#endif
+        for (; x < n; ++x) d[x] = (uint8_t)((s[x] * (uint32_t)scale + add) >> 14);
+    }
+
+    Path m_path = PassThrough;
+    struct SwsContext* m_sws = nullptr;
+    AVFrame* m_scaled = nullptr;
+    int m_slices = 1;
+    std::unique_ptr<SlicePool> m_pool;
+};
+
+// ---- decoder frame pool ----
+//
+// libavcodec's default allocator hands decoders fresh buffers, and at 4K/8K every first touch of
+// a page is a fault. FramePool serves get_buffer2 from an AVBufferPool recycled for the whole job,
+// with buffers of 2 MiB and up backed by huge pages where the OS provides them: MAP_HUGETLB when
+// hugetlbfs pages are reserved, else transparent huge pages (MADV_HUGEPAGE on a 2 MiB aligned
+// mapping), else ordinary pages. Smaller (SD) frames use ordinary heap buffers.
+
+// Page faults of this process so far: minor, and major in *major; -1 where not available
+static int64_t page_faults(int64_t* major) {
+#ifdef __WXMSW__
+    *major = -1;
+    return -1;
+#else
+    struct rusage ru;
+    if (getrusage(RUSAGE_SELF, &ru) < 0) { *major = -1; return -1; }
+    *major = ru.ru_majflt;
+    return ru.ru_minflt;
+#endif
+}
+
+class FramePool {
+public:
+    ~FramePool() { av_buffer_pool_uninit(&m_pool); } // buffers still referenced are freed with their frames
+
+    // Serve dec_ctx's frames from the pool; call before avcodec_open2() and keep the pool alive
+    // until the decoder is freed. Decoders without AV_CODEC_CAP_DR1 and palette/hardware formats
+    // keep the default allocator.
+    void Attach(AVCodecContext* dec_ctx) {
+        dec_ctx->opaque = this;
+        dec_ctx->get_buffer2 = &FramePool::GetBuffer;
+        m_minorAtStart = page_faults(&m_majorAtStart);
+    }
+
+    int64_t Frames() const { return m_frames.load(); }
+
+    // "Decoder buffers: 1234 frames from 9 pooled buffers, 112.0 MiB (transparent huge pages); page faults: 5321 minor, 0 major"
+    std::string Report() const {
+        static const char* backings[] = { "ordinary pages", "transparent huge pages", "hugetlb pages" };
+        char mib[32];
+        snprintf(mib, sizeof(mib), "%.1f MiB", m_bytes.load() / 1048576.0);
+        std::string s = "Decoder buffers: " + std::to_string(m_frames.load()) + " frames from " + std::to_string(m_buffers.load())
+                      + " pooled buffers, " + mib + " (" + backings[m_backing.load()] + ")";
+        int64_t major, minor = page_faults(&major);
+        if (minor >= 0)
+            s += "; page faults: " + std::to_string(minor - m_minorAtStart) + " minor, " + std::to_string(major - m_majorAtStart) + " major";
+        return s;
+    }
+
+private:
+    enum Backing { Ordinary, Transparent, HugeTlb };
+    static constexpr size_t kHugePage = 2 << 20;
+    static constexpr int kAlign = 64; // plane and line alignment, enough for every SIMD decoder path
+
+    static size_t AlignUp(size_t v, size_t a) { return (v + a - 1) & ~(a - 1); }
+
+    static int GetBuffer(AVCodecContext* ctx, AVFrame* f, int flags) {
+        FramePool* self = static_cast<FramePool*>(ctx->opaque);
+        AVPixelFormat fmt = (AVPixelFormat)f->format;
+        const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get(fmt);
+        if (!(ctx->codec->capabilities & AV_CODEC_CAP_DR1) || !desc ||
+            (desc->flags & (AV_PIX_FMT_FLAG_PAL | AV_PIX_FMT_FLAG_HWACCEL | AV_PIX_FMT_FLAG_BITSTREAM)))
+            return avcodec_default_get_buffer2(ctx, f, flags);
+
+        int w = f->width, h = f->height, align[AV_NUM_DATA_POINTERS];
+        avcodec_align_dimensions2(ctx, &w, &h, align);
+        int linesize[4];
+        int ret = av_image_fill_linesizes(linesize, fmt, w);
+        if (ret < 0) return ret;
+        ptrdiff_t lines[4];
+        for (int i = 0; i < 4; ++i) lines[i] = linesize[i] = (int)AlignUp(linesize[i], std::max(kAlign, align[i]));
+        size_t sizes[4];
+        if ((ret = av_image_fill_plane_sizes(sizes, fmt, h, lines)) < 0) return ret;
+        size_t total = kAlign + AV_INPUT_BUFFER_PADDING_SIZE;
+        for (size_t s : sizes) total += AlignUp(s, kAlign);
+
+        {
+            std::lock_guard<std::mutex> lk(self->m_lock);
+            if (!self->m_pool || self->m_poolSize != total) {
+                // new geometry: buffers of the old pool go away as their frames are released
+                av_buffer_pool_uninit(&self->m_pool);
+                self->m_pool = av_buffer_pool_init2(total, self, &FramePool::Alloc, NULL);
+                self->m_poolSize = total;
+            }
+            f->buf[0] = self->m_pool ? av_buffer_pool_get(self->m_pool) : nullptr;
+        }
+        if (!f->buf[0]) return AVERROR(ENOMEM);
+        uint8_t* p = (uint8_t*)AlignUp((uintptr_t)f->buf[0]->data, kAlign); // total has room for this
+        for (int i = 0; i < 4 && sizes[i]; ++i) {
+            f->data[i] = p;
+            f->linesize[i] = linesize[i];
+            p += AlignUp(sizes[i], kAlign);
+        }
+        f->extended_data = f->data;
+        self->m_frames++;
+        return 0;
+    }
+
+    // AVBufferPool allocator: whole huge pages per buffer for frames of a huge page or more;
+    // smaller ones would mostly waste the rounding, so they get ordinary heap buffers
+    static AVBufferRef* Alloc(void* opaque, size_t size) {
+        FramePool* self = static_cast<FramePool*>(opaque);
+        if (size < kHugePage) {
+            AVBufferRef* buf = av_buffer_alloc(size);
+            if (!buf) return nullptr;
+            self->m_buffers++;
+            self->m_bytes += size;
+            self->m_backing = Ordinary;
+            return buf;
+        }
+        size_t len = AlignUp(size, kHugePage);
+        uint8_t* data = nullptr;
+        Backing backing = Ordinary;
+#ifdef __WXMSW__
+        data = (uint8_t*)VirtualAlloc(NULL, len, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+#else
+#ifdef MAP_HUGETLB
+        void* huge = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (huge != MAP_FAILED) { data = (uint8_t*)huge; backing = HugeTlb; }
+#endif
+        if (!data) {
+            // map one huge page more and trim both ends so the buffer starts on a huge page boundary
+            void* p = mmap(NULL, len + kHugePage, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (p == MAP_FAILED) return nullptr;
+            uintptr_t base = (uintptr_t)p, start = AlignUp(base, kHugePage);
+            if (start > base) munmap(p, start - base);
+            if (base + kHugePage > start) munmap((void*)(start + len), base + kHugePage - start);
+            data = (uint8_t*)start;
+#ifdef MADV_HUGEPAGE
+            if (madvise(data, len, MADV_HUGEPAGE) == 0) backing = Transparent;
+#endif
+        }
+#endif
+        if (!data) return nullptr;
+        AVBufferRef* buf = av_buffer_create(data, size, &FramePool::Unmap, (void*)(uintptr_t)len, 0);
+        if (!buf) { Unmap((void*)(uintptr_t)len, data); return nullptr; }
+        self->m_buffers++;
+        self->m_bytes += len;
+        self->m_backing = backing;
+        return buf;
+    }
+
+    // opaque carries the mapping length
+    static void Unmap(void* opaque, uint8_t* data) {
+#ifdef __WXMSW__
+        (void)opaque;
+        VirtualFree(data, 0, MEM_RELEASE);
+#else
+        munmap(data, (size_t)(uintptr_t)opaque);
+#endif
+    }
+
+    std::mutex m_lock;
+    AVBufferPool* m_pool = nullptr;
+    size_t m_poolSize = 0;
+    std::atomic<int64_t> m_frames{ 0 }, m_buffers{ 0 }, m_bytes{ 0 };
+    std::atomic<int> m_backing{ Ordinary };
+    int64_t m_minorAtStart = 0, m_majorAtStart = 0;
+};
+
+// ---- job cost estimation ----
+
+// Path of a small per-user cache file; the directory is created on first use.
+static std::string user_cache_file(const std::string& name) {
+    wxString dir = wxStandardPaths::Get().GetUserDataDir();
+    if (!wxFileName::DirExists(dir)) wxFileName::Mkdir(dir, 0777, wxPATH_MKDIR_FULL);
+    return std::string(dir.mb_str()) + "/" + name;
+}
+
+// Persistent per-codec/resolution/preset encode throughput, refined after every estimate.
+// File format: one "<key> <fps> <runs>" entry per line.
+class ThroughputCache {
+public:
+    struct Entry { double fps = 0; int runs = 0; };
+
+    static bool Lookup(const std::string& key, Entry* out) {
+        std::lock_guard<std::mutex> lock(s_lock);
+        std::map<std::string, Entry> all = Load();
+        auto it = all.find(key);
+        if (it == all.end()) return false;
+        *out = it->second;
+        return true;
+    }
+
+    // Fold a new measurement into the running average (capped so old hosts/builds age out).
+    static void Update(const std::string& key, double fps) {
+        std::lock_guard<std::mutex> lock(s_lock);
+        std::map<std::string, Entry> all = Load();
+        Entry& e = all[key];
+        int w = std::min(e.runs, 8);
+        e.fps = (e.fps * w + fps) / (w + 1);
+        e.runs++;
+        Save(all);
+    }
+
+private:
+    static std::map<std::string, Entry> Load() {
+        std::map<std::string, Entry> all;
+        std::ifstream f(user_cache_file("throughput.cache"));
+        std::string key; Entry e;
+        while (f >> key >> e.fps >> e.runs) all[key] = e;
+        return all;
+    }
+    static void Save(const std::map<std::string, Entry>& all) {
+        std::ofstream f(user_cache_file("throughput.cache"), std::ios::trunc);
+        for (const auto& kv : all) f << kv.first << ' ' << kv.second.fps << ' ' << kv.second.runs << '\n';
+    }
+    static std::mutex s_lock;
+};
+std::mutex ThroughputCache::s_lock;
+
+struct JobEstimate {
+    double seconds = 0;     // expected wall-clock time of the job
+    int64_t bytes = 0;      // expected output size
+    int samples = 0;        // number of sample points actually measured
+    bool calibrated = false; // throughput came (partly) from the calibration cache
+};
+
+static double seconds_since(std::chrono::steady_clock::time_point t0) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+}
+
+// Decode+encode `want` frames starting at the keyframe before ts (AV_TIME_BASE units).
+// Adds the number of encoded frames, produced bytes and elapsed seconds to the accumulators.
+static int encode_sample(AVFormatContext* in_ctx, int vidx, AVCodecContext* dec_ctx, AVRational framerate,
+                         const EncodeProfile& prof, int64_t ts, int want,
+                         int* frames, int64_t* bytes, double* seconds) {
+    int ret = av_seek_frame(in_ctx, -1, ts, AVSEEK_FLAG_BACKWARD);
+    if (ret < 0) return ret;
+    avcodec_flush_buffers(dec_ctx);
+
+    auto t0 = std::chrono::steady_clock::now();
+    AVCodecContext* enc_ctx = nullptr;
+    if ((ret = open_video_encoder(dec_ctx, framerate, prof, &enc_ctx)) < 0) return ret;
+
+    AVFrame* frame = av_frame_alloc();
+    AVPacket* pkt = av_packet_alloc();
+    AVPacket* enc_pkt = av_packet_alloc();
+    ToneMapper tonemapper; // part of the per-frame cost when the source is HDR
+    tonemapper.Init(dec_ctx, prof, prof.sws_threads);
+    EncoderInput input;
+
+    int got = 0;
+    int64_t next_pts = 0;
+    bool draining = false, failed = input.Init(dec_ctx, enc_ctx, prof) < 0;
+    while (got < want && !failed) {
+        if (!draining) {
+            ret = av_read_frame(in_ctx, pkt);
+            if (ret < 0) { draining = true; avcodec_send_packet(dec_ctx, NULL); }
+            else if (pkt->stream_index != vidx) { av_packet_unref(pkt); continue; }
+            else { ret = avcodec_send_packet(dec_ctx, pkt); av_packet_unref(pkt); if (ret < 0 && ret != AVERROR(EAGAIN)) break; }
+        }
+        bool decoded_any = false;
+        while (got < want && (ret = avcodec_receive_frame(dec_ctx, frame)) >= 0) {
+            decoded_any = true;
+            AVFrame* pic = frame;
+            if (tonemapper.Active() && tonemapper.Apply(frame, &pic) < 0) { failed = true; break; }
+            AVFrame* enc_frame = nullptr;
+            if ((ret = input.Convert(pic, &enc_frame)) >= 0) {
+                enc_frame->pts = next_pts++;
+                ret = avcodec_send_frame(enc_ctx, enc_frame);
+            }
+            av_frame_unref(frame);
+            if (ret < 0) { failed = true; break; }
+            while (avcodec_receive_packet(enc_ctx, enc_pkt) >= 0) { *bytes += enc_pkt->size; av_packet_unref(enc_pkt); }
+            got++;
+        }
+        if (draining && !decoded_any) break;
+    }
+
+    // flush so lookahead-buffered frames are accounted for
+    avcodec_send_frame(enc_ctx, NULL);
+    while (avcodec_receive_packet(enc_ctx, enc_pkt) >= 0) { *bytes += enc_pkt->size; av_packet_unref(enc_pkt); }
+    *seconds += seconds_since(t0);
+    *frames += got;
+
+    av_packet_free(&enc_pkt);
+    av_packet_free(&pkt);
+    av_frame_free(&frame);
+    avcodec_free_context(&enc_ctx);
+    return got > 0 ? 0 : AVERROR_EOF;
+}
+
+// Estimate wall time and output size of a job without running it. Re-encode jobs decode and
+// encode a few short samples spread through the input; remux jobs measure demux throughput.
+// Measured encode throughput is stored in ThroughputCache; once a codec/resolution/preset has
+// been calibrated, fewer and shorter samples are taken.
+static int estimate_job(const std::string& in, bool reencode, const EncodeProfile& prof,
+                        JobEstimate* est, std::string* err) {
+    AVFormatContext* in_ctx = nullptr;
+    int ret = avformat_open_input(&in_ctx, in.c_str(), NULL, NULL);
+    if (ret < 0) { *err = "Failed to open input"; return ret; }
+    if ((ret = avformat_find_stream_info(in_ctx, NULL)) < 0) { *err = "Failed to find stream info"; avformat_close_input(&in_ctx); return ret; }
+    if (in_ctx->duration <= 0) { *err = "Input duration unknown"; avformat_close_input(&in_ctx); return AVERROR(EINVAL); }
+    apply_stream_selection(in_ctx, prof.stream_rules);
+
+    double duration = in_ctx->duration / (double)AV_TIME_BASE;
+    int64_t in_size = in_ctx->pb ? avio_size(in_ctx->pb) : -1;
+    if (in_size <= 0) in_size = in_ctx->bit_rate * in_ctx->duration / AV_TIME_BASE / 8;
+
+    if (!reencode) {
+        // Remux cost is dominated by demux/mux I/O: time a few packet bursts.
+        const int points = 3;
+        int64_t read_bytes = 0;
+        double read_secs = 0;
+        AVPacket* pkt = av_packet_alloc();
+        for (int i = 0; i < points; ++i) {
+            av_seek_frame(in_ctx, -1, in_ctx->duration * (i + 1) / (points + 1), AVSEEK_FLAG_BACKWARD);
+            auto t0 = std::chrono::steady_clock::now();
+            for (int n = 0; n < 500 && av_read_frame(in_ctx, pkt) >= 0; ++n) { read_bytes += pkt->size; av_packet_unref(pkt); }
+            read_secs += seconds_since(t0);
+        }
+        av_packet_free(&pkt);
+        est->bytes = in_size;
+        est->seconds = (read_bytes > 0 && read_secs > 0) ? in_size / (read_bytes / read_secs) : 0;
+        est->samples = points;
+        avformat_close_input(&in_ctx);
+        return 0;
+    }
+
+    int vidx = main_video_stream(in_ctx); // the one the job encodes, never cover art
+    int64_t other_bytes = 0;
+    for (unsigned i = 0; i < in_ctx->nb_streams; i++) {
+        AVCodecParameters* par = in_ctx->streams[i]->codecpar;
+        if (in_ctx->streams[i]->discard == AVDISCARD_ALL) continue; // deselected
+        if ((int)i == vidx) continue;
+        if (par->codec_type == AVMEDIA_TYPE_VIDEO && !(in_ctx->streams[i]->disposition & AV_DISPOSITION_ATTACHED_PIC))
+            other_bytes += (int64_t)(prof.bit_rate * duration / 8); // further video streams are re-encoded too
+        else if (par->codec_type == AVMEDIA_TYPE_AUDIO && !prof.audio_codec.empty())
+            other_bytes += (int64_t)(prof.audio_bit_rate * duration / 8); // transcoded at the profile rate
+        else other_bytes += (int64_t)(par->bit_rate * duration / 8); // copied as-is
+    }
+    if (vidx < 0) { *err = "No video stream found for re-encoding"; avformat_close_input(&in_ctx); return AVERROR_STREAM_NOT_FOUND; }
+
+    const AVCodec* dec = avcodec_find_decoder(in_ctx->streams[vidx]->codecpar->codec_id);
+    if (!dec) { *err = "Decoder not found"; avformat_close_input(&in_ctx); return AVERROR_DECODER_NOT_FOUND; }
+    AVCodecContext* dec_ctx = avcodec_alloc_context3(dec);
+    avcodec_parameters_to_context(dec_ctx, in_ctx->streams[vidx]->codecpar);
+    apply_decoder_profile(dec_ctx, dec, prof);
+    if ((ret = avcodec_open2(dec_ctx, dec, NULL)) < 0) { *err = "Failed to open decoder"; avcodec_free_context(&dec_ctx); avformat_close_input(&in_ctx); return ret; }
+
+    AVRational framerate = guess_video_framerate(in_ctx, vidx);
+    std::string key = std::string(dec->name) + "_" + std::to_string(dec_ctx->width) + "x" + std::to_string(dec_ctx->height)
+                    + "_" + (prof.draft ? std::string("draft") : prof.preset.empty() ? std::string("default") : prof.preset);
+    ThroughputCache::Entry cached;
+    bool have_cal = ThroughputCache::Lookup(key, &cached) && cached.runs >= 3;
+
+    const int points = have_cal ? 2 : 5;
+    const int frames_per_sample = have_cal ? 15 : 30;
+    int frames = 0;
+    int64_t bytes = 0;
+    double secs = 0;
+    for (int i = 0; i < points; ++i) {
+        int64_t ts = in_ctx->duration * (i + 1) / (points + 1);
+        if (in_ctx->start_time != AV_NOPTS_VALUE) ts += in_ctx->start_time;
+        if (encode_sample(in_ctx, vidx, dec_ctx, framerate, prof, ts, frames_per_sample, &frames, &bytes, &secs) == 0)
+            est->samples++;
+    }
+    avcodec_free_context(&dec_ctx);
+    avformat_close_input(&in_ctx);
+
+    if (frames == 0 || secs <= 0) { *err = "Could not decode any sample frames"; return AVERROR_INVALIDDATA; }
+
+    double fps = frames / secs;
+    ThroughputCache::Update(key, fps);
+    if (have_cal) {
+        fps = (cached.fps * std::min(cached.runs, 8) + fps) / (std::min(cached.runs, 8) + 1);
+        est->calibrated = true;
+    }
+    double total_frames = duration * av_q2d(framerate);
+    est->seconds = total_frames / fps;
+    est->bytes = (int64_t)(total_frames * bytes / frames) + other_bytes;
+    return 0;
+}
+
+static std::string format_duration(double secs) {
+    int64_t s = (int64_t)(secs + 0.5);
+    std::ostringstream os;
+    if (s >= 3600) os << s / 3600 << "h ";
+    if (s >= 60) os << (s / 60) % 60 << "m ";
+    os << s % 60 << "s";
+    return os.str();
+}
+
+static std::string format_size(int64_t bytes) {
+    std::ostringstream os;
+    os.setf(std::ios::fixed); os.precision(1);
+    if (bytes >= (1LL << 30)) os << bytes / double(1LL << 30) << " GB";
+    else os << bytes / double(1 << 20) << " MB";
+    return os.str();
+}
+
+wxThread::ExitCode ConverterThread::RunEstimate() {
+    Log("Estimating job cost...");
+    JobEstimate est;
+    std::string err;
+    if (estimate_job(m_input, m_reencode, m_profile, &est, &err) < 0) {
+        Log("Estimate failed: " + err);
+    } else {
+        Log("Estimated time: ~" + format_duration(est.seconds) + ", output size: ~" + format_size(est.bytes)
+            + " (" + std::to_string(est.samples) + " samples" + (est.calibrated ? ", calibrated)" : ")"));
+    }
+    NotifyFinished();
+    return (wxThread::ExitCode)0;
+}
+
+// ---- host thread calibration ----
+
+struct ThreadSettings {
+    int dec_threads = 0;
+    int sws_threads = 0;
+    int enc_threads = 0;
+};
+
+// threads.cache holds "<name> <value>" lines; "cpus" guards against reuse on a different host
+// (or a VM resized since calibration), in which case calibration runs again.
+static bool load_thread_calibration(ThreadSettings* ts) {
+    std::ifstream f(user_cache_file("threads.cache"));
+    std::string name; int value; int cpus = -1;
+    while (f >> name >> value) {
+        if (name == "cpus") cpus = value;
+        else if (name == "dec_threads") ts->dec_threads = value;
+        else if (name == "sws_threads") ts->sws_threads = value;
+        else if (name == "enc_threads") ts->enc_threads = value;
+    }
+    return cpus == wxThread::GetCPUCount();
+}
+
+static void save_thread_calibration(const ThreadSettings& ts) {
+    std::ofstream f(user_cache_file("threads.cache"), std::ios::trunc);
+    f << "cpus " << wxThread::GetCPUCount() << '\n'
+      << "dec_threads " << ts.dec_threads << '\n'
+      << "sws_threads " << ts.sws_threads << '\n'
+      << "enc_threads " << ts.enc_threads << '\n';
+}
+
+static bool have_thread_calibration() {
+    ThreadSettings ts;
+    return load_thread_calibration(&ts);
+}
+
+// Fill thread counts the profile leaves at 0 from the host calibration, if any.
+static void apply_thread_calibration(EncodeProfile* prof) {
+    ThreadSettings ts;
+    if (!load_thread_calibration(&ts)) return;
+    if (prof->dec_threads == 0) prof->dec_threads = ts.dec_threads;
+    if (prof->sws_threads == 0) prof->sws_threads = ts.sws_threads;
+    if (prof->enc_threads == 0) prof->enc_threads = ts.enc_threads;
+}
+
+// Moving gradient plus pseudo-random noise so the encoder has real motion/texture to work on.
+static void fill_synthetic_frame(AVFrame* f, int index) {
+    uint32_t seed = 0x9e3779b9u * (index + 1);
+    for (int y = 0; y < f->height; ++y) {
+        uint8_t* row = f->data[0] + y * f->linesize[0];
+        for (int x = 0; x < f->width; ++x) {
+            seed = seed * 1664525u + 1013904223u;
+            row[x] = (uint8_t)(((x + y + index * 4) & 0xff) / 2 + (seed >> 27));
+        }
+    }
+    for (int p = 1; p < 3; ++p) {
+        for (int y = 0; y < f->height / 2; ++y) {
+            uint8_t* row = f->data[p] + y * f->linesize[p];
+            for (int x = 0; x < f->width / 2; ++x) row[x] = (uint8_t)(128 + ((x * p + y + index) & 0x3f) - 32);
+        }
+    }
+}
+
+// Candidate thread counts: single-threaded, half and all cores (deduplicated).
+static std::vector<int> thread_candidates() {
+    int n = std::max(1, wxThread::GetCPUCount());
+    std::vector<int> c = {1, std::max(1, n / 2), n};
+    c.erase(std::unique(c.begin(), c.end()), c.end());
+    return c;
+}
+
+// Keep a higher thread count only if it is measurably faster (5%); extra threads cost memory
+// and compete with other jobs on the same host.
+static void consider_candidate(int threads, double fps, int* best_threads, double* best_fps) {
+    if (*best_threads == 0 || fps > *best_fps * 1.05) { *best_threads = threads; *best_fps = fps; }
+}
+
+// Measure decoder, scaler and encoder throughput on synthetic 720p content for each candidate
+// thread count and keep the fastest setting per stage.
+static int calibrate_threads(ThreadSettings* out, std::string* report) {
+    const int W = 1280, H = 720, N = 32;
+    std::vector<AVFrame*> frames;
+    for (int i = 0; i < N; ++i) {
+        AVFrame* f = av_frame_alloc();
+        f->format = AV_PIX_FMT_YUV420P; f->width = W; f->height = H;
+        if (av_frame_get_buffer(f, 32) < 0) { av_frame_free(&f); break; }
+        fill_synthetic_frame(f, i);
+        f->pts = i;
+        frames.push_back(f);
+    }
+    std::vector<AVPacket*> bitstream;
+    AVCodecContext* fake_dec = avcodec_alloc_context3(NULL);
+    fake_dec->width = W; fake_dec->height = H; fake_dec->pix_fmt = AV_PIX_FMT_YUV420P;
+    fake_dec->sample_aspect_ratio = {1,1};
+    std::ostringstream rep;
+    int ret = 0;
+
+    // encoder: keep the packets of the first run as decoder input
+    double best_fps = 0;
+    for (int t : thread_candidates()) {
+        EncodeProfile prof;
+        prof.preset = "veryfast";
+        prof.enc_threads = t;
+        AVCodecContext* enc_ctx = nullptr;
+        if ((ret = open_video_encoder(fake_dec, {25,1}, prof, &enc_ctx)) < 0) break;
+        AVPacket* pkt = av_packet_alloc();
+        auto t0 = std::chrono::steady_clock::now();
+        for (AVFrame* f : frames) {
+            avcodec_send_frame(enc_ctx, f);
+            while (avcodec_receive_packet(enc_ctx, pkt) >= 0) {
+                if (bitstream.size() < frames.size()) bitstream.push_back(av_packet_clone(pkt));
+                av_packet_unref(pkt);
+            }
+        }
+        avcodec_send_frame(enc_ctx, NULL);
+        while (avcodec_receive_packet(enc_ctx, pkt) >= 0) {
+            if (bitstream.size() < frames.size()) bitstream.push_back(av_packet_clone(pkt));
+            av_packet_unref(pkt);
+        }
+        double fps = N / seconds_since(t0);
+        rep << "enc threads=" << t << ": " << (int)fps << " fps\n";
+        consider_candidate(t, fps, &out->enc_threads, &best_fps);
+        av_packet_free(&pkt);
+        avcodec_free_context(&enc_ctx);
+    }
+
+    // decoder
+    best_fps = 0;
+    const AVCodec* dec = avcodec_find_decoder(AV_CODEC_ID_H264);
+    for (int t : thread_candidates()) {
+        if (ret < 0 || !dec || bitstream.empty()) break;
+        AVCodecContext* dec_ctx = avcodec_alloc_context3(dec);
+        dec_ctx->thread_count = t;
+        if ((ret = avcodec_open2(dec_ctx, dec, NULL)) < 0) { avcodec_free_context(&dec_ctx); break; }
+        AVFrame* frame = av_frame_alloc();
+        int got = 0;
+        auto t0 = std::chrono::steady_clock::now();
+        for (AVPacket* pkt : bitstream) {
+            avcodec_send_packet(dec_ctx, pkt);
+            while (avcodec_receive_frame(dec_ctx, frame) >= 0) { got++; av_frame_unref(frame); }
+        }
+        avcodec_send_packet(dec_ctx, NULL);
+        while (avcodec_receive_frame(dec_ctx, frame) >= 0) { got++; av_frame_unref(frame); }
+        double fps = got / seconds_since(t0);
+        rep << "dec threads=" << t << ": " << (int)fps << " fps\n";
+        consider_candidate(t, fps, &out->dec_threads, &best_fps);
+        av_frame_free(&frame);
+        avcodec_free_context(&dec_ctx);
+    }
+
+    // scaler: 720p -> 1080p bilinear, the heaviest conversion the re-encode path typically does
+    best_fps = 0;
+    AVFrame* dst = av_frame_alloc();
+    dst->format = AV_PIX_FMT_YUV420P; dst->width = 1920; dst->height = 1080;
+    av_frame_get_buffer(dst, 32);
+    for (int t : thread_candidates()) {
+        if (ret < 0 || frames.empty()) break;
+        struct SwsContext* sws = create_scaler(W, H, AV_PIX_FMT_YUV420P, dst->width, dst->height, AV_PIX_FMT_YUV420P, SWS_BILINEAR, t);
+        if (!sws) continue;
+        auto t0 = std::chrono::steady_clock::now();
+        for (AVFrame* f : frames) sws_scale_frame(sws, dst, f);
+        double fps = frames.size() / seconds_since(t0);
+        rep << "sws threads=" << t << ": " << (int)fps << " fps\n";
+        consider_candidate(t, fps, &out->sws_threads, &best_fps);
+        sws_freeContext(sws);
+    }
+    av_frame_free(&dst);
+
+    for (AVPacket*& p : bitstream) av_packet_free(&p);
+    for (AVFrame*& f : frames) av_frame_free(&f);
+    avcodec_free_context(&fake_dec);
+    *report = rep.str();
+    return ret;
+}
+
+wxThread::ExitCode ConverterThread::RunCalibration() {
+    Log("Calibrating thread settings for this host (one-time)...");
+    ThreadSettings ts;
+    std::string report;
+    if (calibrate_threads(&ts, &report) < 0) {
+        Log("Calibration failed; using library defaults");
+    } else {
+        save_thread_calibration(ts);
+        Log(report);
+        Log("Calibrated: decoder " + std::to_string(ts.dec_threads) + ", scaler " + std::to_string(ts.sws_threads)
+            + ", encoder " + std::to_string(ts.enc_threads) + " threads");
+    }
+    NotifyFinished();
+    return (wxThread::ExitCode)0;
+}
+
+// ---- multi-process worker mode ----
+//
+// With "Run in worker process" the GUI spawns `<exe> --worker <name>` for each job. The job
+// description and all progress/log output travel through a WorkerStatusBlock in shared memory,
+// so a crashing decoder or encoder only takes down the worker. With "Decode in separate process"
+// a second worker (`--worker <name> --decode`) decodes the video stream and hands raw frames to
+// the converting worker through a ShmFrameRing, without copying them through a pipe.
+
+class SharedMemory {
+public:
+    ~SharedMemory() { Close(); }
+
+    // Create a new zero-filled segment; the creator unlinks it on Close().
+    bool Create(const std::string& name, size_t size) {
+#ifdef __WXMSW__
+        std::string n = "Local\\" + name;
+        m_map = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, (DWORD)((uint64_t)size >> 32), (DWORD)size, n.c_str());
+        if (!m_map || GetLastError() == ERROR_ALREADY_EXISTS) { Close(); return false; }
+        m_data = MapViewOfFile(m_map, FILE_MAP_ALL_ACCESS, 0, 0, size);
+#else
+        std::string n = "/" + name;
+        int fd = shm_open(n.c_str(), O_CREAT|O_EXCL|O_RDWR, 0600);
+        if (fd < 0) return false;
+        m_name = n; m_owner = true;
+        if (ftruncate(fd, (off_t)size) < 0) { ::close(fd); Close(); return false; }
+        void* p = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+        ::close(fd);
+        m_data = (p == MAP_FAILED) ? nullptr : p;
+#endif
+        m_size = size;
+        if (!m_data) { Close(); return false; }
+        return true;
+    }
+
+    // Map an existing segment created by another process.
+    bool Open(const std::string& name) {
+#ifdef __WXMSW__
+        std::string n = "Local\\" + name;
+        m_map = OpenFileMappingA(FILE_MAP_ALL_ACCESS, FALSE, n.c_str());
+        if (!m_map) return false;
+        m_data = MapViewOfFile(m_map, FILE_MAP_ALL_ACCESS, 0, 0, 0);
+        MEMORY_BASIC_INFORMATION mbi;
+        if (m_data && VirtualQuery(m_data, &mbi, sizeof(mbi))) m_size = mbi.RegionSize;
+#else
+        std::string n = "/" + name;
+        int fd = shm_open(n.c_str(), O_RDWR, 0600);
+        if (fd < 0) return false;
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            void* p = mmap(NULL, (size_t)st.st_size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+            if (p != MAP_FAILED) { m_data = p; m_size = (size_t)st.st_size; }
+        }
+        ::close(fd);
+#endif
+        if (!m_data) { Close(); return false; }
+        return true;
+    }
+
+    void Close() {
+#ifdef __WXMSW__
+        if (m_data) UnmapViewOfFile(m_data);
+        if (m_map) CloseHandle(m_map);
+        m_map = NULL;
+#else
+        if (m_data) munmap(m_data, m_size);
+        if (m_owner) shm_unlink(m_name.c_str());
+        m_owner = false;
+#endif
+        m_data = nullptr; m_size = 0;
+    }
+
+    void* Data() const { return m_data; }
+    size_t Size() const { return m_size; }
+
+private:
+    void* m_data = nullptr;
+    size_t m_size = 0;
+#ifdef __WXMSW__
+    HANDLE m_map = NULL;
+#else
+    std::string m_name;
+    bool m_owner = false;
+#endif
+};
+
+// Job description (written by the supervisor before spawning) followed by the status the workers
+// publish. Atomics are lock-free and address-free, so they work across processes.
+struct WorkerStatusBlock {
+    enum : uint32_t { kMagic = 0x57464650, kLogSlots = 64, kLogLine = 256 };
+    enum : int32_t { Starting = 0, Running = 1, Finished = 2 };
+
+    uint32_t magic;
+    char input[4096];
+    char out_format[32];
+    char preset[32];
+    char video_encoder[32];      // empty: libx264
+    char tonemap[16];
+    char audio_codec[32];        // empty: copy audio
+    char fallback_audio_codec[32]; // copy mode: encoder for tracks the container refuses
+    char stream_rules[256];
+    char extra_formats[64];
+    int32_t loudnorm;
+    char frame_ring[64];         // non-empty: video frames come from a decode worker
+    int32_t reencode;
+    int64_t bit_rate;
+    int32_t dec_threads, sws_threads, enc_threads;
+    int32_t frame_pool;
+    int32_t thumb_tap;
+    int32_t draft, draft_height;
+    int32_t cfr;
+    int32_t bit_depth;
+    int32_t deinterlace;
+    int32_t mkv_cues_kb, ts_pcr_period_ms, frag_duration_ms;
+    int64_t ts_muxrate;
+
+    std::atomic<int32_t> state[2];   // [0] converting worker, [1] decode worker
+    std::atomic<int32_t> video_stream; // main video stream picked by the converting worker; -1 until then, -2 none
+    std::atomic<int32_t> progress;
+    std::atomic<int32_t> cancel;
+    std::atomic<uint32_t> log_head;  // next log sequence number to claim
+    struct LogSlot {
+        std::atomic<uint32_t> seq;   // sequence number + 1 once text is complete, 0 while writing
+        char text[kLogLine];
+    } log[kLogSlots];
+};
+
+static void copy_job_string(char* dst, size_t n, const std::string& s) {
+    strncpy(dst, s.c_str(), n - 1);
+    dst[n - 1] = 0;
+}
+
+// Both workers may log concurrently: claim a sequence number, then fill and publish the slot.
+static void worker_log(WorkerStatusBlock* st, const std::string& s) {
+    uint32_t n = st->log_head.fetch_add(1);
+    WorkerStatusBlock::LogSlot& slot = st->log[n % WorkerStatusBlock::kLogSlots];
+    slot.seq.store(0, std::memory_order_release);
+    copy_job_string(slot.text, sizeof(slot.text), s);
+    slot.seq.store(n + 1, std::memory_order_release);
+}
+
+static void worker_set_progress(WorkerStatusBlock* st, int pct) { st->progress.store(pct, std::memory_order_relaxed); }
+static bool worker_cancelled(WorkerStatusBlock* st) { return st->cancel.load(std::memory_order_relaxed) != 0; }
+static void worker_set_finished(WorkerStatusBlock* st, int role) { st->state[role].store(WorkerStatusBlock::Finished); }
+
+// Single-producer/single-consumer ring of raw decoded frames in shared memory. The decode worker
+// creates it once the stream geometry is known; the consumer maps frames in place (no copy).
+class ShmFrameRing {
+public:
+    struct Header {
+        uint32_t magic;
+        int32_t width, height, format;
+        uint32_t slots;
+        uint64_t slot_size;
+        std::atomic<uint64_t> head;  // frames published by the producer
+        std::atomic<uint64_t> tail;  // frames released by the consumer
+        std::atomic<int32_t> eof;
+        std::atomic<int32_t> attached; // consumer has mapped the ring
+    };
+    struct SlotHeader { int64_t pts; int64_t duration; int32_t flags; };
+    enum : uint32_t { kMagic = 0x57464652, kAlign = 64 };
+
+    bool Create(const std::string& name, int w, int h, AVPixelFormat fmt, uint32_t slots) {
+        int img = av_image_get_buffer_size(fmt, w, h, 32);
+        if (img < 0) return false;
+        uint64_t slot_size = align_up(sizeof(SlotHeader)) + align_up((uint64_t)img);
+        if (!m_shm.Create(name, align_up(sizeof(Header)) + slot_size * slots)) return false;
+        m_hdr = new (m_shm.Data()) Header();
+        m_hdr->width = w; m_hdr->height = h; m_hdr->format = fmt;
+        m_hdr->slots = slots; m_hdr->slot_size = slot_size;
+        std::atomic_thread_fence(std::memory_order_release);
+        reinterpret_cast<std::atomic<uint32_t>*>(&m_hdr->magic)->store(kMagic, std::memory_order_release);
+        return true;
+    }
+
+    // The producer may still be probing the input; retry until the ring appears or timeout.
+    bool Open(const std::string& name, int timeout_ms, WorkerStatusBlock* st) {
+        for (int waited = 0; waited < timeout_ms; waited += 10) {
+            if (st && worker_cancelled(st)) return false;
+            if (m_shm.Open(name) && m_shm.Size() >= sizeof(Header)) {
+                Header* h = reinterpret_cast<Header*>(m_shm.Data());
+                if (reinterpret_cast<std::atomic<uint32_t>*>(&h->magic)->load(std::memory_order_acquire) == kMagic) {
+                    m_hdr = h;
+                    m_hdr->attached.store(1);
+                    return true;
+                }
+            }
+            m_shm.Close();
+            if (st && st->state[1].load() == WorkerStatusBlock::Finished) return false; // producer gave up
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        return false;
+    }
+
+    int Width() const { return m_hdr->width; }
+    int Height() const { return m_hdr->height; }
+    AVPixelFormat Format() const { return (AVPixelFormat)m_hdr->format; }
+
+    // Producer: copy a frame into the next free slot, waiting while the ring is full.
+    int Push(const AVFrame* f, WorkerStatusBlock* st) {
+        if (f->width != m_hdr->width || f->height != m_hdr->height || f->format != m_hdr->format) return AVERROR(EINVAL);
+        uint64_t head = m_hdr->head.load(std::memory_order_relaxed);
+        while (head - m_hdr->tail.load(std::memory_order_acquire) >= m_hdr->slots) {
+            if (worker_cancelled(st)) return AVERROR_EXIT;
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        uint8_t* slot = SlotData(head);
+        SlotHeader* sh = reinterpret_cast<SlotHeader*>(slot);
+        sh->pts = f->pts; sh->duration = f->duration; sh->flags = f->flags;
+        av_image_copy_to_buffer(slot + align_up(sizeof(SlotHeader)), (int)(m_hdr->slot_size - align_up(sizeof(SlotHeader))),
+                                f->data, f->linesize, (AVPixelFormat)m_hdr->format, m_hdr->width, m_hdr->height, 32);
+        m_hdr->head.store(head + 1, std::memory_order_release);
+        return 0;
+    }
+
+    // Mark end of stream. The creator unlinks the segment when it exits, so for short inputs wait
+    // until the consumer has mapped it.
+    void Finish(WorkerStatusBlock* st) {
+        m_hdr->eof.store(1, std::memory_order_release);
+        for (int waited = 0; !m_hdr->attached.load() && !worker_cancelled(st) && waited < 30000; waited += 10)
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+
+    // Consumer: wait for the next frame and report its pts. AVERROR_EOF once the producer is done,
+    // AVERROR_EXIT on cancel, AVERROR(ETIMEDOUT) if the producer stalls for 30s.
+    int Peek(int64_t* pts, WorkerStatusBlock* st) {
+        uint64_t tail = m_hdr->tail.load(std::memory_order_relaxed);
+        for (int waited = 0; m_hdr->head.load(std::memory_order_acquire) == tail; ++waited) {
+            if (m_hdr->eof.load(std::memory_order_acquire) && m_hdr->head.load(std::memory_order_acquire) == tail) return AVERROR_EOF;
+            if (st && worker_cancelled(st)) return AVERROR_EXIT;
+            if (st && st->state[1].load() == WorkerStatusBlock::Finished && !m_hdr->eof.load()) return AVERROR(EPIPE);
+            if (waited > 30000) return AVERROR(ETIMEDOUT);
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        *pts = reinterpret_cast<SlotHeader*>(SlotData(tail))->pts;
+        return 0;
+    }
+
+    // Point f at the next frame's pixels inside the ring; valid until Release().
+    void Map(AVFrame* f) {
+        uint8_t* slot = SlotData(m_hdr->tail.load(std::memory_order_relaxed));
+        const SlotHeader* sh = reinterpret_cast<const SlotHeader*>(slot);
+        av_frame_unref(f);
+        f->format = m_hdr->format; f->width = m_hdr->width; f->height = m_hdr->height;
+        f->pts = sh->pts; f->duration = sh->duration; f->flags = sh->flags;
+        av_image_fill_arrays(f->data, f->linesize, slot + align_up(sizeof(SlotHeader)),
+                             (AVPixelFormat)m_hdr->format, m_hdr->width, m_hdr->height, 32);
+    }
+
+    void Release() { m_hdr->tail.fetch_add(1, std::memory_order_release); }
+
+private:
+    static uint64_t align_up(uint64_t v) { return (v + kAlign - 1) & ~(uint64_t)(kAlign - 1); }
+    uint8_t* SlotData(uint64_t index) {
+        return (uint8_t*)m_shm.Data() + align_up(sizeof(Header)) + (index % m_hdr->slots) * m_hdr->slot_size;
+    }
+
+    SharedMemory m_shm;
+    Header* m_hdr = nullptr;
+};
+
+// Decode worker: demux and decode only the video stream and publish frames into the ring.
+static int run_decode_worker(WorkerStatusBlock* st) {
+    st->state[1].store(WorkerStatusBlock::Running);
+    AVFormatContext* in_ctx = nullptr;
+    AVCodecContext* dec_ctx = nullptr;
+    ShmFrameRing ring;
+    FramePool pool;
+    AVPacket* pkt = av_packet_alloc();
+    AVFrame* frame = av_frame_alloc();
+    int vidx = -1;
+    int ret = avformat_open_input(&in_ctx, st->input, NULL, NULL);
+    if (ret < 0 || (ret = avformat_find_stream_info(in_ctx, NULL)) < 0) { worker_log(st, "Decode worker: failed to open input"); goto done; }
+    // decode the stream the converter encodes (stream rules, cover art skipped); it publishes the index
+    while ((vidx = st->video_stream.load()) == -1) {
+        if (worker_cancelled(st) || st->state[0].load() == WorkerStatusBlock::Finished) { ret = AVERROR_EXIT; goto done; }
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    if (vidx < 0 || vidx >= (int)in_ctx->nb_streams || in_ctx->streams[vidx]->codecpar->codec_type != AVMEDIA_TYPE_VIDEO) {
+        ret = AVERROR_STREAM_NOT_FOUND; worker_log(st, "Decode worker: no video stream"); goto done;
+    }
+    for (unsigned i = 0; i < in_ctx->nb_streams; i++) {
+        if ((int)i != vidx) in_ctx->streams[i]->discard = AVDISCARD_ALL; // never parsed here; the converter copies them
+    }
+    {
+        const AVCodec* dec = avcodec_find_decoder(in_ctx->streams[vidx]->codecpar->codec_id);
+        if (!dec) { ret = AVERROR_DECODER_NOT_FOUND; worker_log(st, "Decode worker: decoder not found"); goto done; }
+        dec_ctx = avcodec_alloc_context3(dec);
+        avcodec_parameters_to_context(dec_ctx, in_ctx->streams[vidx]->codecpar);
+        EncodeProfile prof;
+        prof.dec_threads = st->dec_threads;
+        prof.draft = st->draft != 0;
+        prof.draft_height = st->draft_height;
+        apply_decoder_profile(dec_ctx, dec, prof); // must match the converter's decoder (ring size check)
+        if (st->frame_pool) pool.Attach(dec_ctx);
+        if ((ret = avcodec_open2(dec_ctx, dec, NULL)) < 0) { worker_log(st, "Decode worker: failed to open decoder"); goto done; }
+    }
+    if (!ring.Create(st->frame_ring, dec_ctx->width, dec_ctx->height, dec_ctx->pix_fmt, 8)) {
+        ret = AVERROR(ENOMEM); worker_log(st, "Decode worker: could not create frame ring"); goto done;
+    }
+
+    while (!worker_cancelled(st)) {
+        ret = av_read_frame(in_ctx, pkt);
+        bool eof = ret < 0;
+        if (!eof && pkt->stream_index != vidx) { av_packet_unref(pkt); continue; }
+        ret = avcodec_send_packet(dec_ctx, eof ? NULL : pkt);
+        av_packet_unref(pkt);
+        if (ret < 0 && !eof) { worker_log(st, "Decode worker: error sending packet to decoder"); break; }
+        while ((ret = avcodec_receive_frame(dec_ctx, frame)) >= 0) {
+            ret = ring.Push(frame, st);
+            av_frame_unref(frame);
+            if (ret < 0) break;
+        }
+        if (ret == AVERROR_EXIT || ret == AVERROR(EINVAL)) {
+            if (ret == AVERROR(EINVAL)) worker_log(st, "Decode worker: frame size/format changed mid-stream");
+            break;
+        }
+        if (eof) { ret = 0; break; }
+    }
+    if (ret >= 0) ring.Finish(st);
+    if (pool.Frames() > 0) worker_log(st, "Decode worker: " + pool.Report());
+
+done:
+    av_frame_free(&frame);
+    av_packet_free(&pkt);
+    avcodec_free_context(&dec_ctx);
+    avformat_close_input(&in_ctx);
+    worker_set_finished(st, 1);
+    return ret < 0 ? 1 : 0;
+}
+
+// Entry point of `--worker <name> [--decode]` processes.
+static int run_worker(const std::string& name, bool decode) {
+    SharedMemory shm;
+    if (!shm.Open(name) || shm.Size() < sizeof(WorkerStatusBlock)) return 2;
+    WorkerStatusBlock* st = reinterpret_cast<WorkerStatusBlock*>(shm.Data());
+    if (st->magic != WorkerStatusBlock::kMagic) return 2;
+
+    av_log_set_level(AV_LOG_ERROR);
+    avformat_network_init();
+    int rc = 0;
+    if (decode) {
+        rc = run_decode_worker(st);
+    } else {
+        st->state[0].store(WorkerStatusBlock::Running);
+        EncodeProfile profile;
+        profile.preset = st->preset;
+        profile.video_encoder = st->video_encoder;
+        profile.tonemap = st->tonemap;
+        profile.audio_codec = st->audio_codec;
+        profile.fallback_audio_codec = st->fallback_audio_codec;
+        profile.stream_rules = st->stream_rules;
+        profile.extra_formats = st->extra_formats;
+        profile.loudnorm = st->loudnorm != 0;
+        profile.bit_rate = st->bit_rate;
+        profile.dec_threads = st->dec_threads;
+        profile.frame_pool = st->frame_pool != 0;
+        profile.sws_threads = st->sws_threads;
+        profile.enc_threads = st->enc_threads;
+        profile.thumb_tap = st->thumb_tap != 0;
+        profile.draft = st->draft != 0;
+        profile.draft_height = st->draft_height;
+        profile.cfr = st->cfr != 0;
+        profile.bit_depth = st->bit_depth;
+        profile.deinterlace = st->deinterlace;
+        profile.mkv_cues_kb = st->mkv_cues_kb;
+        profile.ts_muxrate = st->ts_muxrate;
+        profile.ts_pcr_period_ms = st->ts_pcr_period_ms;
+        profile.frag_duration_ms = st->frag_duration_ms;
+        // Never Run(): the detached thread object only hosts Entry() on this thread.
+        ConverterThread* job = new ConverterThread(nullptr, st->input, st->out_format, st->reencode != 0, profile);
+        job->AttachWorker(st, st->frame_ring);
+        job->RunInline();
+        delete job;
+    }
+    avformat_network_deinit();
+    return rc;
+}
+
+// Notified by wx when a worker process exits; deletes itself afterwards. Orphan() before the
+// frame goes away: wx still calls OnTerminate() for detached processes.
+class WorkerProcess : public wxProcess {
+public:
+    explicit WorkerProcess(MainFrame* frame) : m_frame(frame) {}
+    void Orphan() { m_frame = nullptr; }
+    virtual void OnTerminate(int pid, int status) override {
+        if (m_frame) m_frame->OnWorkerExit(pid, status);
+        delete this;
+    }
+private:
+    MainFrame* m_frame;
+};
+
+static long spawn_worker(MainFrame* frame, const std::string& shmName, bool decode, wxProcess** proc_out) {
+    wxString cmd = "\"" + wxStandardPaths::Get().GetExecutablePath() + "\" --worker " + shmName;
+    if (decode) cmd += " --decode";
+    WorkerProcess* proc = new WorkerProcess(frame);
+    long pid = wxExecute(cmd, wxEXEC_ASYNC|wxEXEC_HIDE_CONSOLE, proc);
+    if (pid <= 0) { delete proc; proc = nullptr; }
+    *proc_out = proc;
+    return pid;
+}
+
+bool MainFrame::StartWorkerJob(const std::string& in, const std::string& fmt, bool reencode, const EncodeProfile& profile) {
+    static int job_counter = 0;
+    std::string name = "wxffmpeg_" + std::to_string(wxGetProcessId()) + "_" + std::to_string(++job_counter);
+
+    // the job strings travel in fixed-size fields; a truncated path or rule set would run a different job
+    if (in.size() >= sizeof(WorkerStatusBlock::input) || profile.stream_rules.size() >= sizeof(WorkerStatusBlock::stream_rules) ||
+        profile.extra_formats.size() >= sizeof(WorkerStatusBlock::extra_formats)) {
+        m_log->AppendText("Input path, stream rules or extra formats too long for a worker process job");
+        return false;
+    }
+    m_workerShm = new SharedMemory();
+    if (!m_workerShm->Create(name, sizeof(WorkerStatusBlock))) { delete m_workerShm; m_workerShm = nullptr; return false; }
+    WorkerStatusBlock* st = new (m_workerShm->Data()) WorkerStatusBlock();
+    copy_job_string(st->input, sizeof(st->input), in);
+    copy_job_string(st->out_format, sizeof(st->out_format), fmt);
+    copy_job_string(st->preset, sizeof(st->preset), profile.preset);
+    copy_job_string(st->video_encoder, sizeof(st->video_encoder), profile.video_encoder);
+    copy_job_string(st->tonemap, sizeof(st->tonemap), profile.tonemap);
+    copy_job_string(st->audio_codec, sizeof(st->audio_codec), profile.audio_codec);
+    copy_job_string(st->fallback_audio_codec, sizeof(st->fallback_audio_codec), profile.fallback_audio_codec);
+    copy_job_string(st->stream_rules, sizeof(st->stream_rules), profile.stream_rules);
+    copy_job_string(st->extra_formats, sizeof(st->extra_formats), profile.extra_formats);
+    st->loudnorm = profile.loudnorm;
+    st->reencode = reencode;
+    st->bit_rate = profile.bit_rate;
+    st->dec_threads = profile.dec_threads;
+    st->sws_threads = profile.sws_threads;
+    st->enc_threads = profile.enc_threads;
+    st->thumb_tap = profile.thumb_tap;
+    st->draft = profile.draft;
+    st->frame_pool = profile.frame_pool;
+    st->draft_height = profile.draft_height;
+    st->cfr = profile.cfr;
+    st->bit_depth = profile.bit_depth;
+    st->deinterlace = profile.deinterlace;
+    st->mkv_cues_kb = profile.mkv_cues_kb;
+    st->ts_muxrate = profile.ts_muxrate;
+    st->ts_pcr_period_ms = profile.ts_pcr_period_ms;
+    st->frag_duration_ms = profile.frag_duration_ms;
+    st->video_stream.store(-1);
+    bool split = reencode && m_splitDecodeCheck->GetValue();
+    if (split) copy_job_string(st->frame_ring, sizeof(st->frame_ring), name + "_frames");
+    else st->state[1].store(WorkerStatusBlock::Finished);
+    st->magic = WorkerStatusBlock::kMagic;
+
+    m_workerLogNext = 0;
+    m_workersAlive = 0;
+    m_workerPids[0] = spawn_worker(this, name, false, &m_workerProcs[0]);
+    if (m_workerPids[0] <= 0) { delete m_workerShm; m_workerShm = nullptr; return false; }
+    m_workersAlive++;
+    if (split) {
+        m_workerPids[1] = spawn_worker(this, name, true, &m_workerProcs[1]);
+        if (m_workerPids[1] <= 0) {
+            m_log->AppendText("Failed to start decode worker");
+            st->cancel.store(1);
+        } else {
+            m_workersAlive++;
+        }
+    }
+    m_workerTimer.Start(100);
+    return true;
+}
+
+// Copy new log lines and progress from the shared status block into the GUI.
+void MainFrame::DrainWorkerStatus() {
+    if (!m_workerShm) return;
+    WorkerStatusBlock* st = reinterpret_cast<WorkerStatusBlock*>(m_workerShm->Data());
+    m_progress->SetValue(st->progress.load());
+    uint32_t head = st->log_head.load();
+    if (head - m_workerLogNext > WorkerStatusBlock::kLogSlots) {
+        m_log->AppendText("(" + std::to_string(head - m_workerLogNext - WorkerStatusBlock::kLogSlots) + " worker log lines dropped)");
+        m_workerLogNext = head - WorkerStatusBlock::kLogSlots;
+    }
+    while (m_workerLogNext != head) {
+        WorkerStatusBlock::LogSlot& slot = st->log[m_workerLogNext % WorkerStatusBlock::kLogSlots];
+        if (slot.seq.load(std::memory_order_acquire) != m_workerLogNext + 1) break; // still being written
+        std::string text(slot.text);
+        if (slot.seq.load(std::memory_order_acquire) != m_workerLogNext + 1) break; // overwritten meanwhile
+        m_log->AppendText(text);
+        m_workerLogNext++;
+    }
+}
+
+void MainFrame::OnWorkerTimer(wxTimerEvent&) {
+    DrainWorkerStatus();
+}
+
+void MainFrame::OnWorkerExit(int pid, int status) {
+    if (!m_workerShm) return;
+    WorkerStatusBlock* st = reinterpret_cast<WorkerStatusBlock*>(m_workerShm->Data());
+    int role = (pid == m_workerPids[1]) ? 1 : 0;
+    m_workerProcs[role] = nullptr; // deletes itself after this call
+    if (st->state[role].load() != WorkerStatusBlock::Finished) {
+        m_log->AppendText(std::string(role ? "Decode" : "Conversion") + " worker terminated abnormally (status "
+                          + std::to_string(status) + ")");
+        st->state[role].store(WorkerStatusBlock::Finished);
+        if (role == 0) st->cancel.store(1); // nobody is consuming the decode worker's frames
+    }
+    if (--m_workersAlive <= 0) FinishWorkerJob();
+}
+
+void MainFrame::FinishWorkerJob() {
+    m_workerTimer.Stop();
+    DrainWorkerStatus();
+    delete m_workerShm;
+    m_workerShm = nullptr;
+    m_workerPids[0] = m_workerPids[1] = 0;
+    m_running.store(false);
+}
+
+// The window is going away: ask running workers to stop and stop listening for their exit.
+// The shared segment is unlinked here; workers keep their own mapping until they finish.
+void MainFrame::AbandonWorkers() {
+    if (!m_workerShm) return;
+    reinterpret_cast<WorkerStatusBlock*>(m_workerShm->Data())->cancel.store(1);
+    for (wxProcess*& p : m_workerProcs) {
+        if (p) { static_cast<WorkerProcess*>(p)->Orphan(); p->Detach(); }
+        p = nullptr;
+    }
+    m_workerTimer.Stop();
+    delete m_workerShm;
+    m_workerShm = nullptr;
+}
+
+// ---- chunked / distributed encoding ----
+//
+// A re-encode job can be split into GOP-aligned chunks that are encoded independently. The
+// coordinator (RunDistributed) listens on kChunkPort; chunk workers (`--chunk-worker host:port`)
+// connect, receive one chunk job at a time, encode the chunk from the (shared) input path and send
+// the encoded chunk back over the socket. Local worker processes are started automatically; other
+// hosts can join by running the same command against the coordinator. Failed chunks are retried
+// on any worker; finally the chunks are concatenated with the copied non-video streams.
+//
+// The coordinator only listens on loopback unless remote workers are enabled, and every worker
+// must present the job's random token (passed in the kChunkTokenEnv environment variable) in its Hello.
+
+static const unsigned short kChunkPort = 47800;
+static const int kChunkMaxAttempts = 3;
+static const double kChunkTargetSeconds = 10.0;
+static const int64_t kChunkCacheMaxBytes = 20LL << 30;
+static const uint32_t kChunkMaxControlMsg = 64 << 10; // Hello and Job payloads
+static const uint32_t kChunkMaxResultMsg = 1U << 30;  // one encoded chunk
+
+// Per-job secret for the chunk worker handshake: 128 random bits as hex.
+static std::string chunk_session_token() {
+    std::random_device rd;
+    char hex[33];
+    for (int i = 0; i < 4; ++i) snprintf(hex + 8 * i, 9, "%08x", (unsigned)rd());
+    return hex;
+}
+
+// Compares without an early exit so the time taken does not reveal a matching prefix.
+static bool tokens_equal(const std::string& a, const std::string& b) {
+    if (a.size() != b.size()) return false;
+    unsigned char diff = 0;
+    for (size_t i = 0; i < a.size(); ++i) diff |= (unsigned char)(a[i] ^ b[i]);
+    return diff == 0;
+}
+
+struct ChunkRange {
+    int index;
+    int64_t start;    // pts of the chunk's first keyframe (video stream time base)
+    int64_t end;      // pts of the next chunk's keyframe, AV_NOPTS_VALUE for the last chunk
+    std::string key;  // content address in the chunk cache, empty when caching is off
+};
+
+// Everything besides the source bytes that changes an encoded chunk.
+static std::string chunk_settings_key(const EncodeProfile& prof, AVRational tb) {
+    std::ostringstream os;
+    os << (prof.video_encoder.empty() ? "libx264" : prof.video_encoder) << "|preset=" << prof.preset << "|bit_rate=" << prof.bit_rate << "|tb=" << tb.num << "/" << tb.den;
+    if (prof.draft) os << "|draft=" << prof.draft_height;
+    if (prof.cfr) os << "|cfr";
+    if (prof.deinterlace > 0) os << "|deint=" << (prof.top_field_first ? "tff" : "bff");
+    if (!prof.tonemap.empty()) os << "|tonemap=" << prof.tonemap;
+    if (prof.bit_depth) os << "|depth=" << prof.bit_depth;
+    return os.str();
+}
+
+// Incremental SHA-256 over a chunk's packets; finalized into the chunk's cache key.
+class ChunkHasher {
+public:
+    ChunkHasher() { if (av_hash_alloc(&m_ctx, "SHA256") >= 0) av_hash_init(m_ctx); }
+    ~ChunkHasher() { av_hash_freep(&m_ctx); }
+    ChunkHasher(const ChunkHasher&) = delete;
+    ChunkHasher& operator=(const ChunkHasher&) = delete;
+    void Update(const uint8_t* data, size_t size) { if (m_ctx) av_hash_update(m_ctx, data, size); }
+    void Update(const std::string& s) { Update((const uint8_t*)s.data(), s.size()); }
+    std::string Final() {
+        if (!m_ctx) return std::string();
+        uint8_t hex[2 * AV_HASH_MAX_SIZE + 1];
+        av_hash_final_hex(m_ctx, hex, sizeof(hex));
+        return std::string((const char*)hex);
+    }
+private:
+    AVHashContext* m_ctx = nullptr;
+};
+
+static std::string chunk_cache_dir() {
+    std::string dir = user_cache_file("chunks");
+    if (!wxFileName::DirExists(dir)) wxFileName::Mkdir(dir, 0777, wxPATH_MKDIR_FULL);
+    return dir;
+}
+
+static std::string chunk_cache_path(const std::string& key) {
+    return chunk_cache_dir() + "/" + key + ".nut";
+}
+
+// Drop least recently used chunks until the cache fits in max_bytes (hits are touched on use).
+static void prune_chunk_cache(int64_t max_bytes) {
+    std::string dir = chunk_cache_dir();
+    wxDir d(dir);
+    if (!d.IsOpened()) return;
+    struct Item { time_t mtime; int64_t size; std::string path; };
+    std::vector<Item> items;
+    int64_t total = 0;
+    wxString name;
+    for (bool more = d.GetFirst(&name, "*.nut", wxDIR_FILES); more; more = d.GetNext(&name)) {
+        wxFileName fn(dir + "/" + std::string(name.mb_str()));
+        Item it{fn.GetModificationTime().GetTicks(), (int64_t)fn.GetSize().GetValue(), dir + "/" + std::string(name.mb_str())};
+        total += it.size;
+        items.push_back(it);
+    }
+    std::sort(items.begin(), items.end(), [](const Item& a, const Item& b) { return a.mtime < b.mtime; });
+    for (const Item& it : items) {
+        if (total <= max_bytes) break;
+        if (wxRemoveFile(it.path)) total -= it.size;
+    }
+}
+
+// Split video stream vidx (main_video_stream()) at keyframes into chunks of at least target_secs.
+// Only the demuxer runs here; nothing is decoded. With cache_prof set every chunk also gets a
+// content address: SHA-256 of the encoder settings, its range and the packets that feed it
+// (decode order from its keyframe, plus open-GOP leading packets after the next keyframe).
+static int plan_chunks(const std::string& in, int vidx, double target_secs, const EncodeProfile* cache_prof,
+                       std::vector<ChunkRange>* chunks, AVRational* tb) {
+    AVFormatContext* in_ctx = nullptr;
+    int ret = avformat_open_input(&in_ctx, in.c_str(), NULL, NULL);
+    if (ret < 0) return ret;
+    if ((ret = avformat_find_stream_info(in_ctx, NULL)) < 0) { avformat_close_input(&in_ctx); return ret; }
+    if (vidx < 0 || vidx >= (int)in_ctx->nb_streams) { avformat_close_input(&in_ctx); return AVERROR_STREAM_NOT_FOUND; }
+    for (unsigned i = 0; i < in_ctx->nb_streams; i++)
+        if ((int)i != vidx) in_ctx->streams[i]->discard = AVDISCARD_ALL;
+    *tb = in_ctx->streams[vidx]->time_base;
+    int64_t target = av_rescale_q((int64_t)(target_secs * AV_TIME_BASE), {1, AV_TIME_BASE}, *tb);
+
+    bool hashing = cache_prof != nullptr;
+    std::string settings_key = hashing ? chunk_settings_key(*cache_prof, *tb) : std::string();
+    std::vector<std::unique_ptr<ChunkHasher>> hashers;
+    AVPacket* pkt = av_packet_alloc();
+    while (av_read_frame(in_ctx, pkt) >= 0) {
+        int64_t ts = pkt->pts != AV_NOPTS_VALUE ? pkt->pts : pkt->dts;
+        if (pkt->stream_index == vidx && (pkt->flags & AV_PKT_FLAG_KEY) && ts != AV_NOPTS_VALUE) {
+            if (chunks->empty() || ts - chunks->back().start >= target) {
+                if (!chunks->empty()) chunks->back().end = ts;
+                chunks->push_back({(int)chunks->size(), ts, AV_NOPTS_VALUE, std::string()});
+                if (hashing) hashers.emplace_back(new ChunkHasher());
+            }
+        }
+        if (hashing && pkt->stream_index == vidx && !hashers.empty()) {
+            size_t cur = hashers.size() - 1;
+            hashers[cur]->Update(pkt->data, pkt->size);
+            if (cur > 0 && pkt->pts != AV_NOPTS_VALUE && pkt->pts < (*chunks)[cur].start)
+                hashers[cur - 1]->Update(pkt->data, pkt->size);
+        }
+        av_packet_unref(pkt);
+    }
+    av_packet_free(&pkt);
+    avformat_close_input(&in_ctx);
+    for (size_t i = 0; i < hashers.size(); ++i) {
+        const ChunkRange& c = (*chunks)[i];
+        hashers[i]->Update(settings_key + "|" + std::to_string(c.start) + "|" + std::to_string(c.end));
+        (*chunks)[i].key = hashers[i]->Final();
+    }
+    return chunks->empty() ? AVERROR_INVALIDDATA : 0;
+}
+
+// Encode the frames of one chunk (pts in [start, end)) of the first video stream into a
+// video-only NUT file. Timestamps stay on the source timeline so chunks can be concatenated.
+// When deinterlacing, the frame before `start` and the one at `end` are decoded as well and
+// feed the deinterlacer only, so boundary frames see the same neighbours as in one long run.
+static int encode_chunk(const std::string& in, int stream_index, int64_t start, int64_t end, const EncodeProfile& prof,
+                        const std::string& out_path, std::string* err) {
+    AVFormatContext* in_ctx = nullptr;
+    AVFormatContext* out_ctx = nullptr;
+    AVCodecContext* dec_ctx = nullptr;
+    AVCodecContext* enc_ctx = nullptr;
+    AVFrame* frame = av_frame_alloc();
+    AVFrame* lead = av_frame_alloc(); // last frame before `start`, deinterlacer context only
+    AVPacket* pkt = av_packet_alloc();
+    AVPacket* enc_pkt = av_packet_alloc();
+    AVStream* in_stream = nullptr;
+    AVStream* out_stream = nullptr;
+    int vidx = -1;
+    bool done = false, tail = false, skip_lead = false;
+    FrameTimestamps timestamps;
+    Deinterlacer deint;
+    ToneMapper tonemapper;
+    EncoderInput input;
+    FramePool pool;
+
+    // Timestamp, tone map, scale and encode one (deinterlaced) frame into the chunk file
+    auto encode_pic = [&](AVFrame* pic) -> int {
+        int64_t enc_pts = timestamps.Next(pic->best_effort_timestamp != AV_NOPTS_VALUE ? pic->best_effort_timestamp : pic->pts);
+        if (enc_pts == AV_NOPTS_VALUE) return 0;
+        if (tonemapper.Active() && tonemapper.Apply(pic, &pic) < 0) { *err = "tone mapping failed"; return AVERROR(ENOMEM); }
+        AVFrame* enc_frame = nullptr;
+        int ret = input.Convert(pic, &enc_frame);
+        if (ret < 0) { *err = "pixel format conversion failed"; return ret; }
+        enc_frame->pts = enc_pts;
+        if ((ret = avcodec_send_frame(enc_ctx, enc_frame)) < 0) { *err = "error sending frame to encoder"; return ret; }
+        while (avcodec_receive_packet(enc_ctx, enc_pkt) >= 0) {
+            av_packet_rescale_ts(enc_pkt, enc_ctx->time_base, out_stream->time_base);
+            enc_pkt->stream_index = out_stream->index;
+            if ((ret = av_interleaved_write_frame(out_ctx, enc_pkt)) < 0) { *err = "error writing chunk"; return ret; }
+        }
+        return 0;
+    };
+
+    int ret = avformat_open_input(&in_ctx, in.c_str(), NULL, NULL);
+    if (ret < 0 || (ret = avformat_find_stream_info(in_ctx, NULL)) < 0) { *err = "failed to open input"; goto cleanup; }
+    for (unsigned i = 0; i < in_ctx->nb_streams; i++) {
+        if ((int)i == stream_index && in_ctx->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO) vidx = i;
+        else in_ctx->streams[i]->discard = AVDISCARD_ALL;
+    }
+    if (vidx < 0) { ret = AVERROR_STREAM_NOT_FOUND; *err = "no video stream"; goto cleanup; }
+    in_stream = in_ctx->streams[vidx];
+    {
+        const AVCodec* dec = avcodec_find_decoder(in_stream->codecpar->codec_id);
+        if (!dec) { ret = AVERROR_DECODER_NOT_FOUND; *err = "decoder not found"; goto cleanup; }
+        dec_ctx = avcodec_alloc_context3(dec);
+        avcodec_parameters_to_context(dec_ctx, in_stream->codecpar);
+        apply_decoder_profile(dec_ctx, dec, prof);
+        if (prof.frame_pool) pool.Attach(dec_ctx);
+        if ((ret = avcodec_open2(dec_ctx, dec, NULL)) < 0) { *err = "failed to open decoder"; goto cleanup; }
+    }
+    if ((ret = open_video_encoder(dec_ctx, guess_video_framerate(in_ctx, vidx), prof, &enc_ctx, in_stream->time_base)) < 0) { *err = "failed to open encoder"; goto cleanup; }
+    timestamps.Init(in_stream->time_base, enc_ctx->time_base, guess_video_framerate(in_ctx, vidx), prof.cfr);
+    if (prof.deinterlace > 0 && (ret = deint.Init(dec_ctx->width, dec_ctx->height, dec_ctx->pix_fmt, prof.top_field_first, prof.sws_threads)) < 0) {
+        *err = "deinterlacing not supported for this pixel format"; goto cleanup;
+    }
+    if ((ret = tonemapper.Init(dec_ctx, prof, prof.sws_threads)) < 0) { *err = "failed to set up tone mapping"; goto cleanup; }
+
+    avformat_alloc_output_context2(&out_ctx, NULL, "nut", out_path.c_str());
+    if (!out_ctx || !(out_stream = avformat_new_stream(out_ctx, NULL))) { ret = AVERROR(ENOMEM); *err = "could not create chunk file"; goto cleanup; }
+    avcodec_parameters_from_context(out_stream->codecpar, enc_ctx);
+    out_stream->time_base = enc_ctx->time_base;
+    if ((ret = avio_open(&out_ctx->pb, out_path.c_str(), AVIO_FLAG_WRITE)) < 0 ||
+        (ret = avformat_write_header(out_ctx, NULL)) < 0) { *err = "could not write chunk file"; goto cleanup; }
+
+    if ((ret = input.Init(dec_ctx, enc_ctx, prof)) < 0) { *err = "failed to create scaler"; goto cleanup; }
+
+    // The deinterlacer needs the previous chunk's last frame, so seek to the keyframe before `start`
+    ret = AVERROR(EINVAL);
+    if (deint.Active() && start > (in_stream->start_time != AV_NOPTS_VALUE ? in_stream->start_time : 0))
+        ret = av_seek_frame(in_ctx, vidx, start - 1, AVSEEK_FLAG_BACKWARD);
+    if (ret < 0 && (ret = av_seek_frame(in_ctx, vidx, start, AVSEEK_FLAG_BACKWARD)) < 0) { *err = "seek failed"; goto cleanup; }
+
+    // Decode until the first frame at or past `end`. Frames before `start` (leading pictures of
+    // an open GOP) belong to the previous chunk.
+    while (!done) {
+        ret = av_read_frame(in_ctx, pkt);
+        bool eof = ret < 0;
+        if (!eof && pkt->stream_index != vidx) { av_packet_unref(pkt); continue; }
+        avcodec_send_packet(dec_ctx, eof ? NULL : pkt);
+        av_packet_unref(pkt);
+        while (!done && avcodec_receive_frame(dec_ctx, frame) >= 0) {
+            int64_t pts = frame->best_effort_timestamp != AV_NOPTS_VALUE ? frame->best_effort_timestamp : frame->pts;
+            if (end != AV_NOPTS_VALUE && pts >= end) { done = tail = true; break; }
+            if (pts < start) {
+                if (deint.Active()) { av_frame_unref(lead); av_frame_move_ref(lead, frame); }
+                else av_frame_unref(frame);
+                continue;
+            }
+            AVFrame* pic = frame;
+            if (deint.Active()) {
+                if (lead->buf[0]) {
+                    // queued first; its own output (next call) belongs to the previous chunk
+                    if ((ret = deint.Filter(lead, &pic)) < 0) { *err = "deinterlacing failed"; goto cleanup; }
+                    av_frame_unref(lead);
+                    skip_lead = true;
+                }
+                ret = deint.Filter(frame, &pic);
+                if (ret > 0 && skip_lead) { skip_lead = false; ret = 0; }
+                if (ret <= 0) {
+                    av_frame_unref(frame);
+                    if (ret < 0) { *err = "deinterlacing failed"; goto cleanup; }
+                    continue;
+                }
+            }
+            ret = encode_pic(pic);
+            av_frame_unref(frame);
+            if (ret < 0) goto cleanup;
+        }
+        if (eof) done = true;
+    }
+    if (deint.Active()) {
+        // the frame at `end` completes the last one; only the source's final frame has no successor
+        AVFrame* pic = nullptr;
+        ret = deint.Filter(tail ? frame : nullptr, &pic);
+        if (ret < 0) { *err = "deinterlacing failed"; goto cleanup; }
+        if (ret > 0 && (ret = encode_pic(pic)) < 0) goto cleanup;
+    }
+
+    avcodec_send_frame(enc_ctx, NULL);
+    while (avcodec_receive_packet(enc_ctx, enc_pkt) >= 0) {
+        av_packet_rescale_ts(enc_pkt, enc_ctx->time_base, out_stream->time_base);
+        enc_pkt->stream_index = out_stream->index;
+        if ((ret = av_interleaved_write_frame(out_ctx, enc_pkt)) < 0) { *err = "error writing chunk"; goto cleanup; }
+    }
+    ret = av_write_trailer(out_ctx);
+
+cleanup:
+    av_packet_free(&enc_pkt);
+    av_packet_free(&pkt);
+    av_frame_free(&lead);
+    av_frame_free(&frame);
+    avcodec_free_context(&enc_ctx);
+    avcodec_free_context(&dec_ctx);
+    if (out_ctx) {
+        if (out_ctx->pb) avio_closep(&out_ctx->pb);
+        avformat_free_context(out_ctx);
+    }
+    avformat_close_input(&in_ctx);
+    return ret < 0 ? ret : 0;
+}
+
+// Concatenate encoded chunk files (in order) as the video stream of the output and copy every
+// other input stream, merging both packet sources by dts so the muxer buffers little.
+static int assemble_chunks(const std::string& in, int video_index, const std::vector<std::string>& chunk_files,
+                           const std::string& out_filename, const std::string& out_format,
+                           const EncodeProfile& prof, std::string* err) {
+    AVFormatContext* in_ctx = nullptr;
+    AVFormatContext* out_ctx = nullptr;
+    AVFormatContext* chunk_ctx = nullptr;
+    AVPacket* src_pkt = av_packet_alloc();
+    AVPacket* vid_pkt = av_packet_alloc();
+    std::vector<int> stream_mapping;
+    size_t next_chunk = 0;
+    int vidx = -1;
+    bool src_ok = false, vid_ok = false;
+
+    // Read the next video packet, moving on to the next chunk file at the end of one; false once
+    // all chunks are consumed (vid_status AVERROR_EOF) or on a read/open error (vid_status < 0).
+    int vid_status = 0;
+    bool vid_open_failed = false;
+    auto read_video = [&]() -> bool {
+        while (true) {
+            if (chunk_ctx) {
+                if ((vid_status = av_read_frame(chunk_ctx, vid_pkt)) >= 0) return true;
+                if (vid_status != AVERROR_EOF) return false;
+            }
+            avformat_close_input(&chunk_ctx);
+            if (next_chunk >= chunk_files.size()) return false;
+            if ((vid_status = avformat_open_input(&chunk_ctx, chunk_files[next_chunk++].c_str(), NULL, NULL)) < 0) {
+                vid_open_failed = true;
+                return false;
+            }
+        }
+    };
+    int src_status = 0; // last av_read_frame() result on the source, AVERROR_EOF at the end
+    auto read_source = [&]() -> bool {
+        while ((src_status = av_read_frame(in_ctx, src_pkt)) >= 0) {
+            if (src_pkt->stream_index != vidx && stream_mapping[src_pkt->stream_index] >= 0) return true;
+            av_packet_unref(src_pkt);
+        }
+        return false;
+    };
+
+    int ret = avformat_open_input(&in_ctx, in.c_str(), NULL, NULL);
+    if (ret < 0 || (ret = avformat_find_stream_info(in_ctx, NULL)) < 0) { *err = "failed to open input"; goto cleanup; }
+    apply_stream_selection(in_ctx, prof.stream_rules);
+    if ((ret = avformat_open_input(&chunk_ctx, chunk_files[0].c_str(), NULL, NULL)) < 0 ||
+        (ret = avformat_find_stream_info(chunk_ctx, NULL)) < 0) { *err = "failed to open first chunk"; goto cleanup; }
+    next_chunk = 1;
+
+    avformat_alloc_output_context2(&out_ctx, NULL, container_muxer(out_format).c_str(), out_filename.c_str());
+    if (!out_ctx) { ret = AVERROR(EINVAL); *err = "could not create output context"; goto cleanup; }
+    stream_mapping.assign(in_ctx->nb_streams, -1);
+    for (unsigned i = 0; i < in_ctx->nb_streams; ++i) {
+        // the chunks carry video_index; other deselected streams are left out
+        bool is_video = (int)i == video_index;
+        if (!is_video && in_ctx->streams[i]->discard == AVDISCARD_ALL) continue;
+        AVStream* out_stream = avformat_new_stream(out_ctx, NULL);
+        if (!out_stream) { ret = AVERROR(ENOMEM); *err = "failed allocating output stream"; goto cleanup; }
+        if (is_video) {
+            vidx = i;
+            ret = avcodec_parameters_copy(out_stream->codecpar, chunk_ctx->streams[0]->codecpar);
+            out_stream->time_base = chunk_ctx->streams[0]->time_base;
+        } else {
+            ret = avcodec_parameters_copy(out_stream->codecpar, in_ctx->streams[i]->codecpar);
+            in_ctx->streams[i]->discard = AVDISCARD_DEFAULT;
+        }
+        if (ret < 0) { *err = "failed to copy codec parameters"; goto cleanup; }
+        out_stream->codecpar->codec_tag = 0;
+        stream_mapping[i] = out_stream->index;
+    }
+    if (vidx >= 0) in_ctx->streams[vidx]->discard = AVDISCARD_ALL;
+
+    if (!(out_ctx->oformat->flags & AVFMT_NOFILE) && (ret = avio_open(&out_ctx->pb, out_filename.c_str(), AVIO_FLAG_WRITE)) < 0) { *err = "could not open output file"; goto cleanup; }
+    if ((ret = write_container_header(out_ctx, out_format, prof)) < 0) { *err = "error writing header"; goto cleanup; }
+
+    src_ok = read_source();
+    vid_ok = read_video();
+    while (src_ok || vid_ok) {
+        if (!vid_ok && vid_status != AVERROR_EOF) break; // chunk missing or unreadable, fails below
+        bool take_video = vid_ok;
+        if (vid_ok && src_ok) {
+            AVStream* vs = chunk_ctx->streams[vid_pkt->stream_index];
+            AVStream* ss = in_ctx->streams[src_pkt->stream_index];
+            int64_t vts = vid_pkt->dts != AV_NOPTS_VALUE ? vid_pkt->dts : vid_pkt->pts;
+            int64_t sts = src_pkt->dts != AV_NOPTS_VALUE ? src_pkt->dts : src_pkt->pts;
+            take_video = av_compare_ts(vts, vs->time_base, sts, ss->time_base) <= 0;
+        }
+        if (take_video) {
+            AVStream* out_stream = out_ctx->streams[stream_mapping[vidx]];
+            av_packet_rescale_ts(vid_pkt, chunk_ctx->streams[vid_pkt->stream_index]->time_base, out_stream->time_base);
+            vid_pkt->stream_index = out_stream->index;
+            vid_pkt->pos = -1;
+            ret = av_interleaved_write_frame(out_ctx, vid_pkt);
+            vid_ok = read_video();
+        } else {
+            AVStream* out_stream = out_ctx->streams[stream_mapping[src_pkt->stream_index]];
+            av_packet_rescale_ts(src_pkt, in_ctx->streams[src_pkt->stream_index]->time_base, out_stream->time_base);
+            src_pkt->stream_index = out_stream->index;
+            src_pkt->pos = -1;
+            ret = av_interleaved_write_frame(out_ctx, src_pkt);
+            src_ok = read_source();
+        }
+        if (ret < 0) { *err = "error muxing packet"; goto cleanup; }
+    }
+    if (vid_status != AVERROR_EOF) {
+        ret = vid_status < 0 ? vid_status : AVERROR_BUG;
+        *err = (vid_open_failed ? "failed to open chunk " : "error reading chunk ") + std::to_string(next_chunk - 1);
+        goto cleanup;
+    }
+    if (src_status < 0 && src_status != AVERROR_EOF) { ret = src_status; *err = "error reading input"; goto cleanup; }
+    ret = av_write_trailer(out_ctx);
+
+cleanup:
+    av_packet_free(&vid_pkt);
+    av_packet_free(&src_pkt);
+    avformat_close_input(&chunk_ctx);
+    if (out_ctx) {
+        if (!(out_ctx->oformat->flags & AVFMT_NOFILE)) avio_closep(&out_ctx->pb);
+        avformat_free_context(out_ctx);
+    }
+    avformat_close_input(&in_ctx);
+    return ret < 0 ? ret : 0;
+}
+
+// Wire protocol: [type u32 BE][length u32 BE][payload]. Job and Hello payloads are
+// "key=value" lines; a Result payload is "index status\n" followed by the chunk file bytes.
+enum ChunkMsgType : uint32_t { ChunkMsgHello = 1, ChunkMsgJob = 2, ChunkMsgResult = 3, ChunkMsgBye = 4 };
+
+static bool send_chunk_msg(wxSocketBase* sock, uint32_t type, const std::string& payload) {
+    uint8_t hdr[8];
+    uint32_t len = (uint32_t)payload.size();
+    for (int i = 0; i < 4; ++i) { hdr[i] = (uint8_t)(type >> (24 - 8 * i)); hdr[4 + i] = (uint8_t)(len >> (24 - 8 * i)); }
+    sock->Write(hdr, 8);
+    if (sock->Error() || sock->LastCount() != 8) return false;
+    if (len) {
+        sock->Write(payload.data(), len);
+        if (sock->Error() || sock->LastCount() != len) return false;
+    }
+    return true;
+}
+
+// Waits in short slices so the caller can give up (stop flag, cancellation) while a peer is busy.
+// Messages longer than max_len fail without being read.
+static bool recv_chunk_msg(wxSocketBase* sock, uint32_t* type, std::string* payload, uint32_t max_len,
+                           const std::atomic<bool>* stop, int timeout_secs) {
+    for (int waited = 0; !sock->WaitForRead(0, 200); waited += 200) {
+        if (!sock->IsConnected() || (stop && stop->load()) || waited / 1000 >= timeout_secs) return false;
+    }
+    uint8_t hdr[8];
+    sock->Read(hdr, 8);
+    if (sock->Error() || sock->LastCount() != 8) return false;
+    uint32_t len = 0;
+    *type = 0;
+    for (int i = 0; i < 4; ++i) { *type = (*type << 8) | hdr[i]; len = (len << 8) | hdr[4 + i]; }
+    if (len > max_len) return false;
+    payload->resize(len);
+    if (len) {
+        sock->Read(&(*payload)[0], len);
+        if (sock->Error() || sock->LastCount() != len) return false;
+    }
+    return true;
+}
+
+static std::map<std::string, std::string> parse_kv_lines(const std::string& text) {
+    std::map<std::string, std::string> kv;
+    std::istringstream is(text);
+    std::string line;
+    while (std::getline(is, line)) {
+        size_t eq = line.find('=');
+        if (eq != std::string::npos) kv[line.substr(0, eq)] = line.substr(eq + 1);
+    }
+    return kv;
+}
+
+static bool read_file_bytes(const std::string& path, std::string* out) {
+    std::ifstream f(path, std::ios::binary);
+    if (!f) return false;
+    std::ostringstream os;
+    os << f.rdbuf();
+    *out = os.str();
+    return true;
+}
+
+static bool write_file_bytes(const std::string& path, const char* data, size_t size) {
+    std::ofstream f(path, std::ios::binary | std::ios::trunc);
+    f.write(data, (std::streamsize)size);
+    return (bool)f;
+}
+
+// Hands chunks to connected workers, collects results and re-queues failed chunks.
+class ChunkCoordinator {
+public:
+    // Chunks with a cache key are written into the chunk cache, and cached ones are not sent out
+    // at all; the rest go to tmp_prefix<index>.nut.
+    // Workers must send `token` in their Hello.
+    ChunkCoordinator(const std::string& input, int stream_index, const EncodeProfile& prof, const std::vector<ChunkRange>& chunks,
+                     const std::string& tmp_prefix, const std::string& token)
+        : m_input(input), m_streamIndex(stream_index), m_profile(prof), m_chunks(chunks), m_attempts(chunks.size(), 0),
+          m_files(chunks.size()), m_tmpPrefix(tmp_prefix), m_token(token) {
+        for (const ChunkRange& c : chunks) {
+            std::string cached = c.key.empty() ? std::string() : chunk_cache_path(c.key);
+            if (!cached.empty() && wxFileName::FileExists(cached)) {
+                wxFileName(cached).Touch();
+                m_files[c.index] = cached;
+                m_done++;
+                m_reused++;
+            } else {
+                m_pending.push_back(c.index);
+            }
+        }
+    }
+
+    int Reused() const { return m_reused; }
+    bool IsCacheFile(int idx) const { return !m_chunks[idx].key.empty(); }
+
+    // Accept workers until every chunk is encoded, a chunk ran out of attempts, `cancelled`
+    // returns true or no worker has been connected for a minute.
+    bool Run(wxSocketServer* server, const std::function<bool()>& cancelled,
+             const std::function<void(int, int)>& progress, const std::function<void(const std::string&)>& log) {
+        std::vector<std::thread> conns;
+        auto idle_since = std::chrono::steady_clock::now();
+        int last_done = -1;
+        while (true) {
+            int done, live;
+            { std::lock_guard<std::mutex> lock(m_lock); done = m_done; live = m_live; }
+            if (done != last_done) { progress(done, (int)m_chunks.size()); last_done = done; }
+            if (done == (int)m_chunks.size() || m_failed.load()) break;
+            if (cancelled()) { log("Conversion cancelled"); m_failed.store(true); break; }
+            if (live > 0) idle_since = std::chrono::steady_clock::now();
+            else if (seconds_since(idle_since) > 60) { log("No chunk workers connected"); m_failed.store(true); break; }
+
+            if (server->WaitForAccept(0, 200)) {
+                wxSocketBase* sock = server->Accept(false);
+                if (sock) {
+                    sock->SetFlags(wxSOCKET_BLOCK|wxSOCKET_WAITALL);
+                    { std::lock_guard<std::mutex> lock(m_lock); m_live++; }
+                    conns.emplace_back(&ChunkCoordinator::Serve, this, sock);
+                }
+            }
+            std::string msg;
+            while (PopMessage(&msg)) log(msg);
+        }
+        m_stop.store(true);
+        for (std::thread& t : conns) t.join();
+        std::string msg;
+        while (PopMessage(&msg)) log(msg);
+        return !m_failed.load();
+    }
+
+    const std::vector<std::string>& Files() const { return m_files; }
+
+private:
+    void Post(const std::string& msg) { std::lock_guard<std::mutex> lock(m_lock); m_messages.push_back(msg); }
+    bool PopMessage(std::string* msg) {
+        std::lock_guard<std::mutex> lock(m_lock);
+        if (m_messages.empty()) return false;
+        *msg = m_messages.front(); m_messages.pop_front();
+        return true;
+    }
+
+    // Take the next pending chunk; -1 when there is none right now (others may still fail and
+    // be re-queued), -2 when the job is complete or aborted.
+    int NextChunk() {
+        std::lock_guard<std::mutex> lock(m_lock);
+        if (m_stop.load() || m_failed.load() || m_done == (int)m_chunks.size()) return -2;
+        if (m_pending.empty()) return -1;
+        int idx = m_pending.front(); m_pending.pop_front();
+        return idx;
+    }
+
+    void Requeue(int idx, const std::string& why) {
+        std::lock_guard<std::mutex> lock(m_lock);
+        if (++m_attempts[idx] >= kChunkMaxAttempts) {
+            m_messages.push_back("Chunk " + std::to_string(idx) + " failed " + std::to_string(kChunkMaxAttempts) + " times: " + why);
+            m_failed.store(true);
+        } else {
+            m_messages.push_back("Chunk " + std::to_string(idx) + " failed (" + why + "), retrying");
+            m_pending.push_front(idx);
+        }
+    }
+
+    // One connection: send jobs one at a time until the job completes or the worker goes away.
+    void Serve(wxSocketBase* sock) {
+        std::string worker = "worker";
+        uint32_t type;
+        std::string payload;
+        if (recv_chunk_msg(sock, &type, &payload, kChunkMaxControlMsg, &m_stop, 30) && type == ChunkMsgHello) {
+            std::map<std::string, std::string> hello = parse_kv_lines(payload);
+            worker = hello["host"];
+            if (!tokens_equal(hello["token"], m_token)) {
+                wxIPV4address peer;
+                sock->GetPeer(peer);
+                Post("Rejected chunk worker " + std::string(peer.IPAddress().mb_str()) + ": wrong session token");
+                type = 0;
+            }
+        } else {
+            type = 0;
+        }
+        if (type == ChunkMsgHello) Post("Chunk worker connected: " + worker);
+
+        while (type == ChunkMsgHello) {
+            int idx = NextChunk();
+            if (idx == -2) { send_chunk_msg(sock, ChunkMsgBye, std::string()); break; }
+            if (idx == -1) { std::this_thread::sleep_for(std::chrono::milliseconds(100)); continue; }
+
+            const ChunkRange& c = m_chunks[idx];
+            std::ostringstream job;
+            job << "input=" << m_input << "\nstream=" << m_streamIndex << "\nindex=" << c.index << "\nstart=" << c.start << "\nend=" << c.end
+                << "\npreset=" << m_profile.preset << "\nvideo_encoder=" << m_profile.video_encoder << "\nbit_rate=" << m_profile.bit_rate
+                << "\ndec_threads=" << m_profile.dec_threads << "\nframe_pool=" << m_profile.frame_pool << "\nsws_threads=" << m_profile.sws_threads
+                << "\nenc_threads=" << m_profile.enc_threads
+                << "\ndraft=" << m_profile.draft << "\ndraft_height=" << m_profile.draft_height
+                << "\ncfr=" << m_profile.cfr << "\ntonemap=" << m_profile.tonemap << "\nbit_depth=" << m_profile.bit_depth
+                << "\ndeinterlace=" << m_profile.deinterlace << "\ntop_field_first=" << m_profile.top_field_first << "\n";
+            if (!send_chunk_msg(sock, ChunkMsgJob, job.str()) ||
+                !recv_chunk_msg(sock, &type, &payload, kChunkMaxResultMsg, &m_stop, 3600) || type != ChunkMsgResult) {
+                Requeue(idx, "lost connection to " + worker);
+                break;
+            }
+            size_t nl = payload.find('\n');
+            int ridx = -1, status = -1;
+            std::istringstream(payload.substr(0, nl)) >> ridx >> status;
+            // write under a temporary name so an interrupted job never leaves a truncated cache entry
+            std::string path = c.key.empty() ? m_tmpPrefix + std::to_string(idx) + ".nut" : chunk_cache_path(c.key);
+            if (ridx != idx || status != 0 || nl == std::string::npos ||
+                !write_file_bytes(path + ".part", payload.data() + nl + 1, payload.size() - nl - 1) ||
+                !wxRenameFile(path + ".part", path, true)) {
+                wxRemoveFile(path + ".part");
+                Requeue(idx, worker + " reported an error");
+                continue;
+            }
+            std::lock_guard<std::mutex> lock(m_lock);
+            m_files[idx] = path;
+            m_done++;
+        }
+        sock->Destroy();
+        std::lock_guard<std::mutex> lock(m_lock);
+        m_live--;
+    }
+
+    std::string m_input;
+    int m_streamIndex;
+    EncodeProfile m_profile;
+    std::vector<ChunkRange> m_chunks;
+    std::vector<int> m_attempts;
+    std::vector<std::string> m_files;
+    std::string m_tmpPrefix;
+    std::string m_token;
+    std::deque<int> m_pending;
+    std::deque<std::string> m_messages;
+    std::mutex m_lock;
+    std::atomic<bool> m_stop{false};
+    std::atomic<bool> m_failed{false};
+    int m_done = 0;
+    int m_live = 0;
+    int m_reused = 0;
+};
+
+// Entry point of `--chunk-worker host:port` processes; token comes from kChunkTokenEnv.
+static int run_chunk_worker(const std::string& endpoint, const std::string& token) {
+    size_t colon = endpoint.rfind(':');
+    if (colon == std::string::npos || token.empty()) return 2;
+    av_log_set_level(AV_LOG_ERROR);
+    wxSocketBase::Initialize();
+
+    wxIPV4address addr;
+    addr.Hostname(endpoint.substr(0, colon));
+    addr.Service((unsigned short)std::stoi(endpoint.substr(colon + 1)));
+    wxSocketClient sock(wxSOCKET_BLOCK|wxSOCKET_WAITALL);
+    if (!sock.Connect(addr, true)) return 1;
+    send_chunk_msg(&sock, ChunkMsgHello, "host=" + std::string(wxGetHostName().mb_str()) + ":" + std::to_string(wxGetProcessId())
+                                         + "\ntoken=" + token + "\n");
+
+    uint32_t type;
+    std::string payload;
+    while (recv_chunk_msg(&sock, &type, &payload, kChunkMaxControlMsg, nullptr, 24 * 3600) && type == ChunkMsgJob) {
+        std::map<std::string, std::string> job = parse_kv_lines(payload);
+        EncodeProfile prof;
+        prof.preset = job["preset"];
+        prof.video_encoder = job["video_encoder"];
+        prof.tonemap = job["tonemap"];
+        prof.bit_depth = std::stoi(job["bit_depth"]);
+        prof.bit_rate = std::stoll(job["bit_rate"]);
+        prof.dec_threads = std::stoi(job["dec_threads"]);
+        prof.sws_threads = std::stoi(job["sws_threads"]);
+        prof.enc_threads = std::stoi(job["enc_threads"]);
+        prof.draft = job["draft"] == "1";
+        prof.frame_pool = job["frame_pool"] != "0";
+        if (prof.draft) prof.draft_height = std::stoi(job["draft_height"]);
+        prof.cfr = job["cfr"] == "1";
+        prof.deinterlace = job["deinterlace"] == "1" ? 1 : 0; // resolved by the coordinator
+        prof.top_field_first = job["top_field_first"] != "0";
+
+        std::string tmp = std::string(wxFileName::CreateTempFileName("wxffchunk").mb_str());
+        std::string err, bytes;
+        int status = encode_chunk(job["input"], std::stoi(job["stream"]), std::stoll(job["start"]), std::stoll(job["end"]), prof, tmp, &err);
+        if (status == 0 && !read_file_bytes(tmp, &bytes)) status = AVERROR(EIO);
+        wxRemoveFile(tmp);
+        if (!send_chunk_msg(&sock, ChunkMsgResult, job["index"] + " " + std::to_string(status) + "\n" + bytes)) break;
+    }
+    sock.Close();
+    return 0;
+}
+
+// ---- input deduplication ----
+//
+// The same file often arrives under different names. Before converting, the input is
+// fingerprinted (size + sampled blocks, optionally the first keyframe packets) and looked up in
+// dedup.index together with the job's output settings; a hit copies the earlier output instead
+// of converting again.
+
+static const int kFingerprintBlock = 64 * 1024;
+
+// SHA-256 over the file size, 64 KiB blocks from head, middle and tail and, if keyframes > 0, the
+// packets of the first `keyframes` video keyframes. Returns an empty string if the file is unreadable.
+static std::string input_fingerprint(const std::string& path, int keyframes) {
+    std::ifstream f(path, std::ios::binary | std::ios::ate);
+    if (!f) return std::string();
+    int64_t size = (int64_t)f.tellg();
+    ChunkHasher h;
+    h.Update("size=" + std::to_string(size));
+    std::vector<char> buf(kFingerprintBlock);
+    const int64_t offsets[3] = { 0, std::max<int64_t>(0, size / 2 - kFingerprintBlock / 2), std::max<int64_t>(0, size - kFingerprintBlock) };
+    for (int64_t off : offsets) {
+        f.clear();
+        f.seekg(off);
+        f.read(buf.data(), buf.size());
+        h.Update((const uint8_t*)buf.data(), (size_t)f.gcount());
+    }
+
+    if (keyframes > 0) {
+        AVFormatContext* in_ctx = nullptr;
+        if (avformat_open_input(&in_ctx, path.c_str(), NULL, NULL) >= 0) {
+            int vidx = av_find_best_stream(in_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+            AVPacket* pkt = av_packet_alloc();
+            for (int seen = 0; vidx >= 0 && seen < keyframes && av_read_frame(in_ctx, pkt) >= 0; av_packet_unref(pkt)) {
+                if (pkt->stream_index != vidx || !(pkt->flags & AV_PKT_FLAG_KEY)) continue;
+                h.Update(pkt->data, pkt->size);
+                seen++;
+            }
+            av_packet_free(&pkt);
+            avformat_close_input(&in_ctx);
+        }
+    }
+    return h.Final();
+}
+
+// Output-affecting job settings; two jobs with the same input and key produce the same file.
+static std::string job_settings_key(const std::string& out_format, bool reencode, const EncodeProfile& prof) {
+    std::ostringstream os;
+    os << "fmt=" << out_format << "|reencode=" << reencode;
+    if (!prof.stream_rules.empty()) os << "|streams=" << prof.stream_rules;
+    if (reencode) os << "|preset=" << prof.preset << "|bit_rate=" << prof.bit_rate;
+    if (reencode && prof.draft) os << "|draft=" << prof.draft_height;
+    if (reencode && !prof.video_encoder.empty()) os << "|venc=" << prof.video_encoder;
+    if (reencode && prof.cfr) os << "|cfr";
+    if (reencode && prof.deinterlace >= 0) os << "|deint=" << prof.deinterlace;
+    if (reencode && !prof.tonemap.empty()) os << "|tonemap=" << prof.tonemap;
+    if (reencode && prof.bit_depth) os << "|depth=" << prof.bit_depth;
+    if (reencode && prof.thumb_tap) os << "|tap=" << prof.thumb_tap_interval << "," << prof.thumb_width; // side outputs a hit would skip
+    os << "|mux=" << prof.mkv_cues_kb << "," << prof.ts_muxrate << "," << prof.ts_pcr_period_ms << "," << prof.frag_duration_ms;
+    if (!prof.audio_codec.empty())
+        os << "|audio=" << prof.audio_codec << "," << prof.audio_bit_rate << "," << prof.audio_sample_rate << "," << prof.audio_channels;
+    else if (!prof.fallback_audio_codec.empty()) os << "|audio_fallback=" << prof.fallback_audio_codec << "," << prof.audio_bit_rate << "," << prof.audio_sample_rate << "," << prof.audio_channels;
+    if (!prof.audio_codec.empty() && prof.loudnorm) os << "|loudnorm=" << prof.loudness_target << "," << prof.true_peak_limit;
+    return os.str();
+}
+
+// "<size>:<mtime>" of a file, empty if it does not exist. Outputs are named after their input,
+// so a later job (or the user) may have replaced a recorded output with something else.
+static std::string output_stamp(const std::string& path) {
+    if (!wxFileName::FileExists(path)) return std::string();
+    wxFileName fn(path);
+    return std::to_string((long long)fn.GetSize().GetValue()) + ":" + std::to_string((long long)fn.GetModificationTime().GetTicks());
+}
+
+// dedup.index: one "<key> <output stamp> <output path>" line per finished job; later lines win.
+class DedupIndex {
+public:
+    // The recorded output of `key`, if it still is the file that job wrote.
+    static bool Lookup(const std::string& key, std::string* output) {
+        std::lock_guard<std::mutex> lock(s_lock);
+        std::ifstream f(user_cache_file("dedup.index"));
+        std::string line, stamp;
+        bool found = false;
+        while (std::getline(f, line)) {
+            size_t sp = line.find(' '), sp2 = sp == std::string::npos ? sp : line.find(' ', sp + 1);
+            if (sp2 == std::string::npos || line.compare(0, sp, key) != 0) continue;
+            stamp = line.substr(sp + 1, sp2 - sp - 1);
+            *output = line.substr(sp2 + 1);
+            found = true;
+        }
+        return found && output_stamp(*output) == stamp;
+    }
+    static void Record(const std::string& key, const std::string& output) {
+        std::string stamp = output_stamp(output);
+        if (stamp.empty()) return;
+        std::lock_guard<std::mutex> lock(s_lock);
+        std::ofstream f(user_cache_file("dedup.index"), std::ios::app);
+        f << key << ' ' << stamp << ' ' << output << '\n';
+    }
+private:
+    static std::mutex s_lock;
+};
+std::mutex DedupIndex::s_lock;
+
+// Fingerprint the input; if an identical job already finished and its output is unchanged since,
+// copy it to out_filename and return true. *key receives the index key for RecordFinishedJob().
+bool ConverterThread::ReuseFinishedJob(const std::string& out_filename, std::string* key) {
+    key->clear();
+    if (!m_profile.dedup || !m_profile.extra_formats.empty()) return false; // the index records one output per job
+    std::string fp = input_fingerprint(m_input, m_profile.fingerprint_keyframes);
+    if (fp.empty()) return false;
+    ChunkHasher h;
+    h.Update(fp + "|" + job_settings_key(m_outFormat, m_reencode, m_profile));
+    *key = h.Final();
+
+    std::string previous;
+    if (!DedupIndex::Lookup(*key, &previous)) return false;
+    if (previous != out_filename && !wxCopyFile(previous, out_filename, true)) return false;
+    Log("Identical input already converted with these settings (" + previous + ")");
+    PostProgress(100);
+    return true;
+}
+
+void ConverterThread::RecordFinishedJob(const std::string& key, const std::string& out_filename) {
+    if (!key.empty()) DedupIndex::Record(key, out_filename);
+}
+
+// Re-encode through chunk workers: plan chunks, start the coordinator, ask the GUI to spawn local
+// workers, then assemble the output from the returned chunks.
+wxThread::ExitCode ConverterThread::RunDistributed() {
+    Log("Starting distributed chunk encoding...");
+    std::string out_filename = make_output_path(m_input, m_outFormat, m_reencode && m_profile.draft);
+    std::string dedup_key;
+    if (ReuseFinishedJob(out_filename, &dedup_key)) {
+        NotifyFinished();
+        return (wxThread::ExitCode)0;
+    }
+    // the same stream Entry() would encode: the first one the stream rules keep
+    int vidx = -1;
+    AVFieldOrder field_order = AV_FIELD_UNKNOWN;
+    std::string unfit; // other streams are copied by assemble_chunks(), so check them before encoding anything
+    AVFormatContext* probe = nullptr;
+    if (avformat_open_input(&probe, m_input.c_str(), NULL, NULL) >= 0 && avformat_find_stream_info(probe, NULL) >= 0) {
+        apply_stream_selection(probe, m_profile.stream_rules);
+        vidx = main_video_stream(probe);
+        if (vidx >= 0) field_order = probe->streams[vidx]->codecpar->field_order;
+        const AVOutputFormat* ofmt = av_guess_format(container_muxer(m_outFormat).c_str(), NULL, NULL);
+        for (unsigned i = 0; ofmt && unfit.empty() && i < probe->nb_streams; ++i) {
+            const AVStream* st = probe->streams[i];
+            if ((int)i != vidx && st->discard != AVDISCARD_ALL && !container_accepts(ofmt, st->codecpar))
+                unfit = "Stream " + std::to_string(i) + " (" + avcodec_get_name(st->codecpar->codec_id) + ") cannot be stored in "
+                      + m_outFormat + "; distributed jobs copy it, deselect it";
+        }
+    }
+    avformat_close_input(&probe);
+    if (vidx < 0 || !unfit.empty()) {
+        Log(vidx < 0 ? "No video stream found for re-encoding" : unfit);
+        NotifyFinished();
+        return (wxThread::ExitCode)0;
+    }
+    if (m_profile.deinterlace != 0) {
+        // decided once here so every chunk worker deinterlaces (or not) the same way; sampling
+        // only when the stream does not state its field order
+        InterlaceInfo il;
+        if (InterlaceProbe::FromFieldOrder(field_order, &il))
+            Log(field_order_summary(il));
+        else if (detect_interlace(m_input, vidx, m_profile, &il) >= 0) Log(interlace_summary(il));
+        m_profile.deinterlace = (m_profile.deinterlace > 0 || il.interlaced) ? 1 : 0;
+        m_profile.top_field_first = il.top_field_first;
+    }
+    std::vector<ChunkRange> chunks;
+    AVRational tb;
+    if (plan_chunks(m_input, vidx, kChunkTargetSeconds, m_profile.chunk_cache ? &m_profile : nullptr, &chunks, &tb) < 0) {
+        Log("Could not split input into chunks");
+        NotifyFinished();
+        return (wxThread::ExitCode)0;
+    }
+    Log("Planned " + std::to_string(chunks.size()) + " GOP-aligned chunks");
+
+    wxIPV4address addr;
+    if (m_profile.remote_workers) addr.AnyAddress();
+    else addr.LocalHost();
+    addr.Service(kChunkPort);
+    wxSocketServer server(addr, wxSOCKET_BLOCK|wxSOCKET_REUSEADDR);
+    if (!server.IsOk()) {
+        Log("Could not listen on port " + std::to_string(kChunkPort));
+        NotifyFinished();
+        return (wxThread::ExitCode)0;
+    }
+    std::string token = chunk_session_token();
+    ChunkCoordinator coord(m_input, vidx, m_profile, chunks, out_filename + ".chunk", token);
+    int to_encode = (int)chunks.size() - coord.Reused();
+    if (coord.Reused() > 0) Log(std::to_string(coord.Reused()) + " of " + std::to_string(chunks.size()) + " chunks reused from cache");
+    // wxExecute only works on the main thread; the GUI spawns the local workers for us.
+    if (to_encode > 0)
+        Log("SPAWN_CHUNK_WORKERS:" + std::to_string(kChunkPort) + ":" + std::to_string(std::min(m_profile.chunk_workers, to_encode)) + ":" + token);
+    if (to_encode > 0 && m_profile.remote_workers)
+        Log("Remote workers can join with: " + std::string(kChunkTokenEnv) + "=" + token + " converter --chunk-worker "
+            + std::string(wxGetFullHostName().mb_str()) + ":" + std::to_string(kChunkPort));
+    bool ok = coord.Run(&server,
+        [this]() { return IsCancelled(); },
+        [this](int done, int total) { PostProgress(done * 95 / total); },
+        [this](const std::string& s) { Log(s); });
+
+    if (ok) {
+        std::string err;
+        if (assemble_chunks(m_input, vidx, coord.Files(), out_filename, m_outFormat, m_profile, &err) < 0) Log("Assembling chunks failed: " + err);
+        else { PostProgress(100); RecordFinishedJob(dedup_key, out_filename); Log(std::string("Conversion finished. Output: ") + out_filename); }
+    }
+    for (size_t i = 0; i < coord.Files().size(); ++i)
+        if (!coord.Files()[i].empty() && !coord.IsCacheFile((int)i)) wxRemoveFile(coord.Files()[i]);
+    if (m_profile.chunk_cache) prune_chunk_cache(kChunkCacheMaxBytes);
+    NotifyFinished();
+    return (wxThread::ExitCode)0;
+}
+
+// ---- stream copy ----
+//
+// Copied streams sometimes need their bitstream rewritten for the target container: length-
+// prefixed H.264/HEVC (mp4/mkv extradata) must become Annex B for TS/AVI, and ADTS AAC (TS, raw
+// .aac) needs its headers stripped into an AudioSpecificConfig for mp4/mov/mkv. CopyFilters picks
+// the filter per stream from the codec and both containers and runs packets through it.
+
+// Bitstream filter needed to copy a stream with parameters `par` from `ifmt` into `ofmt`; "" if none.
+static std::string copy_bsf_for(const AVCodecParameters* par, const AVInputFormat* ifmt, const AVOutputFormat* ofmt) {
+    std::string out = ofmt->name, in = ifmt ? ifmt->name : "";
+    bool annexb_target = out == "mpegts" || out == "avi" || out == "h264" || out == "hevc";
+    bool length_prefixed = par->extradata_size > 0 && par->extradata[0] == 1; // avcC / hvcC
+    if (annexb_target && length_prefixed) {
+        if (par->codec_id == AV_CODEC_ID_H264) return "h264_mp4toannexb";
+        if (par->codec_id == AV_CODEC_ID_HEVC) return "hevc_mp4toannexb";
+    }
+    bool adts_source = in.find("mpegts") != std::string::npos || in == "aac" || par->extradata_size == 0;
+    if (par->codec_id == AV_CODEC_ID_AAC && (ofmt->flags & AVFMT_GLOBALHEADER) && adts_source)
+        return "aac_adtstoasc"; // passes non-ADTS packets through unchanged
+    return std::string();
+}
+
+// Timestamp conversion from one time base to another, reduced once per stream: equal time bases
+// pass packets through untouched and integer ratios (e.g. 1/1000 -> 1/90000) become a multiply;
+// only the remaining streams pay for av_rescale_rnd() per timestamp.
+class TsRescale {
+public:
+    void Init(AVRational from, AVRational to) {
+        int64_t num = (int64_t)from.num * to.den, den = (int64_t)from.den * to.num;
+        int64_t g = std::gcd(num, den);
+        m_mul = num / g;
+        m_div = den / g;
+    }
+
+    bool Identity() const { return m_mul == m_div; }
+
+    int64_t operator()(int64_t ts) const {
+        if (ts == AV_NOPTS_VALUE || Identity()) return ts;
+        if (m_div == 1 && ts <= INT64_MAX / m_mul && ts >= -(INT64_MAX / m_mul)) return ts * m_mul;
+        return av_rescale_rnd(ts, m_mul, m_div, (AVRounding)(AV_ROUND_NEAR_INF|AV_ROUND_PASS_MINMAX));
+    }
+
+    void Apply(AVPacket* pkt) const {
+        if (Identity()) return;
+        pkt->pts = (*this)(pkt->pts);
+        pkt->dts = (*this)(pkt->dts);
+        pkt->duration = (*this)(pkt->duration);
+    }
+
+private:
+    int64_t m_mul = 1, m_div = 1;
+};
+
+class CopyFilters {
+public:
+    typedef std::function<int(AVPacket*)> Writer;
+
+    explicit CopyFilters(unsigned nb_streams) : m_bsf(nb_streams, nullptr), m_pkt(av_packet_alloc()) {}
+    ~CopyFilters() {
+        for (AVBSFContext*& b : m_bsf) av_bsf_free(&b);
+        av_packet_free(&m_pkt);
+    }
+
+    // Fill out_par for copying in_stream, through a bitstream filter if the containers need one
+    // (its name is returned in *applied).
+    int Init(const AVStream* in_stream, const AVFormatContext* in_ctx, const AVFormatContext* out_ctx,
+             AVCodecParameters* out_par, std::string* applied) {
+        std::string spec = copy_bsf_for(in_stream->codecpar, in_ctx->iformat, out_ctx->oformat);
+        AVBSFContext* bsf = nullptr;
+        if (spec.empty() || av_bsf_list_parse_str(spec.c_str(), &bsf) < 0) {
+            applied->clear();
+            return avcodec_parameters_copy(out_par, in_stream->codecpar);
+        }
+        int ret = avcodec_parameters_copy(bsf->par_in, in_stream->codecpar);
+        bsf->time_base_in = in_stream->time_base;
+        if (ret >= 0) ret = av_bsf_init(bsf);
+        if (ret >= 0) ret = avcodec_parameters_copy(out_par, bsf->par_out);
+        if (ret < 0) { av_bsf_free(&bsf); return ret; }
+        m_bsf[in_stream->index] = bsf;
+        *applied = spec;
+        return 0;
+    }
+
+    // Pass one packet (stream_index = input stream) through its stream's filter, handing every
+    // resulting packet to `write`. The packet's reference is consumed.
+    int Filter(AVPacket* pkt, const Writer& write) {
+        int idx = pkt->stream_index;
+        AVBSFContext* bsf = m_bsf[idx];
+        if (!bsf) {
+            int ret = write(pkt);
+            av_packet_unref(pkt);
+            return ret;
+        }
+        int ret = av_bsf_send_packet(bsf, pkt);
+        if (ret < 0) { av_packet_unref(pkt); return ret; }
+        return Drain(idx, write);
+    }
+
+    bool Active(int in_index) const { return m_bsf[in_index] != nullptr; }
+
+    // End of input: flush packets still held by the filters.
+    int Flush(const Writer& write) {
+        for (size_t i = 0; i < m_bsf.size(); ++i) {
+            if (!m_bsf[i]) continue;
+            av_bsf_send_packet(m_bsf[i], NULL);
+            int ret = Drain((int)i, write);
+            if (ret < 0) return ret;
+        }
+        return 0;
+    }
+
+private:
+    int Drain(int idx, const Writer& write) {
+        int ret;
+        while ((ret = av_bsf_receive_packet(m_bsf[idx], m_pkt)) >= 0) {
+            m_pkt->stream_index = idx;
+            ret = write(m_pkt);
+            av_packet_unref(m_pkt);
+            if (ret < 0) return ret;
+        }
+        return (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) ? 0 : ret;
+    }
+
+    std::vector<AVBSFContext*> m_bsf;   // by input stream index; NULL = plain copy
+    AVPacket* m_pkt;
+};
+
+// ---- audio transcode ----
+//
+// Audio is normally copied. With a profile audio codec set, every audio stream is decoded,
+// resampled to the profile's rate/layout with swresample, re-framed to the encoder's frame size
+// through an AVAudioFifo and encoded, each track on its own thread. The job's demux loop only
+// queues packets; encoded packets of all tracks go through the job's mux callback, which
+// serializes with the video path (av_interleaved_write_frame then interleaves the streams by dts).
+// Every transcoded track is also loudness-metered (EBU R128); the result is cached per input so a
+// normalizing job can apply the gain in the same transcode.
+
+// Sample access for any FFmpeg sample format (packed or planar), as a float in [-1, 1].
+static double read_sample(const AVFrame* f, int ch, int i) {
+    AVSampleFormat fmt = (AVSampleFormat)f->format;
+    bool planar = av_sample_fmt_is_planar(fmt);
+    const uint8_t* p = planar ? f->extended_data[ch] : f->extended_data[0];
+    int idx = planar ? i : i * f->ch_layout.nb_channels + ch;
+    switch (av_get_packed_sample_fmt(fmt)) {
+    case AV_SAMPLE_FMT_U8:  return (p[idx] - 128) / 128.0;
+    case AV_SAMPLE_FMT_S16: return ((const int16_t*)p)[idx] / 32768.0;
+    case AV_SAMPLE_FMT_S32: return ((const int32_t*)p)[idx] / 2147483648.0;
+    case AV_SAMPLE_FMT_FLT: return ((const float*)p)[idx];
+    case AV_SAMPLE_FMT_DBL: return ((const double*)p)[idx];
+    default: return 0;
+    }
+}
+
+// Multiply every sample by `gain`, clipping integer formats.
+static void apply_gain(AVFrame* f, double gain) {
+    AVSampleFormat fmt = (AVSampleFormat)f->format;
+    bool planar = av_sample_fmt_is_planar(fmt);
+    int planes = planar ? f->ch_layout.nb_channels : 1;
+    int n = planar ? f->nb_samples : f->nb_samples * f->ch_layout.nb_channels;
+    for (int c = 0; c < planes; ++c) {
+        uint8_t* p = f->extended_data[c];
+        for (int i = 0; i < n; ++i) {
+            switch (av_get_packed_sample_fmt(fmt)) {
+            case AV_SAMPLE_FMT_U8:  p[i] = (uint8_t)std::max(0.0, std::min(255.0, 128 + (p[i] - 128) * gain)); break;
+            case AV_SAMPLE_FMT_S16: ((int16_t*)p)[i] = (int16_t)std::max(-32768.0, std::min(32767.0, ((int16_t*)p)[i] * gain)); break;
+            case AV_SAMPLE_FMT_S32: ((int32_t*)p)[i] = (int32_t)std::max(-2147483648.0, std::min(2147483647.0, ((int32_t*)p)[i] * gain)); break;
+            case AV_SAMPLE_FMT_FLT: ((float*)p)[i] = (float)(((float*)p)[i] * gain); break;
+            case AV_SAMPLE_FMT_DBL: ((double*)p)[i] *= gain; break;
+            default: return;
+            }
+        }
+    }
+}
+
+// EBU R128 / ITU-R BS.1770-4 integrated loudness: K-weighting (high shelf + high pass biquads,
+// coefficients derived for any sample rate), 400 ms blocks every 100 ms, absolute gate at
+// -70 LUFS and relative gate 10 LU below the ungated mean. Block energies are kept, so memory
+// grows by one double per 100 ms of audio. The true peak is the sample peak of a 4x oversampled
+// signal (BS.1770-4 Annex 2; here a 12-tap per phase Hann windowed sinc).
+class LoudnessMeter {
+public:
+    enum { kOversample = 4, kTaps = 12 };
+
+    LoudnessMeter(int rate, const AVChannelLayout& layout)
+        : m_channels(layout.nb_channels), m_subBlock(std::max(1, rate / 10)), m_state(m_channels), m_sum(m_channels, 0.0) {
+        const double pi = 3.14159265358979323846;
+        // stage 1: high shelf (+4 dB above ~1.7 kHz)
+        double K = std::tan(pi * 1681.974450955533 / rate), Q = 0.7071752369554196;
+        double Vh = std::pow(10.0, 3.999843853973347 / 20.0), Vb = std::pow(Vh, 0.4996667741545416);
+        double a0 = 1.0 + K / Q + K * K;
+        m_shelf = { (Vh + Vb * K / Q + K * K) / a0, 2.0 * (K * K - Vh) / a0, (Vh - Vb * K / Q + K * K) / a0,
+                    2.0 * (K * K - 1.0) / a0, (1.0 - K / Q + K * K) / a0 };
+        // stage 2: high pass (~38 Hz)
+        K = std::tan(pi * 38.13547087602444 / rate); Q = 0.5003270373238773;
+        a0 = 1.0 + K / Q + K * K;
+        m_highpass = { 1.0, -2.0, 1.0, 2.0 * (K * K - 1.0) / a0, (1.0 - K / Q + K * K) / a0 };
+        for (int c = 0; c < m_channels; ++c) {
+            AVChannel ch = av_channel_layout_channel_from_index(&layout, c);
+            double w = 1.0;
+            if (ch == AV_CHAN_LOW_FREQUENCY || ch == AV_CHAN_LOW_FREQUENCY_2) w = 0.0;
+            else if (ch == AV_CHAN_SIDE_LEFT || ch == AV_CHAN_SIDE_RIGHT || ch == AV_CHAN_BACK_LEFT || ch == AV_CHAN_BACK_RIGHT) w = 1.41;
+            m_weights.push_back(w);
+        }
+        // phase p interpolates at p/4 of a sample past the middle of the kTaps most recent samples
+        for (int p = 0; p < kOversample; ++p) {
+            for (int j = 0; j < kTaps; ++j) {
+                double x = j - (kTaps / 2 - 1) - (double)p / kOversample;
+                double sinc = x == 0 ? 1.0 : std::sin(pi * x) / (pi * x);
+                m_interp[p][j] = sinc * 0.5 * (1.0 + std::cos(pi * x / (kTaps / 2)));
+            }
+        }
+    }
+
+    void Add(const AVFrame* f) {
+        for (int i = 0; i < f->nb_samples; ++i) {
+            for (int c = 0; c < m_channels; ++c) {
+                double x = read_sample(f, c, i);
+                double y = Filter(m_highpass, m_state[c].s2, Filter(m_shelf, m_state[c].s1, x));
+                m_sum[c] += y * y;
+                TrackPeak(&m_state[c], x);
+            }
+            if (++m_count == m_subBlock) CloseSubBlock();
+        }
+    }
+
+    // True peak in dBTP (-inf for digital silence)
+    double TruePeak() const { return 20.0 * std::log10(m_peak); }
+
+    // Integrated loudness in LUFS; -70 or below means (near) silence.
+    double Integrated() const {
+        const double abs_gate = std::pow(10.0, (-70.0 + 0.691) / 10.0);
+        double sum = 0; size_t n = 0;
+        for (double z : m_blocks) if (z > abs_gate) { sum += z; n++; }
+        if (n == 0) return -70.0;
+        double rel_gate = sum / n * std::pow(10.0, -10.0 / 10.0);
+        sum = 0; n = 0;
+        for (double z : m_blocks) if (z > abs_gate && z > rel_gate) { sum += z; n++; }
+        return n ? -0.691 + 10.0 * std::log10(sum / n) : -70.0;
+    }
+
+private:
+    struct Biquad { double b0, b1, b2, a1, a2; };
+    struct State {
+        double s1[2] = {0, 0}, s2[2] = {0, 0};
+        double hist[kTaps] = {};  // most recent input samples, hist[pos] the oldest
+        int pos = 0;
+    };
+
+    void TrackPeak(State* st, double x) {
+        st->hist[st->pos] = x;
+        st->pos = (st->pos + 1) % kTaps;
+        m_peak = std::max(m_peak, std::fabs(x));
+        for (int p = 1; p < kOversample; ++p) {
+            double y = 0;
+            for (int j = 0; j < kTaps; ++j) y += m_interp[p][j] * st->hist[(st->pos + j) % kTaps];
+            m_peak = std::max(m_peak, std::fabs(y));
+        }
+    }
+
+    // Direct form II transposed
+    static double Filter(const Biquad& q, double* s, double x) {
+        double y = q.b0 * x + s[0];
+        s[0] = q.b1 * x - q.a1 * y + s[1];
+        s[1] = q.b2 * x - q.a2 * y;
+        return y;
+    }
+
+    void CloseSubBlock() {
+        double z = 0;
+        for (int c = 0; c < m_channels; ++c) { z += m_weights[c] * m_sum[c] / m_count; m_sum[c] = 0; }
+        m_count = 0;
+        m_recent.push_back(z);
+        if (m_recent.size() > 4) m_recent.pop_front();
+        if (m_recent.size() == 4) m_blocks.push_back((m_recent[0] + m_recent[1] + m_recent[2] + m_recent[3]) / 4);
+    }
+
+    int m_channels;
+    int m_subBlock;             // samples per 100 ms
+    Biquad m_shelf, m_highpass;
+    std::vector<State> m_state;
+    std::vector<double> m_weights;
+    std::vector<double> m_sum;  // K-weighted energy of the current sub-block per channel
+    int m_count = 0;
+    std::deque<double> m_recent;
+    std::vector<double> m_blocks;
+    double m_interp[kOversample][kTaps];
+    double m_peak = 0;          // linear, all channels
+};
+
+// loudness.cache: "<input fingerprint>|<track>|<channels> <LUFS> <dBTP>" per measured audio
+// track. Filled by every job that transcodes audio; read by loudness normalization to skip the
+// analysis. Each store rewrites the file with one line per key, most recent last, and keeps the
+// kMaxEntries most recent.
+class LoudnessCache {
+public:
+    enum { kMaxEntries = 4096 };
+
+    static std::string Key(const std::string& fingerprint, int track, int channels) {
+        return fingerprint + "|" + std::to_string(track) + "|" + std::to_string(channels);
+    }
+
+    static bool Lookup(const std::string& key, double* lufs, double* peak) {
+        std::lock_guard<std::mutex> lock(s_lock);
+        std::ifstream f(user_cache_file("loudness.cache"));
+        std::string line, k;
+        bool found = false;
+        while (std::getline(f, line)) {
+            std::istringstream is(line);
+            double v, tp;
+            if (is >> k >> v >> tp && k == key) { *lufs = v; *peak = tp; found = true; } // entries without a peak are remeasured
+        }
+        return found;
+    }
+
+    static void Store(const std::string& key, double lufs, double peak) {
+        std::lock_guard<std::mutex> lock(s_lock);
+        std::string path = user_cache_file("loudness.cache");
+        std::vector<std::string> lines;
+        std::map<std::string, size_t> latest; // key -> index in lines
+        std::ifstream in(path);
+        std::string line;
+        while (std::getline(in, line)) {
+            std::string k = line.substr(0, line.find(' '));
+            if (k.empty() || k == key) continue;
+            auto it = latest.find(k);
+            if (it != latest.end()) lines[it->second].clear();
+            latest[k] = lines.size();
+            lines.push_back(line);
+        }
+        in.close();
+        std::ostringstream entry;
+        entry << key << ' ' << lufs << ' ' << (std::isfinite(peak) ? peak : -200.0);
+        lines.push_back(entry.str());
+        lines.erase(std::remove(lines.begin(), lines.end(), std::string()), lines.end());
+        size_t first = lines.size() > kMaxEntries ? lines.size() - kMaxEntries : 0;
+        {
+            std::ofstream out(path + ".tmp", std::ios::trunc);
+            for (size_t i = first; i < lines.size(); ++i) out << lines[i] << '\n';
+            if (!out) return;
+        }
+        wxRenameFile(path + ".tmp", path, true);
+    }
+
+private:
+    static std::mutex s_lock;
+};
+std::mutex LoudnessCache::s_lock;
+
+typedef std::function<int(AVPacket*)> MuxWriter;
+
+// One stream's pipeline on its own thread. The demux loop queues packets with Push(); Process()
+// runs on the worker thread for every packet and once with NULL at end of stream, and hands
+// output packets to the job's MuxWriter.
+class PacketWorker {
+public:
+    enum { kQueueDepth = 64 };
+
+    virtual ~PacketWorker() {
+        Stop();
+        for (AVPacket* p : m_queue) av_packet_free(&p);
+    }
+
+    void Start(MuxWriter mux) {
+        m_mux = mux;
+        m_thread = std::thread(&PacketWorker::Run, this);
+    }
+
+    // Queue a demuxed packet, taking over its reference. Blocks while the queue is full;
+    // returns the worker's error once it has failed.
+    int Push(AVPacket* pkt) {
+        AVPacket* copy = av_packet_alloc();
+        if (!copy) return AVERROR(ENOMEM);
+        av_packet_move_ref(copy, pkt);
+        std::unique_lock<std::mutex> lk(m_lock);
+        m_cv.wait(lk, [&] { return m_error < 0 || m_queue.size() < kQueueDepth; });
+        if (m_error < 0) { av_packet_free(&copy); return m_error; }
+        m_queue.push_back(copy);
+        m_cv.notify_all();
+        return 0;
+    }
+
+    // Drain the queue, flush the pipeline and stop the thread.
+    int Finish() {
+        {
+            std::lock_guard<std::mutex> lk(m_lock);
+            m_eof = true;
+        }
+        m_cv.notify_all();
+        if (m_thread.joinable()) m_thread.join();
+        return m_error;
+    }
+
+    // Seconds the worker spent processing (includes waits for the mux lock)
+    double BusySeconds() const { return m_busy; }
+
+protected:
+    virtual int Process(const AVPacket* pkt) = 0;
+
+    // Stop the thread without flushing. Derived destructors call this first so Process() never
+    // runs on a partly destroyed object.
+    void Stop() {
+        {
+            std::lock_guard<std::mutex> lk(m_lock);
+            m_eof = m_abort = true;
+        }
+        m_cv.notify_all();
+        if (m_thread.joinable()) m_thread.join();
+    }
+
+    MuxWriter m_mux;
+
+private:
+    void Run() {
+        int ret = 0;
+        while (ret >= 0) {
+            AVPacket* pkt = nullptr;
+            {
+                std::unique_lock<std::mutex> lk(m_lock);
+                m_cv.wait(lk, [&] { return m_eof || !m_queue.empty(); });
+                if (m_abort) return;
+                if (m_queue.empty()) break;
+                pkt = m_queue.front();
+                m_queue.pop_front();
+            }
+            m_cv.notify_all();
+            auto t0 = std::chrono::steady_clock::now();
+            ret = Process(pkt);
+            m_busy += seconds_since(t0);
+            av_packet_free(&pkt);
+        }
+        auto t0 = std::chrono::steady_clock::now();
+        if (ret >= 0) ret = Process(nullptr);
+        m_busy += seconds_since(t0);
+        std::lock_guard<std::mutex> lk(m_lock);
+        m_error = ret < 0 ? ret : 0;
+        m_cv.notify_all();
+    }
+
+    std::mutex m_lock;
+    std::condition_variable m_cv;
+    std::deque<AVPacket*> m_queue;
+    bool m_eof = false;
+    bool m_abort = false;
+    int m_error = 1;     // 1 while running, then the thread's result
+    double m_busy = 0;
+    std::thread m_thread;
+};
+
+class AudioTranscoder : public PacketWorker {
+public:
+    // kMaxGapFillSeconds: longer timestamp gaps are skipped over instead of filled with silence
+    enum { kDefaultFrameSize = 1024, kMaxGapFillSeconds = 10 };
+
+    ~AudioTranscoder() {
+        Stop();
+        av_audio_fifo_free(m_fifo);
+        swr_free(&m_swr);
+        av_frame_free(&m_frame);
+        av_frame_free(&m_resampled);
+        av_frame_free(&m_encFrame);
+        av_packet_free(&m_pkt);
+        avcodec_free_context(&m_dec);
+        avcodec_free_context(&m_enc);
+    }
+
+    // Open decoder and encoder for in_stream and describe out_stream; call before the header is written.
+    // Without out_stream the track is only decoded, resampled and metered (loudness analysis).
+    int Open(AVStream* in_stream, AVStream* out_stream, const AVFormatContext* out_ctx, const EncodeProfile& prof, std::string* err) {
+        m_in = in_stream;
+        m_out = out_stream;
+        const AVCodec* dec = avcodec_find_decoder(in_stream->codecpar->codec_id);
+        if (!dec) { *err = "audio decoder not found"; return AVERROR_DECODER_NOT_FOUND; }
+        m_dec = avcodec_alloc_context3(dec);
+        avcodec_parameters_to_context(m_dec, in_stream->codecpar);
+        m_dec->pkt_timebase = in_stream->time_base;
+        int ret = avcodec_open2(m_dec, dec, NULL);
+        if (ret < 0) { *err = "failed to open audio decoder"; return ret; }
+
+        const AVCodec* enc = nullptr;
+        const std::string& enc_name = prof.audio_codec.empty() ? prof.fallback_audio_codec : prof.audio_codec;
+        if (out_stream) {
+            enc = avcodec_find_encoder_by_name(enc_name.c_str());
+            if (!enc) { *err = "audio encoder " + enc_name + " not found"; return AVERROR_ENCODER_NOT_FOUND; }
+        }
+        m_enc = avcodec_alloc_context3(enc); // without a codec it only describes the output format
+        const int* rates = nullptr;
+        const AVSampleFormat* sample_fmts = nullptr;
+        if (enc) {
+#if LIBAVCODEC_VERSION_INT >= AV_VERSION_INT(61, 13, 100) // the AVCodec lists are deprecated from here on
+            const void* cfg = nullptr;
+            if (avcodec_get_supported_config(NULL, enc, AV_CODEC_CONFIG_SAMPLE_RATE, 0, &cfg, NULL) >= 0) rates = (const int*)cfg;
+            cfg = nullptr;
+            if (avcodec_get_supported_config(NULL, enc, AV_CODEC_CONFIG_SAMPLE_FORMAT, 0, &cfg, NULL) >= 0) sample_fmts = (const AVSampleFormat*)cfg;
+#else
+            rates = enc->supported_samplerates;
+            sample_fmts = enc->sample_fmts;
+#endif
+        }
+        int rate = prof.audio_sample_rate > 0 ? prof.audio_sample_rate : m_dec->sample_rate;
+        if (rates) { // nearest rate the encoder takes (libopus: 48 kHz family only)
+            int best = rates[0];
+            for (const int* r = rates; *r; ++r)
+                if (std::abs(*r - rate) < std::abs(best - rate)) best = *r;
+            rate = best;
+        }
+        m_enc->sample_rate = rate;
+        m_enc->sample_fmt = sample_fmts ? sample_fmts[0] : AV_SAMPLE_FMT_FLTP;
+        av_channel_layout_default(&m_enc->ch_layout, prof.audio_channels > 0 ? prof.audio_channels : m_dec->ch_layout.nb_channels);
+        m_enc->bit_rate = prof.audio_bit_rate;
+        m_enc->time_base = {1, rate};
+        if (enc) {
+            // extra containers (ContainerMirror) share these packets and may need the global header
+            if ((out_ctx->oformat->flags & AVFMT_GLOBALHEADER) || !prof.extra_formats.empty())
+                m_enc->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+            if ((ret = avcodec_open2(m_enc, enc, NULL)) < 0) { *err = "failed to open audio encoder " + enc_name; return ret; }
+            avcodec_parameters_from_context(out_stream->codecpar, m_enc);
+            out_stream->time_base = m_enc->time_base;
+        }
+
+        m_frameSize = (enc && m_enc->frame_size > 0 && !(enc->capabilities & AV_CODEC_CAP_VARIABLE_FRAME_SIZE))
+                      ? m_enc->frame_size : kDefaultFrameSize;
+        m_meter.reset(new LoudnessMeter(rate, m_enc->ch_layout));
+        m_fifo = av_audio_fifo_alloc(m_enc->sample_fmt, m_enc->ch_layout.nb_channels, m_frameSize);
+        m_frame = av_frame_alloc();
+        m_resampled = av_frame_alloc();
+        m_encFrame = av_frame_alloc();
+        m_pkt = av_packet_alloc();
+        if (!m_fifo || !m_frame || !m_resampled || !m_encFrame || !m_pkt) { *err = "out of memory"; return AVERROR(ENOMEM); }
+        return 0;
+    }
+
+    // Gain (dB) applied after metering, before encoding
+    void SetGain(double db) { m_gain = std::pow(10.0, db / 20.0); }
+    // Integrated loudness (LUFS) and true peak (dBTP) of the track before gain, valid after Finish()
+    double Loudness() const { return m_meter->Integrated(); }
+    double TruePeak() const { return m_meter->TruePeak(); }
+    int Track() const { return m_in->index; }
+    int Channels() const { return m_enc->ch_layout.nb_channels; }
+
+    // Per-track throughput, valid after Finish(): "Audio track 2 (eng, ac3 -> aac): 01:30:00 of audio in 00:00:12 busy (450x)"
+    std::string Summary() const {
+        std::string name = "Audio track " + std::to_string(m_in->index) + " (";
+        AVDictionaryEntry* lang = av_dict_get(m_in->metadata, "language", NULL, 0);
+        if (lang) name += std::string(lang->value) + ", ";
+        name += std::string(m_dec->codec->name) + " -> " + (m_out ? m_enc->codec->name : "analysis") + ")";
+        double media = m_enc->sample_rate > 0 ? (m_nextPts - m_firstPts) / (double)m_enc->sample_rate : 0;
+        char speed[32];
+        double busy = BusySeconds();
+        snprintf(speed, sizeof(speed), "%.0fx", busy > 0 ? media / busy : 0.0);
+        std::string s = name + ": " + format_duration(media) + " of audio in " + format_duration(busy) + " busy (" + speed + ")";
+        if (m_resyncs > 0) s += ", resynced to source timestamps " + std::to_string(m_resyncs) + " times";
+        return s;
+    }
+
+protected:
+    // Decode one packet (NULL = end of stream), resample into the FIFO and encode full frames.
+    int Process(const AVPacket* pkt) override {
+        int ret = avcodec_send_packet(m_dec, pkt);
+        if (ret < 0 && ret != AVERROR_INVALIDDATA && ret != AVERROR_EOF) return ret; // corrupt packets are skipped
+        while ((ret = avcodec_receive_frame(m_dec, m_frame)) >= 0) {
+            if (!m_swr) {
+                // set up from the first frame: some decoders only know their output format then
+                ret = swr_alloc_set_opts2(&m_swr, &m_enc->ch_layout, m_enc->sample_fmt, m_enc->sample_rate,
+                                          &m_frame->ch_layout, (AVSampleFormat)m_frame->format, m_frame->sample_rate, 0, NULL);
+                if (ret < 0 || (ret = swr_init(m_swr)) < 0) { av_frame_unref(m_frame); return ret; }
+                int64_t ts = m_frame->best_effort_timestamp;
+                m_nextPts = m_firstPts = ts != AV_NOPTS_VALUE ? av_rescale_q(ts, m_in->time_base, m_enc->time_base) : 0;
+            } else if ((ret = Resync(m_frame)) != 0) {
+                av_frame_unref(m_frame);
+                if (ret < 0) return ret;
+                continue; // lies in audio that was already encoded
+            }
+            ret = Resample(m_frame);
+            av_frame_unref(m_frame);
+            if (ret < 0) return ret;
+            if ((ret = EncodeFifo(false)) < 0) return ret;
+        }
+        if (ret != AVERROR(EAGAIN) && ret != AVERROR_EOF) return ret;
+        if (pkt) return 0;
+
+        if (m_swr && (ret = Resample(nullptr)) < 0) return ret; // samples buffered in the resampler
+        if ((ret = EncodeFifo(true)) < 0) return ret;
+        return m_out ? Encode(nullptr) : 0;
+    }
+
+    // Output pts follow the sample count, so compare the frame's own timestamp with where its first
+    // sample would land. More than an encoder frame later (a gap in the source): fill with silence,
+    // or for long gaps complete the current frame and jump. More than a frame earlier (overlap):
+    // returns 1 to drop the frame.
+    int Resync(const AVFrame* in) {
+        int64_t ts = in->best_effort_timestamp;
+        if (ts == AV_NOPTS_VALUE) return 0;
+        int64_t expected = m_nextPts + av_audio_fifo_size(m_fifo) + swr_get_delay(m_swr, m_enc->sample_rate);
+        int64_t drift = av_rescale_q(ts, m_in->time_base, m_enc->time_base) - expected;
+        if (drift >= -m_frameSize && drift <= m_frameSize) return 0;
+        m_resyncs++;
+        if (drift < 0) return 1;
+        int64_t fill = drift;
+        if (drift > (int64_t)kMaxGapFillSeconds * m_enc->sample_rate)
+            fill = (m_frameSize - av_audio_fifo_size(m_fifo) % m_frameSize) % m_frameSize;
+        int ret = WriteSilence(fill);
+        if (ret < 0) return ret;
+        m_nextPts += drift - fill; // the FIFO is empty here when fill < drift
+        return 0;
+    }
+
+    int WriteSilence(int64_t n) {
+        while (n > 0) {
+            int chunk = (int)std::min<int64_t>(n, m_frameSize);
+            m_resampled->format = m_enc->sample_fmt;
+            m_resampled->sample_rate = m_enc->sample_rate;
+            m_resampled->nb_samples = chunk;
+            av_channel_layout_copy(&m_resampled->ch_layout, &m_enc->ch_layout);
+            int ret = av_frame_get_buffer(m_resampled, 0);
+            if (ret < 0) return ret;
+            av_samples_set_silence(m_resampled->extended_data, 0, chunk, m_enc->ch_layout.nb_channels, m_enc->sample_fmt);
+            if (av_audio_fifo_write(m_fifo, (void**)m_resampled->extended_data, chunk) < chunk) ret = AVERROR(ENOMEM);
+            av_frame_unref(m_resampled);
+            if (ret < 0 || (ret = EncodeFifo(false)) < 0) return ret;
+            n -= chunk;
+        }
+        return 0;
+    }
+
+    int Resample(const AVFrame* in) {
+        m_resampled->format = m_enc->sample_fmt;
+        m_resampled->sample_rate = m_enc->sample_rate;
+        av_channel_layout_copy(&m_resampled->ch_layout, &m_enc->ch_layout);
+        int ret = swr_convert_frame(m_swr, m_resampled, in);
+        if (ret >= 0 && m_resampled->nb_samples > 0 &&
+            av_audio_fifo_write(m_fifo, (void**)m_resampled->extended_data, m_resampled->nb_samples) < m_resampled->nb_samples)
+            ret = AVERROR(ENOMEM);
+        av_frame_unref(m_resampled);
+        return ret;
+    }
+
+    // Encode whole encoder frames from the FIFO; on flush also the final partial one.
+    int EncodeFifo(bool flush) {
+        int ret = 0;
+        while (ret >= 0 && (av_audio_fifo_size(m_fifo) >= m_frameSize || (flush && av_audio_fifo_size(m_fifo) > 0))) {
+            int n = std::min(av_audio_fifo_size(m_fifo), m_frameSize);
+            m_encFrame->nb_samples = n;
+            m_encFrame->format = m_enc->sample_fmt;
+            m_encFrame->sample_rate = m_enc->sample_rate;
+            av_channel_layout_copy(&m_encFrame->ch_layout, &m_enc->ch_layout);
+            if ((ret = av_frame_get_buffer(m_encFrame, 0)) < 0) break;
+            av_audio_fifo_read(m_fifo, (void**)m_encFrame->extended_data, n);
+            m_encFrame->pts = m_nextPts;
+            m_nextPts += n;
+            m_meter->Add(m_encFrame);
+            if (m_gain != 1.0) apply_gain(m_encFrame, m_gain);
+            if (m_out) ret = Encode(m_encFrame);
+            av_frame_unref(m_encFrame);
+        }
+        return ret;
+    }
+
+    int Encode(const AVFrame* frame) {
+        int ret = avcodec_send_frame(m_enc, frame);
+        if (ret < 0) return ret;
+        while ((ret = avcodec_receive_packet(m_enc, m_pkt)) >= 0) {
+            av_packet_rescale_ts(m_pkt, m_enc->time_base, m_out->time_base);
+            m_pkt->stream_index = m_out->index;
+            ret = m_mux(m_pkt);
+            av_packet_unref(m_pkt);
+            if (ret < 0) return ret;
+        }
+        return (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) ? 0 : ret;
+    }
+
+    AVStream* m_in = nullptr;
+    AVStream* m_out = nullptr;
+    AVCodecContext* m_dec = nullptr;
+    AVCodecContext* m_enc = nullptr;
+    struct SwrContext* m_swr = nullptr;
+    AVAudioFifo* m_fifo = nullptr;
+    AVFrame* m_frame = nullptr;
+    AVFrame* m_resampled = nullptr;
+    AVFrame* m_encFrame = nullptr;
+    AVPacket* m_pkt = nullptr;
+    int m_frameSize = kDefaultFrameSize;
+    int64_t m_nextPts = 0;
+    int64_t m_firstPts = 0;
+    int m_resyncs = 0;
+    std::unique_ptr<LoudnessMeter> m_meter;
+    double m_gain = 1.0;
+};
+
+// Additional video stream re-encoded on its own worker: decoder, scaler and H.264 encoder set up
+// like the job's main video stream.
+class VideoTranscoder : public PacketWorker {
+public:
+    ~VideoTranscoder() {
+        Stop();
+        av_frame_free(&m_frame);
+        av_packet_free(&m_pkt);
+        avcodec_free_context(&m_dec);
+        avcodec_free_context(&m_enc);
+    }
+
+    // Open decoder, scaler and encoder for in_stream and describe out_stream; call before the header is written.
+    int Open(AVStream* in_stream, AVStream* out_stream, AVRational framerate, const EncodeProfile& prof, std::string* err) {
+        m_in = in_stream;
+        m_out = out_stream;
+        const AVCodec* dec = avcodec_find_decoder(in_stream->codecpar->codec_id);
+        if (!dec) { *err = "video decoder not found"; return AVERROR_DECODER_NOT_FOUND; }
+        m_dec = avcodec_alloc_context3(dec);
+        avcodec_parameters_to_context(m_dec, in_stream->codecpar);
+        m_dec->pkt_timebase = in_stream->time_base;
+        apply_decoder_profile(m_dec, dec, prof);
+        if (prof.frame_pool) m_pool.Attach(m_dec);
+        int ret = avcodec_open2(m_dec, dec, NULL);
+        if (ret < 0) { *err = "failed to open video decoder"; return ret; }
+        if ((ret = open_video_encoder(m_dec, framerate, prof, &m_enc, in_stream->time_base)) < 0) { *err = "failed to open video encoder"; return ret; }
+        m_ts.Init(in_stream->time_base, m_enc->time_base, framerate, prof.cfr);
+        if ((ret = m_tone.Init(m_dec, prof, prof.sws_threads)) < 0) { *err = "failed to set up tone mapping"; return ret; }
+        avcodec_parameters_from_context(out_stream->codecpar, m_enc);
+        out_stream->time_base = m_enc->time_base;
+
+        m_frame = av_frame_alloc();
+        m_pkt = av_packet_alloc();
+        if (!m_frame || !m_pkt) { *err = "out of memory"; return AVERROR(ENOMEM); }
+        if ((ret = m_input.Init(m_dec, m_enc, prof)) < 0) { *err = "failed to create scaler"; return ret; }
+        return 0;
+    }
+
+    // "Video track 1 (h264 -> libx264): 1234 frames in 00:00:41 busy (30.1 fps)"
+    std::string Summary() const {
+        char fps[32];
+        double busy = BusySeconds();
+        snprintf(fps, sizeof(fps), "%.1f fps", busy > 0 ? m_frames / busy : 0.0);
+        return "Video track " + std::to_string(m_in->index) + " (" + m_dec->codec->name + " -> " + m_enc->codec->name + "): "
+             + std::to_string(m_frames) + " frames in " + format_duration(busy) + " busy (" + fps + ")"
+             + (m_ts.Report().empty() ? "" : "; timestamps repaired: " + m_ts.Report());
+    }
+
+protected:
+    int Process(const AVPacket* pkt) override {
+        int ret = avcodec_send_packet(m_dec, pkt);
+        if (ret < 0 && ret != AVERROR_INVALIDDATA && ret != AVERROR_EOF) return ret; // corrupt packets are skipped
+        while ((ret = avcodec_receive_frame(m_dec, m_frame)) >= 0) {
+            int64_t pts = m_ts.Next(m_frame->best_effort_timestamp);
+            if (pts == AV_NOPTS_VALUE) { av_frame_unref(m_frame); continue; }
+            AVFrame* pic = m_frame;
+            if (m_tone.Active() && (ret = m_tone.Apply(m_frame, &pic)) < 0) { av_frame_unref(m_frame); return ret; }
+            AVFrame* enc_frame = nullptr;
+            if ((ret = m_input.Convert(pic, &enc_frame)) < 0) { av_frame_unref(m_frame); return ret; }
+            enc_frame->pts = pts;
+            m_frames++;
+            ret = Encode(enc_frame);
+            av_frame_unref(m_frame);
+            if (ret < 0) return ret;
+        }
+        if (ret != AVERROR(EAGAIN) && ret != AVERROR_EOF) return ret;
+        return pkt ? 0 : Encode(nullptr);
+    }
+
+private:
+    int Encode(const AVFrame* frame) {
+        int ret = avcodec_send_frame(m_enc, frame);
+        if (ret < 0) return ret;
+        while ((ret = avcodec_receive_packet(m_enc, m_pkt)) >= 0) {
+            av_packet_rescale_ts(m_pkt, m_enc->time_base, m_out->time_base);
+            m_pkt->stream_index = m_out->index;
+            ret = m_mux(m_pkt);
+            av_packet_unref(m_pkt);
+            if (ret < 0) return ret;
+        }
+        return (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) ? 0 : ret;
+    }
+
+    AVStream* m_in = nullptr;
+    AVStream* m_out = nullptr;
+    AVCodecContext* m_dec = nullptr;
+    AVCodecContext* m_enc = nullptr;
+    AVFrame* m_frame = nullptr;
+    AVPacket* m_pkt = nullptr;
+    int64_t m_frames = 0;
+    FrameTimestamps m_ts;
+    ToneMapper m_tone;
+    EncoderInput m_input;
+    FramePool m_pool; // outlives m_dec, which the destructor body frees
+};
+
+// A job's stream workers of one kind, looked up by input stream index.
+template <class Worker>
+class TrackSet {
+public:
+    explicit TrackSet(unsigned nb_streams) : m_byInput(nb_streams, nullptr) {}
+
+    Worker* For(int in_index) const {
+        return in_index >= 0 && in_index < (int)m_byInput.size() ? m_byInput[in_index] : nullptr;
+    }
+
+    void Start(MuxWriter mux) {
+        for (auto& t : m_tracks) t->Start(mux);
+    }
+
+    // Finish every track; appends one throughput line per track to `report`.
+    int Finish(std::vector<std::string>* report) {
+        int result = 0;
+        for (auto& t : m_tracks) {
+            int ret = t->Finish();
+            if (ret < 0 && result == 0) result = ret;
+            report->push_back(t->Summary());
+        }
+        return result;
+    }
+
+    // Stop all threads without flushing (error paths, before the muxer is freed).
+    void Abort() { m_tracks.clear(); }
+
+    bool Empty() const { return m_tracks.empty(); }
+
+protected:
+    Worker* Create(int in_index) {
+        m_tracks.emplace_back(new Worker());
+        return m_byInput[in_index] = m_tracks.back().get();
+    }
+
+    std::vector<std::unique_ptr<Worker>> m_tracks;
+    std::vector<Worker*> m_byInput;
+};
+
+// All transcoded audio tracks of a job.
+class AudioTracks : public TrackSet<AudioTranscoder> {
+public:
+    explicit AudioTracks(unsigned nb_streams) : TrackSet(nb_streams) {}
+
+    // Every selected audio track with an audio_codec; in copy mode only those the output
+    // container (ofmt) refuses, when the profile names a fallback_audio_codec.
+    static bool Wanted(const AVStream* st, const EncodeProfile& prof, const AVOutputFormat* ofmt) {
+        if (st->codecpar->codec_type != AVMEDIA_TYPE_AUDIO || st->discard == AVDISCARD_ALL) return false;
+        if (!prof.audio_codec.empty()) return true;
+        return !prof.fallback_audio_codec.empty() && ofmt && !container_accepts(ofmt, st->codecpar);
+    }
+
+    int Add(AVStream* in_stream, AVStream* out_stream, const AVFormatContext* out_ctx, const EncodeProfile& prof, std::string* err) {
+        return Create(in_stream->index)->Open(in_stream, out_stream, out_ctx, prof, err);
+    }
+
+    // Set each track's gain from its cached loudness so it lands on `target` LUFS, but never raise
+    // a track so far that its true peak exceeds `peak_limit` dBTP (there is no limiter); loud
+    // tracks are always attenuated in full, silent ones left alone. Returns false if some track
+    // has no cached measurement.
+    bool ApplyCachedLoudness(const std::string& fingerprint, double target, double peak_limit, std::vector<std::string>* report) {
+        bool all = true;
+        for (auto& t : m_tracks) {
+            double lufs, peak;
+            if (!LoudnessCache::Lookup(LoudnessCache::Key(fingerprint, t->Track(), t->Channels()), &lufs, &peak)) { all = false; continue; }
+            if (lufs <= -70.0) continue;
+            double gain = target - lufs;
+            if (gain > 0 && gain > peak_limit - peak) {
+                gain = std::max(0.0, peak_limit - peak);
+                char line[128];
+                snprintf(line, sizeof(line), "Audio track %d: gain limited to %+.1f dB by its true peak (%.1f dBTP)", t->Track(), gain, peak);
+                report->push_back(line);
+            }
+            t->SetGain(gain);
+        }
+        return all;
+    }
+
+    // Cache each track's measured loudness (after Finish) and report it.
+    void StoreLoudness(const std::string& fingerprint, std::vector<std::string>* report) {
+        for (auto& t : m_tracks) {
+            double lufs = t->Loudness(), peak = t->TruePeak();
+            if (!fingerprint.empty()) LoudnessCache::Store(LoudnessCache::Key(fingerprint, t->Track(), t->Channels()), lufs, peak);
+            char line[128];
+            snprintf(line, sizeof(line), "Audio track %d: integrated loudness %.1f LUFS, true peak %.1f dBTP", t->Track(), lufs, peak);
+            report->push_back(line);
+        }
+    }
+};
+
+// Video streams besides the job's main one (multi-angle, stereo views); attached pictures such
+// as cover art stay copied.
+class VideoTracks : public TrackSet<VideoTranscoder> {
+public:
+    explicit VideoTracks(unsigned nb_streams) : TrackSet(nb_streams) {}
+
+    static bool Wanted(const AVStream* st, int main_index) {
+        return st->codecpar->codec_type == AVMEDIA_TYPE_VIDEO && st->index != main_index
+            && !(st->disposition & AV_DISPOSITION_ATTACHED_PIC) && st->discard != AVDISCARD_ALL;
+    }
+
+    int Add(AVStream* in_stream, AVStream* out_stream, AVRational framerate, const EncodeProfile& prof, std::string* err) {
+        return Create(in_stream->index)->Open(in_stream, out_stream, framerate, prof, err);
+    }
+};
+
+// ---- extra output containers ----
+//
+// A remux can write the same streams into several containers from one read of the input. Each
+// extra container is a ContainerMirror: demuxed packets (and transcoded audio) reach it as new
+// references to the same buffers, and its own thread runs that container's bitstream filters,
+// rescales into its time bases and writes the file.
+
+class ContainerMirror : public PacketWorker {
+public:
+    ContainerMirror() : m_pkt(av_packet_alloc()) {}
+    ~ContainerMirror() {
+        Stop();
+        if (m_ctx) {
+            if (m_ioOpen) avio_closep(&m_ctx->pb);
+            avformat_free_context(m_ctx);
+        }
+        av_packet_free(&m_pkt);
+    }
+
+    // Create `path` with the streams of the primary output (`mapping`: input index -> primary
+    // stream). Streams flagged in `encoded` arrive as encoded packets in the primary stream's
+    // time base, the others as demuxed input packets. Call after the primary wrote its header.
+    int Open(const std::string& fmt, const std::string& path, const AVFormatContext* in_ctx,
+             const AVFormatContext* primary, const std::vector<int>& mapping,
+             const std::vector<bool>& encoded, const EncodeProfile& prof, std::string* err) {
+        int ret = avformat_alloc_output_context2(&m_ctx, NULL, container_muxer(fmt).c_str(), path.c_str());
+        if (!m_ctx) { *err = "could not create output context"; return ret < 0 ? ret : AVERROR(EINVAL); }
+        m_filters.reset(new CopyFilters(in_ctx->nb_streams));
+        m_mapping.assign(in_ctx->nb_streams, -1);
+        m_srcTb.assign(in_ctx->nb_streams, AVRational{ 0, 1 });
+        m_rescale.assign(in_ctx->nb_streams, TsRescale());
+        m_encoded = encoded;
+        for (unsigned i = 0; i < in_ctx->nb_streams; ++i) {
+            if (mapping[i] < 0) continue;
+            const AVStream* in_stream = in_ctx->streams[i];
+            const AVStream* src = encoded[i] ? primary->streams[mapping[i]] : in_stream;
+            if (!container_accepts(m_ctx->oformat, src->codecpar)) {
+                *err = "stream " + std::to_string(i) + " (" + avcodec_get_name(src->codecpar->codec_id) + ") cannot be stored in " + fmt;
+                return AVERROR(EINVAL);
+            }
+            AVStream* out_stream = avformat_new_stream(m_ctx, NULL);
+            if (!out_stream) { *err = "failed allocating output stream"; return AVERROR(ENOMEM); }
+            std::string bsf;
+            if (encoded[i]) ret = avcodec_parameters_copy(out_stream->codecpar, src->codecpar);
+            else ret = m_filters->Init(in_stream, in_ctx, m_ctx, out_stream->codecpar, &bsf);
+            if (ret < 0) { *err = "failed to copy codec parameters"; return ret; }
+            out_stream->codecpar->codec_tag = 0;
+            m_srcTb[i] = src->time_base;
+            m_mapping[i] = out_stream->index;
+        }
+        if (!(m_ctx->oformat->flags & AVFMT_NOFILE)) {
+            if ((ret = avio_open(&m_ctx->pb, path.c_str(), AVIO_FLAG_WRITE)) < 0) { *err = "could not open output file"; return ret; }
+            m_ioOpen = true;
+        }
+        if ((ret = write_container_header(m_ctx, fmt, prof)) < 0) { *err = "error writing header"; return ret; }
+        for (unsigned i = 0; i < in_ctx->nb_streams; ++i)
+            if (m_mapping[i] >= 0) m_rescale[i].Init(m_srcTb[i], m_ctx->streams[m_mapping[i]]->time_base);
+        m_write = [this](AVPacket* p) -> int {
+            m_rescale[p->stream_index].Apply(p);
+            p->stream_index = m_mapping[p->stream_index];
+            p->pos = -1;
+            return av_interleaved_write_frame(m_ctx, p);
+        };
+        return 0;
+    }
+
+protected:
+    // pkt->stream_index is the input stream index
+    int Process(const AVPacket* pkt) override {
+        if (!pkt) {
+            int ret = m_filters->Flush(m_write);
+            int trailer = av_write_trailer(m_ctx);
+            return ret < 0 ? ret : trailer;
+        }
+        int ret = av_packet_ref(m_pkt, pkt);
+        if (ret < 0) return ret;
+        if (!m_encoded[pkt->stream_index]) return m_filters->Filter(m_pkt, m_write);
+        ret = m_write(m_pkt);
+        av_packet_unref(m_pkt);
+        return ret;
+    }
+
+private:
+    AVFormatContext* m_ctx = nullptr;
+    bool m_ioOpen = false;
+    std::unique_ptr<CopyFilters> m_filters;
+    std::vector<int> m_mapping;       // input stream -> stream in this container
+    std::vector<AVRational> m_srcTb;  // time base of the packets arriving for each input stream
+    std::vector<TsRescale> m_rescale;
+    std::vector<bool> m_encoded;
+    CopyFilters::Writer m_write;
+    AVPacket* m_pkt;
+};
+
+// Extra containers of a remux job, fed from the demux loop and the audio transcoders.
+class ContainerMirrors {
+public:
+    // Open one mirror per format in the comma-separated `formats` list, skipping ones that would
+    // land on `primary_path`; errors are logged through `log` and skip that container.
+    void Open(const std::string& formats, const std::string& input, const std::string& primary_path,
+              const AVFormatContext* in_ctx, const AVFormatContext* primary, const std::vector<int>& mapping,
+              const std::vector<bool>& encoded, const EncodeProfile& prof,
+              const std::function<void(const std::string&)>& log) {
+        std::vector<std::string> paths{ primary_path };
+        std::istringstream is(formats);
+        std::string item, fmt;
+        while (std::getline(is, item, ',')) {
+            if (!(std::istringstream(item) >> fmt)) continue;
+            std::string path = make_output_path(input, fmt);
+            if (std::find(paths.begin(), paths.end(), path) != paths.end()) continue;
+            paths.push_back(path);
+            std::unique_ptr<ContainerMirror> m(new ContainerMirror());
+            std::string err;
+            if (m->Open(fmt, path, in_ctx, primary, mapping, encoded, prof, &err) < 0) {
+                log("Not writing " + fmt + " output: " + err);
+                continue;
+            }
+            log("Also writing " + path);
+            m->Start(MuxWriter());
+            m_mirrors.push_back(std::move(m));
+            m_paths.push_back(path);
+        }
+    }
+
+    // Hand a new reference to pkt (stream_index = input stream) to every mirror.
+    int Push(const AVPacket* pkt) {
+        for (auto& m : m_mirrors) {
+            AVPacket* ref = av_packet_clone(pkt);
+            if (!ref) return AVERROR(ENOMEM);
+            int ret = m->Push(ref);
+            av_packet_free(&ref);
+            if (ret < 0) return ret;
+        }
+        return 0;
+    }
+
+    int Finish() {
+        int result = 0;
+        for (auto& m : m_mirrors) {
+            int ret = m->Finish();
+            if (ret < 0 && result == 0) result = ret;
+        }
+        return result;
+    }
+
+    void Abort() { m_mirrors.clear(); }
+
+    bool Empty() const { return m_mirrors.empty(); }
+
+    const std::vector<std::string>& Paths() const { return m_paths; }
+
+private:
+    std::vector<std::unique_ptr<ContainerMirror>> m_mirrors;
+    std::vector<std::string> m_paths;
+};
+
+// ---- per-stream packet dispatch ----
+//
+// What happens to a demuxed packet depends only on its stream, so the strategy (copy with or
+// without bitstream filter / rescale / extra containers, queue to a transcoder, custom, discard)
+// is resolved once after the header is written into a table of specialized handlers. The demux
+// loops then make a single indirect call per packet. Handlers consume the packet's reference and
+// return a negative AVERROR on failure.
+
+class PacketDispatch {
+public:
+    explicit PacketDispatch(unsigned nb_streams, MuxWriter mux) : m_slots(nb_streams), m_mux(mux) {}
+    PacketDispatch(const PacketDispatch&) = delete;
+    PacketDispatch& operator=(const PacketDispatch&) = delete;
+
+    // Stream copy into output stream out_index; packets also go to `mirrors` when it has any.
+    void Copy(int in_index, int out_index, AVRational in_tb, AVRational out_tb, CopyFilters* filters,
+              ContainerMirrors* mirrors = nullptr) {
+        Slot& s = m_slots[in_index];
+        s.out_index = out_index;
+        s.rescale.Init(in_tb, out_tb);
+        s.filters = filters;
+        s.mirrors = mirrors;
+        s.mux = &m_mux;
+        bool filtered = filters->Active(in_index), rescaled = !s.rescale.Identity();
+        bool mirrored = mirrors && !mirrors->Empty();
+        static const Handler kCopy[8] = {
+            &CopyPacket<false, false, false>, &CopyPacket<false, false, true>,
+            &CopyPacket<false, true, false>,  &CopyPacket<false, true, true>,
+            &CopyPacket<true, false, false>,  &CopyPacket<true, false, true>,
+            &CopyPacket<true, true, false>,   &CopyPacket<true, true, true>,
+        };
+        s.handler = kCopy[filtered * 4 + rescaled * 2 + mirrored];
+        s.failure = "Error muxing packet";
+    }
+
+    // Queue to a transcoding worker thread.
+    void Queue(int in_index, PacketWorker* worker, const char* failure) {
+        Slot& s = m_slots[in_index];
+        s.worker = worker;
+        s.handler = &QueuePacket;
+        s.failure = failure;
+    }
+
+    // Hand to `fn`, which logs its own errors (the job's main video stream).
+    void Custom(int in_index, const std::function<int(AVPacket*)>* fn) {
+        Slot& s = m_slots[in_index];
+        s.custom = fn;
+        s.handler = &CustomPacket;
+        s.failure = nullptr;
+    }
+
+    int operator()(AVPacket* pkt) const {
+        if ((unsigned)pkt->stream_index >= m_slots.size()) { av_packet_unref(pkt); return 0; } // stream appeared mid-file
+        const Slot& s = m_slots[pkt->stream_index];
+        return s.handler(s, pkt);
+    }
+
+    // End of input: drain the copy filters through their streams' slots.
+    int Flush(CopyFilters* filters) const {
+        return filters->Flush([this](AVPacket* p) { return Emit<true>(m_slots[p->stream_index], p); });
+    }
+
+    // Message for a failed packet of in_index; NULL if the handler already logged it.
+    const char* Failure(int in_index) const {
+        return (unsigned)in_index < m_slots.size() ? m_slots[in_index].failure : nullptr;
+    }
+
+private:
+    struct Slot;
+    typedef int (*Handler)(const Slot&, AVPacket*);
+
+    static int Discard(const Slot&, AVPacket* pkt) {
+        av_packet_unref(pkt);
+        return 0;
+    }
+
+    struct Slot {
+        Handler handler = &Discard;
+        const char* failure = nullptr;
+        int out_index = -1;
+        TsRescale rescale;
+        CopyFilters* filters = nullptr;
+        ContainerMirrors* mirrors = nullptr;
+        const MuxWriter* mux = nullptr;
+        PacketWorker* worker = nullptr;
+        const std::function<int(AVPacket*)>* custom = nullptr;
+    };
+
+    template <bool Rescaled>
+    static int Emit(const Slot& s, AVPacket* pkt) {
+        if (Rescaled) s.rescale.Apply(pkt);
+        pkt->stream_index = s.out_index;
+        pkt->pos = -1;
+        return (*s.mux)(pkt);
+    }
+
+    template <bool Filtered, bool Rescaled, bool Mirrored>
+    static int CopyPacket(const Slot& s, AVPacket* pkt) {
+        if (Mirrored) {
+            int ret = s.mirrors->Push(pkt);
+            if (ret < 0) { av_packet_unref(pkt); return ret; }
+        }
+        if (Filtered) return s.filters->Filter(pkt, [&s](AVPacket* p) { return Emit<Rescaled>(s, p); });
+        int ret = Emit<Rescaled>(s, pkt);
+        av_packet_unref(pkt);
+        return ret;
+    }
+
+    static int QueuePacket(const Slot& s, AVPacket* pkt) { return s.worker->Push(pkt); }
+    static int CustomPacket(const Slot& s, AVPacket* pkt) { return (*s.custom)(pkt); }
+
+    std::vector<Slot> m_slots;
+    MuxWriter m_mux;
+};
+
+// First pass of loudness normalization: decode only the audio streams (everything else is
+// discarded at the demuxer) and meter every track; results land in loudness.cache.
+static int analyze_loudness(const std::string& in, const EncodeProfile& prof, const std::string& fingerprint,
+                            const std::function<bool()>& cancelled, std::vector<std::string>* report) {
+    AVFormatContext* in_ctx = nullptr;
+    int ret = avformat_open_input(&in_ctx, in.c_str(), NULL, NULL);
+    if (ret < 0) return ret;
+    if ((ret = avformat_find_stream_info(in_ctx, NULL)) < 0) { avformat_close_input(&in_ctx); return ret; }
+
+    apply_stream_selection(in_ctx, prof.stream_rules);
+    AudioTracks tracks(in_ctx->nb_streams);
+    std::string err;
+    for (unsigned i = 0; i < in_ctx->nb_streams && ret >= 0; ++i) {
+        AVStream* st = in_ctx->streams[i];
+        if (AudioTracks::Wanted(st, prof, nullptr)) ret = tracks.Add(st, nullptr, nullptr, prof, &err);
+        else st->discard = AVDISCARD_ALL;
+    }
+    if (ret >= 0) {
+        tracks.Start(MuxWriter());
+        AVPacket* pkt = av_packet_alloc();
+        while (av_read_frame(in_ctx, pkt) >= 0) {
+            AudioTranscoder* t = tracks.For(pkt->stream_index);
+            if (t && (ret = t->Push(pkt)) < 0) break;
+            av_packet_unref(pkt);
+            if (cancelled()) { ret = AVERROR_EXIT; break; }
+        }
+        av_packet_free(&pkt);
+        std::vector<std::string> throughput;
+        if (ret >= 0) ret = tracks.Finish(&throughput);
+        if (ret >= 0) tracks.StoreLoudness(fingerprint, report);
+    }
+    tracks.Abort();
+    avformat_close_input(&in_ctx);
+    return ret;
+}
+
+// ---- thumbnails / sprite sheet ----
+//
+// Thumbnail jobs seek to evenly spaced points and decode only keyframes (skip_frame =
+// AVDISCARD_NONKEY, non-key packets are not even sent to the decoder). The points are split over
+// several threads, each with its own demuxer/decoder, and downscaled with swscale. Output: one
+// image per point, a sprite sheet of all of them and a WebVTT index into the sheet. Points that
+// land on the same keyframe as the point before (sparse keyframes) are only kept once.
+
+struct Thumbnail {
+    double time = -1;     // seconds from start; -1 if nothing could be decoded there
+    int64_t pts = AV_NOPTS_VALUE; // of the decoded keyframe, to spot points that share one
+    AVFrame* frame = nullptr;
+};
+
+// Encode a single frame as a JPEG (frame in YUVJ420P) or PNG (frame in RGB24) file.
+static int write_image(const AVFrame* f, bool png, const std::string& path) {
+    const AVCodec* codec = avcodec_find_encoder(png ? AV_CODEC_ID_PNG : AV_CODEC_ID_MJPEG);
+    if (!codec) return AVERROR_ENCODER_NOT_FOUND;
+    AVCodecContext* ctx = avcodec_alloc_context3(codec);
+    ctx->width = f->width;
+    ctx->height = f->height;
+    ctx->pix_fmt = (AVPixelFormat)f->format;
+    ctx->time_base = {1, 25};
+    if (!png) {
+        ctx->flags |= AV_CODEC_FLAG_QSCALE;
+        ctx->global_quality = FF_QP2LAMBDA * 3;
+    }
+    int ret = avcodec_open2(ctx, codec, NULL);
+    AVPacket* pkt = av_packet_alloc();
+    if (ret >= 0 && (ret = avcodec_send_frame(ctx, f)) >= 0) {
+        avcodec_send_frame(ctx, NULL);
+        std::ofstream out(path, std::ios::binary | std::ios::trunc);
+        while (avcodec_receive_packet(ctx, pkt) >= 0) {
+            out.write((const char*)pkt->data, pkt->size);
+            av_packet_unref(pkt);
+        }
+        if (!out) ret = AVERROR(EIO);
+    }
+    av_packet_free(&pkt);
+    avcodec_free_context(&ctx);
+    return ret;
+}
+
+// Worker body: decode the first keyframe of stream vidx at or before each assigned point and scale
+// it to w x h. Gives up between points once *stop is set.
+static void decode_thumbnails(const std::string& in, int vidx, const std::vector<int>& points, int count,
+                              int w, int h, AVPixelFormat dst_fmt, std::vector<Thumbnail>* out,
+                              const std::atomic<bool>* stop) {
+    AVFormatContext* in_ctx = nullptr;
+    if (avformat_open_input(&in_ctx, in.c_str(), NULL, NULL) < 0) return;
+    if (avformat_find_stream_info(in_ctx, NULL) < 0 || vidx >= (int)in_ctx->nb_streams) { avformat_close_input(&in_ctx); return; }
+    for (unsigned i = 0; i < in_ctx->nb_streams; i++) {
+        if ((int)i != vidx) in_ctx->streams[i]->discard = AVDISCARD_ALL;
+    }
+    const AVCodec* dec = avcodec_find_decoder(in_ctx->streams[vidx]->codecpar->codec_id);
+    if (!dec) { avformat_close_input(&in_ctx); return; }
+    AVStream* st = in_ctx->streams[vidx];
+    AVCodecContext* dec_ctx = avcodec_alloc_context3(dec);
+    avcodec_parameters_to_context(dec_ctx, st->codecpar);
+    dec_ctx->skip_frame = AVDISCARD_NONKEY;
+    dec_ctx->thread_count = 1; // parallelism comes from the independent workers
+    if (avcodec_open2(dec_ctx, dec, NULL) < 0) { avcodec_free_context(&dec_ctx); avformat_close_input(&in_ctx); return; }
+
+    AVPacket* pkt = av_packet_alloc();
+    AVFrame* frame = av_frame_alloc();
+    struct SwsContext* sws = nullptr;
+    int64_t start = in_ctx->start_time != AV_NOPTS_VALUE ? in_ctx->start_time : 0;
+    for (int i : points) {
+        if (stop->load()) break;
+        int64_t ts = start + in_ctx->duration * (2 * i + 1) / (2 * count); // middle of each interval
+        if (av_seek_frame(in_ctx, -1, ts, AVSEEK_FLAG_BACKWARD) < 0) continue;
+        avcodec_flush_buffers(dec_ctx);
+        bool got = false, eof = false;
+        while (!got && !eof) {
+            if (av_read_frame(in_ctx, pkt) < 0) { eof = true; avcodec_send_packet(dec_ctx, NULL); }
+            else if (pkt->stream_index != vidx || !(pkt->flags & AV_PKT_FLAG_KEY)) { av_packet_unref(pkt); continue; }
+            else { avcodec_send_packet(dec_ctx, pkt); av_packet_unref(pkt); }
+            if (avcodec_receive_frame(dec_ctx, frame) >= 0) got = true;
+        }
+        if (!got) continue;
+        sws = sws_getCachedContext(sws, frame->width, frame->height, (AVPixelFormat)frame->format,
+                                   w, h, dst_fmt, SWS_BILINEAR, NULL, NULL, NULL);
+        if (sws) set_scaler_colorspace(sws, frame_sws_colorspace(frame), frame_full_range(frame), SWS_CS_ITU601, true); // JFIF is BT.601 full range
+        Thumbnail& t = (*out)[i];
+        t.frame = av_frame_alloc();
+        t.frame->format = dst_fmt; t.frame->width = w; t.frame->height = h;
+        if (!sws || av_frame_get_buffer(t.frame, 32) < 0) { av_frame_free(&t.frame); av_frame_unref(frame); continue; }
+        sws_scale_frame(sws, t.frame, frame);
+        int64_t pts = frame->best_effort_timestamp != AV_NOPTS_VALUE ? frame->best_effort_timestamp : frame->pts;
+        t.pts = pts;
+        t.time = pts != AV_NOPTS_VALUE ? (pts - av_rescale_q(start, {1, AV_TIME_BASE}, st->time_base)) * av_q2d(st->time_base)
+                                       : (ts - start) / (double)AV_TIME_BASE;
+        av_frame_unref(frame);
+    }
+    sws_freeContext(sws);
+    av_frame_free(&frame);
+    av_packet_free(&pkt);
+    avcodec_free_context(&dec_ctx);
+    avformat_close_input(&in_ctx);
+}
+
+static std::string vtt_timestamp(double secs) {
+    if (secs < 0) secs = 0;
+    int64_t ms = (int64_t)(secs * 1000 + 0.5);
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%02d:%02d:%02d.%03d", (int)(ms / 3600000), (int)(ms / 60000 % 60), (int)(ms / 1000 % 60), (int)(ms % 1000));
+    return buf;
+}
+
+wxThread::ExitCode ConverterThread::RunThumbnails() {
+    Log("Generating thumbnails...");
+    const int count = std::max(1, m_profile.thumb_count);
+    const bool png = m_profile.thumb_png;
+    const AVPixelFormat fmt = png ? AV_PIX_FMT_RGB24 : AV_PIX_FMT_YUVJ420P;
+    const std::string ext = png ? ".png" : ".jpg";
+    const std::string base = output_base_path(m_input);
+
+    // the stream a re-encode would encode (stream rules applied, cover art skipped), picked once
+    // here for the sizes and the workers
+    AVFormatContext* in_ctx = nullptr;
+    int w = 0, h = 0, vidx = -1;
+    double duration = 0;
+    if (avformat_open_input(&in_ctx, m_input.c_str(), NULL, NULL) >= 0 && avformat_find_stream_info(in_ctx, NULL) >= 0) {
+        apply_stream_selection(in_ctx, m_profile.stream_rules);
+        vidx = main_video_stream(in_ctx);
+        if (vidx >= 0 && in_ctx->duration > 0) {
+            AVCodecParameters* par = in_ctx->streams[vidx]->codecpar;
+            AVRational sar = par->sample_aspect_ratio.num > 0 ? par->sample_aspect_ratio : AVRational{1, 1};
+            w = m_profile.thumb_width & ~1;
+            h = (int)(w * par->height / (par->width * av_q2d(sar))) & ~1;
+            duration = in_ctx->duration / (double)AV_TIME_BASE;
+        }
+    }
+    avformat_close_input(&in_ctx);
+    if (w <= 0 || h <= 0) {
+        Log("Thumbnails need a video stream with known duration");
+        NotifyFinished();
+        return (wxThread::ExitCode)0;
+    }
+
+    std::vector<Thumbnail> thumbs(count);
+    int workers = std::min(count, std::max(1, wxThread::GetCPUCount()));
+    std::vector<std::thread> pool;
+    std::atomic<bool> stop{false};
+    std::atomic<int> running{workers};
+    for (int k = 0; k < workers; ++k) {
+        std::vector<int> points;
+        for (int i = k; i < count; i += workers) points.push_back(i);
+        pool.emplace_back([&, points]() { decode_thumbnails(m_input, vidx, points, count, w, h, fmt, &thumbs, &stop); running--; });
+    }
+    // cancellation can only be polled from this thread
+    while (running.load() > 0) {
+        if (!stop.load() && IsCancelled()) stop.store(true);
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    }
+    for (std::thread& t : pool) t.join();
+    if (stop.load()) {
+        Log("Thumbnail generation cancelled");
+        for (Thumbnail& t : thumbs) av_frame_free(&t.frame);
+        NotifyFinished();
+        return (wxThread::ExitCode)0;
+    }
+    PostProgress(60);
+
+    // neighbouring points that decoded the same keyframe would give duplicate images and
+    // zero-length cues
+    std::vector<const Thumbnail*> kept;
+    for (const Thumbnail& t : thumbs) {
+        if (!t.frame) continue;
+        if (!kept.empty() && t.pts != AV_NOPTS_VALUE && t.pts == kept.back()->pts) continue;
+        kept.push_back(&t);
+    }
+    if ((int)kept.size() < count)
+        Log(std::to_string(count - (int)kept.size()) + " of " + std::to_string(count)
+            + " thumbnail points skipped (nothing decoded, or the same keyframe as the point before)");
+
+    // individual images + sprite sheet (columns x rows grid, unused cells black)
+    const int shown = std::max(1, (int)kept.size());
+    const int cols = std::max(1, std::min(m_profile.thumb_columns, shown));
+    const int rows = (shown + cols - 1) / cols;
+    AVFrame* sheet = av_frame_alloc();
+    sheet->format = fmt; sheet->width = cols * w; sheet->height = rows * h;
+    av_frame_get_buffer(sheet, 32);
+    const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get(fmt);
+    for (int p = 0; p < (png ? 1 : 3); ++p) {
+        int ph = p ? sheet->height >> desc->log2_chroma_h : sheet->height;
+        memset(sheet->data[p], p ? 128 : 0, (size_t)sheet->linesize[p] * ph);
+    }
+
+    int written = 0;
+    std::ostringstream vtt;
+    vtt << "WEBVTT\n\n";
+    std::string sprite_name = base + "_sprite" + ext;
+    std::string sprite_file = sprite_name.substr(sprite_name.find_last_of("/\\") + 1);
+    for (int i = 0; i < (int)kept.size(); ++i) {
+        const Thumbnail& t = *kept[i];
+        char idx[16];
+        snprintf(idx, sizeof(idx), "_thumb_%03d", i + 1);
+        if (write_image(t.frame, png, base + idx + ext) >= 0) written++;
+
+        int x = (i % cols) * w, y = (i / cols) * h;
+        for (int p = 0; p < (png ? 1 : 3); ++p) {
+            int sx = p ? desc->log2_chroma_w : 0, sy = p ? desc->log2_chroma_h : 0;
+            int bytes = png ? 3 * w : (w >> sx);
+            int px = png ? 3 * x : (x >> sx);
+            av_image_copy_plane(sheet->data[p] + (y >> sy) * sheet->linesize[p] + px, sheet->linesize[p],
+                                t.frame->data[p], t.frame->linesize[p], bytes, h >> sy);
+        }
+        double next = i + 1 < (int)kept.size() ? kept[i + 1]->time : duration;
+        vtt << vtt_timestamp(t.time) << " --> " << vtt_timestamp(std::max(next, t.time)) << "\n"
+            << sprite_file << "#xywh=" << x << "," << y << "," << w << "," << h << "\n\n";
+    }
+    PostProgress(90);
+
+    if (written > 0 && write_image(sheet, png, sprite_name) >= 0) {
+        std::ofstream(base + "_sprite.vtt", std::ios::trunc) << vtt.str();
+        Log("Wrote " + std::to_string(written) + " thumbnails, sprite sheet " + sprite_name + " and WebVTT index");
+    } else {
+        Log("Thumbnail generation failed");
+    }
+    PostProgress(100);
+
+    av_frame_free(&sheet);
+    for (Thumbnail& t : thumbs) av_frame_free(&t.frame);
+    NotifyFinished();
+    return (wxThread::ExitCode)0;
+}
+
+// Thumbnail tap on a running re-encode: Offer() is called for every decoded frame and picks one
+// every `thumb_tap_interval` seconds or on a scene change (mean luma difference of a 16x16 sample
+// grid against the previous frame). Picked frames are referenced/copied into a short queue that a
+// side thread scales and writes as images; when the queue is full the frame is dropped rather
+// than making the encode loop wait.
+class ThumbnailTap {
+public:
+    enum { kQueueDepth = 4, kGrid = 16 };
+
+    ThumbnailTap(const std::string& base, const EncodeProfile& prof)
+        : m_base(base), m_prof(prof), m_thread(&ThumbnailTap::Run, this) {}
+    ~ThumbnailTap() { Finish(); }
+
+    void Offer(const AVFrame* frame, double secs) {
+        bool scene = m_prof.thumb_scene_threshold > 0 && SceneChanged(frame);
+        bool due = m_last < 0 || secs - m_last >= m_prof.thumb_tap_interval;
+        if (!due && !(scene && secs - m_last >= 1.0)) return;
+        m_last = secs;
+        std::lock_guard<std::mutex> lk(m_lock);
+        if (m_queue.size() >= kQueueDepth) { m_dropped++; return; }
+        AVFrame* copy = av_frame_clone(frame); // shares refcounted decoder buffers, copies ring frames
+        if (!copy) { m_dropped++; return; }
+        m_queue.push_back({copy, secs});
+        m_cv.notify_one();
+    }
+
+    // Stop accepting frames, write what is queued and join the side thread.
+    void Finish() {
+        {
+            std::lock_guard<std::mutex> lk(m_lock);
+            if (m_done) return;
+            m_done = true;
+        }
+        m_cv.notify_one();
+        m_thread.join();
+    }
+
+    int Written() const { return m_written; }
+    int Dropped() const { return m_dropped; }
+
+private:
+    bool SceneChanged(const AVFrame* f) {
+        const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get((AVPixelFormat)f->format);
+        if (!desc || (desc->flags & AV_PIX_FMT_FLAG_HWACCEL) || desc->comp[0].depth > 8) return false;
+        uint8_t sig[kGrid * kGrid];
+        for (int gy = 0; gy < kGrid; ++gy)
+            for (int gx = 0; gx < kGrid; ++gx)
+                sig[gy * kGrid + gx] = f->data[0][(int64_t)((2 * gy + 1) * f->height / (2 * kGrid)) * f->linesize[0]
+                                                  + (2 * gx + 1) * f->width / (2 * kGrid) * desc->comp[0].step];
+        bool changed = false;
+        if (m_haveSig) {
+            int diff = 0;
+            for (int i = 0; i < kGrid * kGrid; ++i) diff += std::abs(sig[i] - m_sig[i]);
+            changed = diff / (kGrid * kGrid) >= m_prof.thumb_scene_threshold;
+        }
+        memcpy(m_sig, sig, sizeof(sig));
+        m_haveSig = true;
+        return changed;
+    }
+
+    void Run() {
+        const bool png = m_prof.thumb_png;
+        const AVPixelFormat fmt = png ? AV_PIX_FMT_RGB24 : AV_PIX_FMT_YUVJ420P;
+        struct SwsContext* sws = nullptr;
+        AVFrame* out = nullptr;
+        while (true) {
+            std::pair<AVFrame*, double> item;
+            {
+                std::unique_lock<std::mutex> lk(m_lock);
+                m_cv.wait(lk, [&] { return m_done || !m_queue.empty(); });
+                if (m_queue.empty()) break;
+                item = m_queue.front();
+                m_queue.pop_front();
+            }
+            AVFrame* f = item.first;
+            AVRational sar = f->sample_aspect_ratio.num > 0 ? f->sample_aspect_ratio : AVRational{1, 1};
+            int w = m_prof.thumb_width & ~1;
+            int h = (int)(w * f->height / (f->width * av_q2d(sar))) & ~1;
+            if (!out || out->width != w || out->height != h) {
+                av_frame_free(&out);
+                out = av_frame_alloc();
+                out->format = fmt; out->width = w; out->height = h;
+                if (h <= 0 || av_frame_get_buffer(out, 32) < 0) av_frame_free(&out);
+            }
+            sws = sws_getCachedContext(sws, f->width, f->height, (AVPixelFormat)f->format,
+                                       w, h, fmt, SWS_BILINEAR, NULL, NULL, NULL);
+            if (out && sws) {
+                set_scaler_colorspace(sws, frame_sws_colorspace(f), frame_full_range(f), SWS_CS_ITU601, true);
+                sws_scale_frame(sws, out, f);
+                char name[32];
+                snprintf(name, sizeof(name), "_tap_%03d_%07.1fs", m_written + 1, item.second);
+                if (write_image(out, png, m_base + name + (png ? ".png" : ".jpg")) >= 0) m_written++;
+            }
+            av_frame_free(&f);
+        }
+        av_frame_free(&out);
+        sws_freeContext(sws);
+    }
+
+    std::string m_base;
+    EncodeProfile m_prof;
+    std::mutex m_lock;
+    std::condition_variable m_cv;
+    std::deque<std::pair<AVFrame*, double>> m_queue;
+    bool m_done = false;
+    int m_written = 0;       // side thread only until Finish()
+    int m_dropped = 0;
+    double m_last = -1;
+    uint8_t m_sig[kGrid * kGrid];
+    bool m_haveSig = false;
+    std::thread m_thread;    // last: starts after the members above are initialized
+};
+
+// The main converter thread entry. Depending on m_reencode it will either remux (stream copy)
+// or decode->encode the video stream (H.264) while copying other streams.
+wxThread::ExitCode ConverterThread::Entry() {
+    if (m_mode == JobMode::Estimate) return RunEstimate();
+    if (m_mode == JobMode::Calibrate) return RunCalibration();
+    if (m_mode == JobMode::Distributed) return RunDistributed();
+    if (m_mode == JobMode::Thumbnails) return RunThumbnails();
+
+    Log(m_reencode ? "Starting encoding conversion..." : "Starting remux (stream-copy) conversion...");
+
+    const char* in_filename = m_input.c_str();
+    std::string out_filename = make_output_path(m_input, m_outFormat, m_reencode && m_profile.draft);
+
+    std::string dedup_key;
+    if (ReuseFinishedJob(out_filename, &dedup_key)) {
+        NotifyFinished();
+        return (wxThread::ExitCode)0;
+    }
+
+    AVFormatContext* in_ctx = nullptr;
+    AVFormatContext* out_ctx = nullptr;
+    int ret = 0;
+    bool completed = false;
+
+    // Open input
+    ret = avformat_open_input(&in_ctx, in_filename, NULL, NULL);
+    if (ret < 0) {
+        char errbuf[256]; av_strerror(ret, errbuf, sizeof(errbuf));
+        Log(std::string("Failed to open input: ") + errbuf);
+        NotifyFinished();
+        return (wxThread::ExitCode)0;
+    }
+
+    if ((ret = avformat_find_stream_info(in_ctx, NULL)) < 0) {
+        Log("Failed to find stream info");
+        avformat_close_input(&in_ctx);
+        NotifyFinished();
+        return 0;
+    }
+    if (int dropped = apply_stream_selection(in_ctx, m_profile.stream_rules))
+        Log("Stream selection: dropping " + std::to_string(dropped) + " of " + std::to_string(in_ctx->nb_streams) + " streams");
+
+    // Audio transcoding (profile audio_codec) and additional video streams run one thread per
+    // track; all muxing goes through mux_write so their packets and the job's own are serialized.
+    AudioTracks audio(in_ctx->nb_streams);
+    VideoTracks video(in_ctx->nb_streams); // re-encode only: video streams besides the main one
+    FrameTimestamps timestamps;            // re-encode only: main video stream
+    Deinterlacer deinterlacer;             // re-encode only: main video stream, when interlaced
+    ToneMapper tonemapper;                 // re-encode only: main video stream, when HDR
+    EncoderInput input;                    // re-encode only: main video stream
+    FramePool frame_pool;                  // re-encode only: main video decoder buffers
+    InterlaceProbe interlace_probe;        // re-encode only: holds the first frames when field order is unknown
+    CopyFilters copy_filters(in_ctx->nb_streams);
+    std::mutex mux_lock;
+    auto mux_write = [&](AVPacket* p) {
+        std::lock_guard<std::mutex> lk(mux_lock);
+        return av_interleaved_write_frame(out_ctx, p);
+    };
+
+    // Transcoded tracks are always metered and the results cached by input fingerprint. With
+    // loudnorm the cached value sets the gain; an unseen input gets an audio-only analysis first.
+    std::string audio_fp;
+    auto prepare_audio = [&]() -> bool {
+        if (audio.Empty()) return true;
+        audio_fp = input_fingerprint(m_input, m_profile.fingerprint_keyframes);
+        std::vector<std::string> report;
+        bool cached = !m_profile.loudnorm || audio.ApplyCachedLoudness(audio_fp, m_profile.loudness_target, m_profile.true_peak_limit, &report);
+        if (!cached) {
+            Log("Measuring loudness (audio-only pass)...");
+            int ret = audio_fp.empty() ? AVERROR(EINVAL)
+                                       : analyze_loudness(m_input, m_profile, audio_fp, [this] { return IsCancelled(); }, &report);
+            if (ret == AVERROR_EXIT) { Log("Conversion cancelled"); return false; }
+            if (ret < 0) { Log("Loudness analysis failed"); return false; }
+            audio.ApplyCachedLoudness(audio_fp, m_profile.loudness_target, m_profile.true_peak_limit, &report);
+        }
+        for (const std::string& line : report) Log(line);
+        return true;
+    };
+    auto finish_audio = [&]() -> bool {
+        std::vector<std::string> report;
+        bool ok = audio.Finish(&report) >= 0;
+        if (ok) audio.StoreLoudness(audio_fp, &report);
+        for (const std::string& line : report) Log(line);
+        return ok;
+    };
+
+    // If no re-encode requested -> perform simple remux (stream copy)
+    if (!m_reencode) {
+        avformat_alloc_output_context2(&out_ctx, NULL, container_muxer(m_outFormat).c_str(), out_filename.c_str());
+        if (!out_ctx) {
+            Log("Could not create output context (unsupported format?)");
+            avformat_close_input(&in_ctx);
+            NotifyFinished();
+            return 0;
+        }
+
+        std::vector<int> stream_mapping(in_ctx->nb_streams, -1);
+        int stream_index = 0;
+        for (unsigned i = 0; i < in_ctx->nb_streams; ++i) {
+            AVStream* in_stream = in_ctx->streams[i];
+            if (in_stream->discard == AVDISCARD_ALL) continue; // deselected
+            AVStream* out_stream = avformat_new_stream(out_ctx, NULL);
+            if (!out_stream) {
+                Log("Failed allocating output stream");
+                ret = AVERROR_UNKNOWN; break;
+            }
+            if (AudioTracks::Wanted(in_stream, m_profile, out_ctx->oformat)) {
+                std::string err;
+                ret = audio.Add(in_stream, out_stream, out_ctx, m_profile, &err);
+                if (ret < 0) { Log("Audio transcode setup failed: " + err); break; }
+                stream_mapping[i] = stream_index++;
+                continue;
+            }
+            if (!container_accepts(out_ctx->oformat, in_stream->codecpar)) {
+                Log("Stream " + std::to_string(i) + " (" + avcodec_get_name(in_stream->codecpar->codec_id) + ") cannot be stored in "
+                    + m_outFormat + "; re-encode it or deselect it");
+                ret = AVERROR(EINVAL); break;
+            }
+            std::string bsf;
+            ret = copy_filters.Init(in_stream, in_ctx, out_ctx, out_stream->codecpar, &bsf);
+            if (ret < 0) { Log("Failed to copy codec parameters"); break; }
+            if (!bsf.empty()) Log("Stream " + std::to_string(i) + ": applying " + bsf);
+            out_stream->codecpar->codec_tag = 0;
+            stream_mapping[i] = stream_index++;
+        }
+
+        if (ret < 0) {
+            avformat_close_input(&in_ctx);
+            if (out_ctx) avformat_free_context(out_ctx);
+            NotifyFinished();
+            return 0;
+        }
+        if (!prepare_audio()) {
+            avformat_close_input(&in_ctx);
+            avformat_free_context(out_ctx);
+            NotifyFinished();
+            return 0;
+        }
+
+        if (!(out_ctx->oformat->flags & AVFMT_NOFILE)) {
+            ret = avio_open(&out_ctx->pb, out_filename.c_str(), AVIO_FLAG_WRITE);
+            if (ret < 0) {
+                char errbuf[256]; av_strerror(ret, errbuf, sizeof(errbuf));
+                Log(std::string("Could not open output file: ") + errbuf);
+                avformat_close_input(&in_ctx);
+                avformat_free_context(out_ctx);
+                NotifyFinished();
+                return 0;
+            }
+        }
+
+        ret = write_container_header(out_ctx, m_outFormat, m_profile);
+        if (ret < 0) {
+            Log("Error occurred when writing header");
+            if (!(out_ctx->oformat->flags & AVFMT_NOFILE)) avio_closep(&out_ctx->pb);
+            avformat_close_input(&in_ctx);
+            avformat_free_context(out_ctx);
+            NotifyFinished();
+            return 0;
+        }
+
+        // Extra containers get the same packets; transcoded audio is encoded once and fanned out too.
+        ContainerMirrors mirrors;
+        std::vector<bool> encoded(in_ctx->nb_streams, false);
+        std::vector<int> out_to_in(out_ctx->nb_streams, -1);
+        for (unsigned i = 0; i < in_ctx->nb_streams; ++i) {
+            encoded[i] = audio.For(i) != nullptr;
+            if (stream_mapping[i] >= 0) out_to_in[stream_mapping[i]] = i;
+        }
+        if (!m_profile.extra_formats.empty())
+            mirrors.Open(m_profile.extra_formats, m_input, out_filename, in_ctx, out_ctx, stream_mapping, encoded, m_profile,
+                         [this](const std::string& s) { Log(s); });
+        auto fan_out = [&](AVPacket* p) -> int {
+            if (!mirrors.Empty()) {
+                int out_index = p->stream_index;
+                p->stream_index = out_to_in[out_index];
+                int ret = mirrors.Push(p);
+                p->stream_index = out_index;
+                if (ret < 0) return ret;
+            }
+            return mux_write(p);
+        };
+        audio.Start(fan_out);
+
+        // Copied streams are rescaled into the time bases the header fixed
+        PacketDispatch dispatch(in_ctx->nb_streams, mux_write);
+        for (unsigned i = 0; i < in_ctx->nb_streams; ++i) {
+            if (stream_mapping[i] < 0) continue;
+            if (AudioTranscoder* track = audio.For(i)) dispatch.Queue(i, track, "Audio transcoding failed");
+            else dispatch.Copy(i, stream_mapping[i], in_ctx->streams[i]->time_base,
+                               out_ctx->streams[stream_mapping[i]]->time_base, &copy_filters, &mirrors);
+        }
+
+        // Progress and cancellation are checked once per kRemuxBatch packets; high packet rate
+        // inputs (small audio packets, subtitles) would otherwise flood the GUI with events.
+        const int64_t kRemuxBatch = 256;
+        int64_t packets = 0;
+        int last_pct = -1;
+        auto remux_t0 = std::chrono::steady_clock::now();
+        AVPacket pkt;
+        completed = true;
+        while (true) {
+            ret = av_read_frame(in_ctx, &pkt);
+            if (ret == AVERROR_EOF) break;
+            if (ret < 0) { Log("Error reading input"); completed = false; break; }
+            packets++;
+            int index = pkt.stream_index;
+            int64_t pts = pkt.pts;
+            if (dispatch(&pkt) < 0) {
+                if (const char* what = dispatch.Failure(index)) Log(what);
+                completed = false;
+                break;
+            }
+
+            if (packets % kRemuxBatch != 0) continue;
+            // approximate progress if duration known
+            if (in_ctx->duration > 0 && pts != AV_NOPTS_VALUE && index < (int)in_ctx->nb_streams) {
+                int pct = (int)((pts * av_q2d(in_ctx->streams[index]->time_base) * AV_TIME_BASE) * 100 / in_ctx->duration);
+                if (pct < 0) pct = 0; if (pct > 100) pct = 100;
+                if (pct != last_pct) PostProgress(last_pct = pct);
+            }
+
+            if (IsCancelled()) { Log("Conversion cancelled"); completed = false; break; }
+        }
+        double remux_secs = seconds_since(remux_t0);
+        if (completed) PostProgress(100);
+        if (remux_secs > 0) {
+            char rate[128];
+            snprintf(rate, sizeof(rate), "Remuxed %lld packets in %.2f s (%.0f packets/s)", (long long)packets, remux_secs, packets / remux_secs);
+            Log(rate);
+        }
+
+        if (completed && dispatch.Flush(&copy_filters) < 0) { Log("Error muxing packet"); completed = false; }
+        if (!finish_audio()) { Log("Audio transcoding failed"); completed = false; }
+        if (mirrors.Finish() < 0) { Log("Error writing an extra output"); completed = false; }
+        av_write_trailer(out_ctx);
+        if (!(out_ctx->oformat->flags & AVFMT_NOFILE)) avio_closep(&out_ctx->pb);
+        avformat_close_input(&in_ctx);
+        avformat_free_context(out_ctx);
+        if (completed) RecordFinishedJob(dedup_key, out_filename);
+
+        Log(std::string("Remux finished. Output: ") + out_filename);
+        for (const std::string& path : mirrors.Paths()) Log("Also written: " + path);
+        NotifyFinished();
+        return (wxThread::ExitCode)0;
+    }
+
+    // ---- re-encode path (video -> H.264), copy other streams ----
+    if (!m_profile.extra_formats.empty()) Log("Extra output containers are only written by remux jobs");
+    // The first video stream is encoded on this thread; further ones get their own workers.
+    int video_stream_index = main_video_stream(in_ctx);
+    if (m_status) m_status->video_stream.store(video_stream_index >= 0 ? video_stream_index : -2); // for the decode worker
+    if (video_stream_index < 0) {
+        Log("No video stream found for re-encoding");
+        avformat_close_input(&in_ctx);
+        NotifyFinished();
+        return 0;
+    }
+
+    // Open decoder for input video stream
+    const AVCodec* dec = avcodec_find_decoder(in_ctx->streams[video_stream_index]->codecpar->codec_id);
+    if (!dec) { Log("Decoder not found"); avformat_close_input(&in_ctx); NotifyFinished(); return 0; }
+    AVCodecContext* dec_ctx = avcodec_alloc_context3(dec);
+    avcodec_parameters_to_context(dec_ctx, in_ctx->streams[video_stream_index]->codecpar);
+    apply_decoder_profile(dec_ctx, dec, m_profile);
+    if (m_profile.frame_pool) frame_pool.Attach(dec_ctx);
+    if ((ret = avcodec_open2(dec_ctx, dec, NULL)) < 0) { Log("Failed to open decoder"); avcodec_free_context(&dec_ctx); avformat_close_input(&in_ctx); NotifyFinished(); return 0; }
+
+    // Interlacing: the stream's field_order decides when stated, else the first decoded frames
+    // do (InterlaceProbe); a deinterlacer goes in front of the scaler if needed
+    const AVFieldOrder field_order = in_ctx->streams[video_stream_index]->codecpar->field_order;
+    auto start_deinterlacer = [&](const InterlaceInfo& il) {
+        if ((m_profile.deinterlace > 0 || il.interlaced) &&
+            deinterlacer.Init(dec_ctx->width, dec_ctx->height, dec_ctx->pix_fmt, il.top_field_first, m_profile.sws_threads) < 0)
+            Log(std::string("Deinterlacing not supported for ") + av_get_pix_fmt_name(dec_ctx->pix_fmt) + "; encoding as is");
+    };
+    if (m_profile.deinterlace != 0) {
+        InterlaceInfo il;
+        if (InterlaceProbe::FromFieldOrder(field_order, &il)) {
+            Log(field_order_summary(il));
+            start_deinterlacer(il);
+        } else {
+            interlace_probe.Start();
+        }
+    }
+    if ((ret = tonemapper.Init(dec_ctx, m_profile, m_profile.sws_threads)) < 0) { Log("Failed to set up tone mapping"); avcodec_free_context(&dec_ctx); avformat_close_input(&in_ctx); NotifyFinished(); return 0; }
+    if (tonemapper.Active()) Log("HDR tone mapping: " + tonemapper.Describe());
+    else if (hdr_transfer(dec_ctx->color_trc)) Log("HDR source encoded without tone mapping");
+
+    // Create output context and add streams: video will be encoded, others copied
+    avformat_alloc_output_context2(&out_ctx, NULL, container_muxer(m_outFormat).c_str(), out_filename.c_str());
+    if (!out_ctx) { Log("Could not create output context"); avcodec_free_context(&dec_ctx); avformat_close_input(&in_ctx); NotifyFinished(); return 0; }
+
+    std::vector<int> stream_mapping(in_ctx->nb_streams, -1);
+    int out_stream_cnt = 0;
+    for (unsigned i = 0; i < in_ctx->nb_streams; ++i) {
+        AVStream* in_stream = in_ctx->streams[i];
+        if (in_stream->discard == AVDISCARD_ALL) continue; // deselected
+        if ((int)i == video_stream_index) {
+            // create placeholder stream for encoded video
+            AVStream* out_stream = avformat_new_stream(out_ctx, NULL);
+            if (!out_stream) { Log("Failed allocating output video stream"); ret = AVERROR_UNKNOWN; break; }
+            stream_mapping[i] = out_stream_cnt++;
+        } else if (AudioTracks::Wanted(in_stream, m_profile, out_ctx->oformat)) {
+            AVStream* out_stream = avformat_new_stream(out_ctx, NULL);
+            if (!out_stream) { Log("Failed allocating output audio stream"); ret = AVERROR_UNKNOWN; break; }
+            std::string err;
+            ret = audio.Add(in_stream, out_stream, out_ctx, m_profile, &err);
+            if (ret < 0) { Log("Audio transcode setup failed: " + err); break; }
+            stream_mapping[i] = out_stream_cnt++;
+        } else if (VideoTracks::Wanted(in_stream, video_stream_index)) {
+            AVStream* out_stream = avformat_new_stream(out_ctx, NULL);
+            if (!out_stream) { Log("Failed allocating output video stream"); ret = AVERROR_UNKNOWN; break; }
+            std::string err;
+            ret = video.Add(in_stream, out_stream, guess_video_framerate(in_ctx, i), m_profile, &err);
+            if (ret < 0) { Log("Video stream " + std::to_string(i) + " setup failed: " + err); break; }
+            stream_mapping[i] = out_stream_cnt++;
+        } else {
+            AVStream* out_stream = avformat_new_stream(out_ctx, NULL);
+            if (!out_stream) { Log("Failed allocating output stream"); ret = AVERROR_UNKNOWN; break; }
+            if (!container_accepts(out_ctx->oformat, in_stream->codecpar)) {
+                Log("Stream " + std::to_string(i) + " (" + avcodec_get_name(in_stream->codecpar->codec_id) + ") cannot be stored in "
+                    + m_outFormat + "; deselect it");
+                ret = AVERROR(EINVAL); break;
+            }
+            std::string bsf;
+            ret = copy_filters.Init(in_stream, in_ctx, out_ctx, out_stream->codecpar, &bsf);
+            if (ret < 0) { Log("Failed to copy codec parameters for non-video stream"); break; }
+            if (!bsf.empty()) Log("Stream " + std::to_string(i) + ": applying " + bsf);
+            out_stream->codecpar->codec_tag = 0;
+            stream_mapping[i] = out_stream_cnt++;
+        }
+    }
+    if (ret < 0) { avformat_close_input(&in_ctx); avformat_free_context(out_ctx); avcodec_free_context(&dec_ctx); NotifyFinished(); return 0; }
+    if (!prepare_audio()) { avformat_close_input(&in_ctx); avformat_free_context(out_ctx); avcodec_free_context(&dec_ctx); NotifyFinished(); return 0; }
+
+    // Setup and open the video encoder (options like preset come from the profile)
+    AVRational framerate = guess_video_framerate(in_ctx, video_stream_index);
+    AVCodecContext* enc_ctx = nullptr;
+    ret = open_video_encoder(dec_ctx, framerate, m_profile, &enc_ctx, in_ctx->streams[video_stream_index]->time_base);
+    if (ret == AVERROR_ENCODER_NOT_FOUND) { Log("Video encoder not found"); avformat_close_input(&in_ctx); avformat_free_context(out_ctx); avcodec_free_context(&dec_ctx); NotifyFinished(); return 0; }
+    if (ret < 0) { Log("Failed to open encoder"); avformat_free_context(out_ctx); avcodec_free_context(&dec_ctx); avformat_close_input(&in_ctx); NotifyFinished(); return 0; }
+
+    timestamps.Init(in_ctx->streams[video_stream_index]->time_base, enc_ctx->time_base, framerate, m_profile.cfr);
+
+    // Copy encoder params to output video stream
+    AVStream* out_video_stream = out_ctx->streams[ stream_mapping[video_stream_index] ];
+    avcodec_parameters_from_context(out_video_stream->codecpar, enc_ctx);
+    out_video_stream->time_base = enc_ctx->time_base;
+
+    // Open output file
+    if (!(out_ctx->oformat->flags & AVFMT_NOFILE)) {
+        ret = avio_open(&out_ctx->pb, out_filename.c_str(), AVIO_FLAG_WRITE);
+        if (ret < 0) { char errbuf[256]; av_strerror(ret, errbuf, sizeof(errbuf)); Log(std::string("Could not open output file: ") + errbuf); avcodec_free_context(&enc_ctx); avformat_free_context(out_ctx); avcodec_free_context(&dec_ctx); avformat_close_input(&in_ctx); NotifyFinished(); return 0; }
+    }
+
+    // Write header
+    ret = write_container_header(out_ctx, m_outFormat, m_profile);
+    if (ret < 0) { Log("Error occurred when writing header"); if (!(out_ctx->oformat->flags & AVFMT_NOFILE)) avio_closep(&out_ctx->pb); avcodec_free_context(&enc_ctx); avformat_free_context(out_ctx); avcodec_free_context(&dec_ctx); avformat_close_input(&in_ctx); NotifyFinished(); return 0; }
+    audio.Start(mux_write);
+    video.Start(mux_write);
+
+    // Allocate frames/packets
+    AVFrame* frame = av_frame_alloc();
+    AVPacket* pkt = av_packet_alloc();
+    AVPacket* enc_pkt = av_packet_alloc();
+
+    // Split-process mode: a decode worker publishes decoded frames in a shared-memory ring
+    ShmFrameRing* ring = nullptr;
+    ThumbnailTap* tap = nullptr;
+    if (!m_frameRing.empty()) {
+        ring = new ShmFrameRing();
+        if (!ring->Open(m_frameRing, 10000, m_status)) {
+            Log("Could not attach to the decode worker's frame ring");
+            goto cleanup;
+        }
+        if (ring->Width() != dec_ctx->width || ring->Height() != dec_ctx->height || ring->Format() != dec_ctx->pix_fmt) {
+            Log("Decode worker frame format does not match the input");
+            goto cleanup;
+        }
+    }
+    if (m_profile.thumb_tap) tap = new ThumbnailTap(output_base_path(m_input), m_profile);
+
+    // Prepare the pixel format conversion (none when the decoded frames already suit the encoder)
+    if (input.Init(dec_ctx, enc_ctx, m_profile) < 0) {
+        Log("Could not create scaler");
+        goto cleanup;
+    }
+    Log("Encoder input: " + input.Describe(dec_ctx, enc_ctx));
+
+    {
+    // Convert one decoded frame to the encoder's format, encode it and mux the resulting packets.
+    // Logs and returns a negative value on error.
+    auto encode_picture = [&](AVFrame* frame) -> int {
+        int64_t ts = frame->best_effort_timestamp != AV_NOPTS_VALUE ? frame->best_effort_timestamp : frame->pts;
+        int64_t enc_pts = timestamps.Next(ts);
+        if (enc_pts == AV_NOPTS_VALUE) return 0; // overlaps the previous frame in CFR output
+        if (tonemapper.Active() && tonemapper.Apply(frame, &frame) < 0) { Log("Tone mapping failed"); return AVERROR(ENOMEM); }
+        if (tap && ts != AV_NOPTS_VALUE) {
+            const AVStream* vs = in_ctx->streams[video_stream_index];
+            int64_t start = vs->start_time != AV_NOPTS_VALUE ? vs->start_time : 0; // MPEG-TS clocks rarely start at 0
+            tap->Offer(frame, (ts - start) * av_q2d(vs->time_base));
+        }
+
+        // Convert pixel format to encoder's format
+        AVFrame* enc_frame = nullptr;
+        int ret = input.Convert(frame, &enc_frame);
+        if (ret < 0) { Log("Pixel format conversion failed"); return ret; }
+        enc_frame->pts = enc_pts;
+
+        // send to encoder
+        ret = avcodec_send_frame(enc_ctx, enc_frame);
+        if (ret < 0) { Log("Error sending frame to encoder"); return ret; }
+
+        while (ret >= 0) {
+            ret = avcodec_receive_packet(enc_ctx, enc_pkt);
+            if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) break;
+            else if (ret < 0) { Log("Error during encoding"); return ret; }
+
+            // rescale and write
+            av_packet_rescale_ts(enc_pkt, enc_ctx->time_base, out_video_stream->time_base);
+            enc_pkt->stream_index = out_video_stream->index; // use stream index assigned by avformat
+            ret = mux_write(enc_pkt);
+            av_packet_unref(enc_pkt);
+            if (ret < 0) { Log("Error muxing encoded packet"); return ret; }
+        }
+
+        // progress (approx)
+        if (in_ctx->duration > 0 && ts != AV_NOPTS_VALUE) {
+            int pct = (int)((ts * av_q2d(in_ctx->streams[video_stream_index]->time_base) * AV_TIME_BASE) * 100 / in_ctx->duration);
+            if (pct < 0) pct = 0; if (pct > 100) pct = 100;
+            PostProgress(pct);
+        }
+
+        if (IsCancelled()) { Log("Conversion cancelled"); return AVERROR_EXIT; }
+        return 0;
+    };
+
+    // Frames pass through the deinterlacer (one frame behind the input) when it is active
+    auto filter_frame = [&](AVFrame* frame) -> int {
+        if (!deinterlacer.Active()) return encode_picture(frame);
+        AVFrame* out = nullptr;
+        int ret = deinterlacer.Filter(frame, &out);
+        if (ret < 0) { Log("Deinterlacing failed"); return ret; }
+        return ret > 0 ? encode_picture(out) : 0;
+    };
+
+    // Settle interlacing from the probed frames (a sampling pass only if they are inconclusive),
+    // then encode them
+    auto finish_probe = [&]() -> int {
+        InterlaceInfo il;
+        if (interlace_probe.Decide(field_order, &il) || m_profile.deinterlace > 0) {
+            Log(interlace_summary(il) + " (first frames)");
+        } else if (detect_interlace(m_input, video_stream_index, m_profile, &il) >= 0) {
+            Log(interlace_summary(il));
+        }
+        start_deinterlacer(il);
+        return interlace_probe.Replay(filter_frame);
+    };
+
+    auto encode_frame = [&](AVFrame* frame) -> int {
+        if (!interlace_probe.Pending()) return filter_frame(frame);
+        int ret = interlace_probe.Add(frame);
+        if (ret < 0) { Log("Out of memory"); return ret; }
+        return ret > 0 ? finish_probe() : 0;
+    };
+
+    // Encode ring frames presented up to `due` (stream time base; AV_NOPTS_VALUE = until EOF).
+    // The frames are used in place in shared memory and released after encoding.
+    auto encode_ring_frames = [&](int64_t due) -> int {
+        int64_t pts;
+        int ret;
+        while ((ret = ring->Peek(&pts, m_status)) == 0) {
+            if (due != AV_NOPTS_VALUE && pts != AV_NOPTS_VALUE && pts > due) return 0;
+            ring->Map(frame);
+            ret = encode_frame(frame);
+            ring->Release();
+            if (ret < 0) return ret;
+        }
+        if (ret == AVERROR_EOF) return 0;
+        Log("Decode worker stopped delivering frames");
+        return ret;
+    };
+
+    // Main video stream: decode here, or (split-process mode) encode the decode worker's frames
+    // at the pace of the demuxed video packets. Errors are logged here.
+    std::function<int(AVPacket*)> main_video;
+    if (ring) {
+        main_video = [&](AVPacket* p) -> int {
+            int64_t due = p->dts != AV_NOPTS_VALUE ? p->dts : p->pts;
+            av_packet_unref(p);
+            return due != AV_NOPTS_VALUE ? encode_ring_frames(due) : 0;
+        };
+    } else {
+        main_video = [&](AVPacket* p) -> int {
+            int ret = avcodec_send_packet(dec_ctx, p);
+            av_packet_unref(p);
+            if (ret < 0) { Log("Error sending packet to decoder"); return ret; }
+            while (true) {
+                ret = avcodec_receive_frame(dec_ctx, frame);
+                if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) return 0;
+                if (ret < 0) { Log("Error during decoding"); return ret; }
+                if ((ret = encode_frame(frame)) < 0) return ret;
+            }
+        };
+    }
+
+    // Copied streams are rescaled into the time bases the header fixed
+    PacketDispatch dispatch(in_ctx->nb_streams, mux_write);
+    for (unsigned i = 0; i < in_ctx->nb_streams; ++i) {
+        if (stream_mapping[i] < 0) continue;
+        if ((int)i == video_stream_index) dispatch.Custom(i, &main_video);
+        else if (AudioTranscoder* track = audio.For(i)) dispatch.Queue(i, track, "Audio transcoding failed");
+        else if (VideoTranscoder* track = video.For(i)) dispatch.Queue(i, track, "Video transcoding failed");
+        else dispatch.Copy(i, stream_mapping[i], in_ctx->streams[i]->time_base,
+                           out_ctx->streams[stream_mapping[i]]->time_base, &copy_filters);
+    }
+
+    // Read packets and process
+    while (true) {
+        ret = av_read_frame(in_ctx, pkt);
+        if (ret == AVERROR_EOF) break;
+        if (ret < 0) { Log("Error reading input"); goto cleanup; }
+
+        int index = pkt->stream_index;
+        if (dispatch(pkt) < 0) {
+            if (const char* what = dispatch.Failure(index)) Log(what);
+            goto cleanup;
+        }
+    }
+    if (ring && encode_ring_frames(AV_NOPTS_VALUE) < 0) goto cleanup;
+    if (interlace_probe.Pending() && finish_probe() < 0) goto cleanup;
+    if (deinterlacer.Active()) {
+        AVFrame* out = nullptr;
+        if (deinterlacer.Filter(nullptr, &out) > 0 && encode_picture(out) < 0) goto cleanup;
+    }
+    if (dispatch.Flush(&copy_filters) < 0) { Log("Error muxing packet for non-video stream"); goto cleanup; }
+    }
+
+    // flush encoder
+    avcodec_send_frame(enc_ctx, NULL);
     while (true) {
         ret = avcodec_receive_packet(enc_ctx, enc_pkt);
         if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) break;
         else if (ret < 0) { Log("Error flushing encoder"); break; }
         av_packet_rescale_ts(enc_pkt, enc_ctx->time_base, out_video_stream->time_base);
         enc_pkt->stream_index = out_video_stream->index;
-        av_interleaved_write_frame(out_ctx, enc_pkt);
+        mux_write(enc_pkt);
         av_packet_unref(enc_pkt);
     }
+    if (!timestamps.Report().empty()) Log("Video timestamps repaired: " + timestamps.Report());
+    if (frame_pool.Frames() > 0) Log(frame_pool.Report());
+    if (!finish_audio()) { Log("Audio transcoding failed"); goto cleanup; }
+    {
+        std::vector<std::string> report;
+        bool ok = video.Finish(&report) >= 0;
+        for (const std::string& line : report) Log(line);
+        if (!ok) { Log("Video transcoding failed"); goto cleanup; }
+    }
 
-    av_write_trailer(out_ctx);
+    if (av_write_trailer(out_ctx) >= 0) completed = true;
 
 cleanup:
+    audio.Abort(); // stops the worker threads before the muxer goes away
+    video.Abort();
+    delete ring;
+    if (tap) {
+        tap->Finish();
+        Log("Thumbnail tap wrote " + std::to_string(tap->Written()) + " images ("
+            + std::to_string(tap->Dropped()) + " frames dropped while the writer was busy)");
+        delete tap;
+    }
     av_frame_free(&frame);
-    av_frame_free(&sws_frame);
     av_packet_free(&pkt);
     av_packet_free(&enc_pkt);
-    sws_freeContext(sws_ctx);
 
     avcodec_free_context(&dec_ctx);
     avcodec_free_context(&enc_ctx);
@@ -528,18 +6100,57 @@ cleanup:
     }
     avformat_close_input(&in_ctx);
 
-    m_handler->setRunning(false);
+    if (completed) RecordFinishedJob(dedup_key, out_filename);
+    NotifyFinished();
     Log(std::string("Conversion finished. Output: ") + out_filename);
     return (wxThread::ExitCode)0;
 }
 
 class MyApp : public wxApp {
 public:
+    // Worker processes are headless: they only get wxAppConsole's initialization, so they neither
+    // need nor connect to a display.
+    virtual bool Initialize(int& ac, wxChar** av) override {
+        wxString mode = ac >= 3 ? wxString(av[1]) : wxString();
+        // `--worker <shm-name> [--decode]`: headless job process spawned by the GUI
+        if (mode == "--worker") {
+            m_workerShm = std::string(wxString(av[2]).mb_str());
+            m_decodeWorker = ac >= 4 && wxString(av[3]) == "--decode";
+        }
+        // `--chunk-worker host:port` (token in kChunkTokenEnv): distributed chunk encoding node
+        if (mode == "--chunk-worker") {
+            m_chunkEndpoint = std::string(wxString(av[2]).mb_str());
+            if (const char* token = getenv(kChunkTokenEnv)) m_chunkToken = token;
+        }
+        return Headless() ? wxAppConsole::Initialize(ac, av) : wxApp::Initialize(ac, av);
+    }
+
+    virtual void CleanUp() override {
+        if (Headless()) wxAppConsole::CleanUp();
+        else wxApp::CleanUp();
+    }
+
     virtual bool OnInit() override {
+        if (Headless()) return true;
         MainFrame* f = new MainFrame();
         f->Show(true);
+        f->CalibrateIfNeeded();
         return true;
     }
+
+    virtual int OnRun() override {
+        if (!m_workerShm.empty()) return run_worker(m_workerShm, m_decodeWorker);
+        if (!m_chunkEndpoint.empty()) return run_chunk_worker(m_chunkEndpoint, m_chunkToken);
+        return wxApp::OnRun();
+    }
+
+private:
+    bool Headless() const { return !m_workerShm.empty() || !m_chunkEndpoint.empty(); }
+
+    std::string m_workerShm;
+    std::string m_chunkEndpoint;
+    std::string m_chunkToken;
+    bool m_decodeWorker = false;
 };
 
 wxIMPLEMENT_APP(MyApp);